@@ -258,6 +258,34 @@ static const unsigned rewind_buffer_size = 20 << 20; // 20MiB
 // How many frames to rewind at a time.
 static const unsigned rewind_granularity = 1;
 
+// Stores a full state in the rewind buffer every N states, so long rewind jumps don't have to replay every delta. 0 disables.
+static const unsigned rewind_keyframe_interval = 600;
+
+// How many seconds the rewind jump hotkey rewinds.
+static const unsigned rewind_jump_seconds = 5;
+
+// Computes rewind deltas on a separate thread, so only serialization is done on the main thread.
+static const bool rewind_async = false;
+
+// Adapts the rewind granularity at runtime, between rewind_granularity and rewind_granularity_max.
+// States are pushed less often when serializing and pushing them costs more than rewind_adaptive_budget of a frame,
+// or when deltas are too big for rewind_adaptive_seconds of history to fit in the rewind buffer.
+static const bool rewind_adaptive = false;
+static const unsigned rewind_granularity_max = 8;
+static const float rewind_adaptive_budget = 0.1;
+static const unsigned rewind_adaptive_seconds = 60;
+
+// Size limit of each game's rewind spill file, if rewind_spill_directory is set. The oldest history in it is dropped to stay within it.
+static const unsigned rewind_spill_size = 1024 << 20; // 1GiB
+
+// Recorded movies store a save state every N frames, so playback can seek without running every frame before. 0 disables.
+// Movies with save states in them can't be played back by older versions, so this is off by default. 3600 is a good value.
+static const unsigned movie_checkpoint_interval = 0;
+
+// Recorded movies pack each frame's input into bitmasks, and store repeated frames as a count.
+// Such movies can't be played back by older versions, so this is off by default.
+static const bool movie_pack_input = false;
+
 // Pause gameplay when gameplay loses focus.
 static const bool pause_nonactive = false;
 
@@ -267,6 +295,29 @@ static const unsigned autosave_interval = 0;
 // When being client over netplay, use keybinds for player 1 rather than player 2.
 static const bool netplay_client_swap_input = true;
 
+// How netplay guesses the other player's input until it arrives. A wrong guess costs a rollback.
+// "repeat" repeats their last input, "hold" learns how long they tend to hold and release each button,
+// "pattern" looks for their last few inputs in earlier play and repeats what came next.
+static const char *netplay_prediction = "repeat";
+
+// Frames netplay waits before local input takes effect. Input is sent that much ahead of time,
+// so the other player has to predict it less often, at the cost of the delay. Up to 10.
+static const unsigned netplay_input_delay = 0;
+// Picks the input delay from the round trip time instead, using netplay_input_delay as the most it may pick if set.
+static const bool netplay_input_delay_auto = false;
+
+// If one side of netplay runs ahead of the other, it waits out a frame now and then so the other can catch up.
+// Otherwise the side that's ahead keeps predicting, and rolling back.
+static const bool netplay_time_sync = true;
+
+// Every this many frames, both sides of netplay compare a hash of their save state. If they differ, the host sends its state over.
+// Hashes are kept up to date from the deltas netplay stores anyway, so this is cheap. 0 disables it.
+static const unsigned netplay_check_frames = 60;
+
+// Interval in seconds at which netplay dumps RTT, jitter, packet loss, stall and rollback histograms.
+// They go to netplay_telemetry_path if it is set, otherwise to the log. A value of 0 only dumps totals on exit.
+static const unsigned netplay_telemetry_interval = 0;
+
 // On save state load, block SRAM from being overwritten.
 // This could potentially lead to buggy games.
 static const bool block_sram_overwrite = false;
@@ -331,6 +382,7 @@ static const struct snes_keybind snes_keybinds_1[] = {
    { true, SSNES_MUTE,                       SK_F9,     NO_BTN,      AXIS_NONE },
    { true, SSNES_NETPLAY_FLIP,               SK_i,      NO_BTN,      AXIS_NONE },
    { true, SSNES_SLOWMOTION,                 SK_e,      NO_BTN,      AXIS_NONE },
+   { true, SSNES_REWIND_JUMP,                SK_UNKNOWN, NO_BTN,     AXIS_NONE },
 };
 
 // Player 2-5
@@ -59,6 +59,7 @@ enum
    SSNES_MUTE,
    SSNES_NETPLAY_FLIP,
    SSNES_SLOWMOTION,
+   SSNES_REWIND_JUMP,
 
 #ifdef SSNES_CONSOLE
    SSNES_CHEAT_INPUT,
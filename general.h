@@ -160,6 +160,14 @@ struct settings
       bool netplay_client_swap_input;
    } input;
 
+   char netplay_prediction[32];
+   unsigned netplay_input_delay;
+   bool netplay_input_delay_auto;
+   bool netplay_time_sync;
+   unsigned netplay_check_frames;
+   unsigned netplay_telemetry_interval;
+   char netplay_telemetry_path[PATH_MAX];
+
    char libsnes[PATH_MAX];
    char cheat_database[PATH_MAX];
    char cheat_settings_path[PATH_MAX];
@@ -169,6 +177,18 @@ struct settings
    bool rewind_enable;
    size_t rewind_buffer_size;
    unsigned rewind_granularity;
+   unsigned rewind_keyframe_interval;
+   unsigned rewind_jump_seconds;
+   bool rewind_async;
+   bool rewind_adaptive;
+   unsigned rewind_granularity_max;
+   float rewind_adaptive_budget;
+   unsigned rewind_adaptive_seconds;
+   char rewind_spill_directory[PATH_MAX];
+   size_t rewind_spill_size;
+
+   unsigned movie_checkpoint_interval;
+   bool movie_pack_input;
 
    float slowmotion_ratio;
 
@@ -361,7 +381,7 @@ struct global
 
    // Rewind support.
    state_manager_t *state_manager;
-   void *state_buf;
+   unsigned rewind_granularity; // Granularity in use. Differs from g_settings.rewind_granularity in adaptive mode.
    size_t state_size;
    bool frame_is_reverse;
 
@@ -377,7 +397,31 @@ struct global
       char movie_start_path[PATH_MAX];
       bool movie_start_recording;
       bool movie_start_playback;
+      unsigned movie_seek_frame;
       bool movie_end;
+
+      // Headless playback, as fast as the core runs, without drivers.
+      bool movie_headless;
+      char movie_hash_path[PATH_MAX];
+      unsigned movie_hash_interval;
+      struct
+      {
+         FILE *hash_file;
+         unsigned frame;
+         unsigned frames;
+         int64_t start_time;
+
+         // CRC32 of the current frame's output, and of the frame hashes since the last line and since the start.
+         uint32_t frame_video;
+         uint32_t frame_audio;
+         uint32_t video;
+         uint32_t audio;
+         uint32_t total_video;
+         uint32_t total_audio;
+
+         uint16_t audio_buf[2048];
+         size_t audio_ptr;
+      } replay;
    } bsv;
 #endif
 
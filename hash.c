@@ -248,12 +248,17 @@ uint32_t crc32_adjust(uint32_t crc32, uint8_t input)
    return ((crc32 >> 8) & 0x00ffffff) ^ crc32_table[(crc32 ^ input) & 0xff];
 }
 
-uint32_t crc32_calculate(const uint8_t *data, size_t length)
+uint32_t crc32_update(uint32_t crc32, const uint8_t *data, size_t length)
 {
-   uint32_t crc32 = ~0;
+   crc32 = ~crc32;
    for (size_t i = 0; i < length; i++)
       crc32 = crc32_adjust(crc32, data[i]);
    return ~crc32;
 }
+
+uint32_t crc32_calculate(const uint8_t *data, size_t length)
+{
+   return crc32_update(0, data, length);
+}
 #endif
 
@@ -35,9 +35,16 @@ static inline uint32_t crc32_adjust(uint32_t crc, uint8_t data)
 {
    return crc32(crc, &data, 1);
 }
+
+// Continues crc, as returned by crc32_calculate(), with more data.
+static inline uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t length)
+{
+   return crc32(crc, data, length);
+}
 #else
 uint32_t crc32_calculate(const uint8_t *data, size_t length);
 uint32_t crc32_adjust(uint32_t crc, uint8_t data);
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t length);
 #endif
 
 #endif
@@ -22,79 +22,514 @@
 #include <string.h>
 #include "general.h"
 #include "dynamic.h"
+#include "rewind.h"
+
+#ifdef HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Recorded input is written out on a thread of its own where we can. Consoles lack timed condition waits.
+#if defined(HAVE_THREADS) && !defined(SSNES_CONSOLE)
+#define HAVE_BSV_THREAD
+#include "thread.h"
+#endif
+
+// Recorded input is written to disk once this much has piled up.
+#define BSV_FLUSH_SIZE (64 * 1024)
+// The flush thread also writes out whatever there is this often, so little is lost if we crash.
+#define BSV_FLUSH_INTERVAL_MS 1000
+
+// BSV2 is BSV1 with BSV2_MAGIC and flags in SERIALIZER_INDEX.
+// With BSV2_FLAG_PACKED_INPUT, input is stored a frame at a time, each starting with a varint:
+// (n << 2) | (ones << 1): a frame of n words, with a bitmask of the words that aren't zero. Unless ones is set,
+// a zigzag varint for each of those follows. Otherwise they're all 1, which is what buttons return.
+// (n << 1) | 1: the frame before repeated n more times. It always follows a frame of the former kind.
+// The file is followed by a trailer written when recording stops:
+// [checkpoints][{u32 frame, u32 input offset, u32 checkpoint offset, u32 checkpoint size} per checkpoint]
+// [u32 index offset][u32 checkpoints][u32 end of input][u32 BSV_INDEX_MAGIC]
+// A checkpoint is the save state at the start of its frame, stored as a delta from the initial state (see rewind.h).
+// Fields other than magic values are little endian.
+// A recording that was cut short has no trailer, so its input runs to the end of the file.
+#define BSV_INDEX_MAGIC 0x42535649
+#define BSV_INDEX_ENTRY_SIZE (4 * sizeof(uint32_t))
+#define BSV_FOOTER_SIZE (4 * sizeof(uint32_t))
+// Head varint, bitmask and a 3 byte varint per word.
+#define BSV_MAX_FRAME_SIZE(words) (5 + ((words) + 7) / 8 + (words) * 3)
+// Keeps the run count in a frame_run entry. Longer runs store the frame again.
+#define BSV_MAX_REPEAT 1024
+
+struct bsv_checkpoint
+{
+   uint32_t frame;
+   uint32_t pos; // Input of the frame starts here.
+   uint8_t *data; // Points into the movie for playback, owned when recording.
+   size_t size;
+};
 
 struct bsv_movie
 {
    FILE *file;
+   char path[PATH_MAX];
    uint8_t *state;
    size_t state_size;
 
+   // The whole movie, header included, so positions in it are file offsets.
+   // Playback maps or loads the file. Recording keeps everything in memory and writes it out as it goes.
+   uint8_t *data;
+   size_t size; // Playback: size of the file. Recording: size of the allocation.
+   size_t pos;
+   bool mapped;
+
    size_t *frame_pos; // A ring buffer keeping track of positions in the file for each frame.
    size_t frame_mask;
    size_t frame_ptr;
+   // Packed input: frame_pos holds the offset of the stored frame, and frame_run how many repeats of it we're into.
+   uint16_t *frame_run;
+
+   // Packed input, a frame at a time.
+   bool packed;
+   struct
+   {
+      int16_t *words; // This frame.
+      size_t count;
+      size_t cap;
+      size_t read;
+
+      // Recording: the last stored frame, repeats of it not stored yet.
+      int16_t *prev;
+      size_t prev_count;
+      size_t prev_cap;
+      bool prev_valid;
+
+      size_t base; // Offset of the stored frame the current one comes from.
+      unsigned run; // Repeats of it so far.
+      unsigned run_left; // Playback: repeats still to come.
+      bool ended; // Playback.
+   } input;
 
    bool playback;
    size_t min_file_pos;
+   size_t end; // Playback: end of the input.
 
    bool first_rewind;
    bool did_rewind;
+
+   unsigned frame; // Frames since the start of the movie.
+   // Rewinding stops here. Seeking moves it.
+   unsigned start_frame;
+   size_t start_pos;
+
+   // Oldest first. Recording takes one every checkpoint_interval frames.
+   struct bsv_checkpoint *checkpoints;
+   size_t num_checkpoints;
+   size_t checkpoints_cap;
+   unsigned checkpoint_interval;
+
+   // Checkpoints are packed against base, the initial state, padded to whole words.
+   uint32_t *base;
+   uint32_t *scratch;
+   size_t state_words;
+
+   // Recording only. data up to flushed is on disk. Whoever writes the file may only read data up to end,
+   // the rest can still change. Rewinding moves both back.
+   struct
+   {
+      size_t flushed;
+      size_t end;
+      size_t file_pos;
+      size_t file_size; // Stale input past the end is cut off when we're done.
+      bool failed;
+
+#ifdef HAVE_BSV_THREAD
+      // The thread writes out a copy, so the emulator only waits on it for a memcpy.
+      uint8_t *copy;
+      size_t copy_size;
+
+      sthread_t *thread;
+      slock_t *lock;
+      scond_t *cond;
+      bool quit;
+#endif
+   } flush;
 };
 
+static void movie_lock(bsv_movie_t *handle)
+{
+#ifdef HAVE_BSV_THREAD
+   if (handle->flush.thread)
+      slock_lock(handle->flush.lock);
+#endif
+}
+
+static void movie_unlock(bsv_movie_t *handle)
+{
+#ifdef HAVE_BSV_THREAD
+   if (handle->flush.thread)
+      slock_unlock(handle->flush.lock);
+#endif
+}
+
+static bool load_movie(bsv_movie_t *handle, const char *path)
+{
+#ifdef HAVE_MMAP
+   int fd = open(path, O_RDONLY);
+   if (fd >= 0)
+   {
+      struct stat st;
+      if (fstat(fd, &st) == 0 && st.st_size > 0)
+      {
+         void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+         if (map != MAP_FAILED)
+         {
+            handle->data = (uint8_t*)map;
+            handle->size = st.st_size;
+            handle->mapped = true;
+         }
+      }
+      close(fd);
+
+      if (handle->mapped)
+         return true;
+   }
+#endif
+
+   FILE *file = fopen(path, "rb");
+   if (!file)
+      return false;
+
+   fseek(file, 0, SEEK_END);
+   long len = ftell(file);
+   rewind(file);
+
+   bool ret = len >= 0 && (handle->data = (uint8_t*)malloc(len ? len : 1)) &&
+      fread(handle->data, 1, len, file) == (size_t)len;
+   handle->size = ret ? len : 0;
+   fclose(file);
+   return ret;
+}
+
+static size_t write_varint(uint8_t *out, uint32_t v)
+{
+   size_t len = 0;
+   while (v >= 0x80)
+   {
+      out[len++] = (uint8_t)(v | 0x80);
+      v >>= 7;
+   }
+   out[len++] = (uint8_t)v;
+   return len;
+}
+
+static bool read_varint(const uint8_t **in, const uint8_t *end, uint32_t *value)
+{
+   const uint8_t *ptr = *in;
+   uint32_t v = 0;
+   unsigned shift = 0;
+   do
+   {
+      if (ptr >= end || shift > 28)
+         return false;
+      v |= (uint32_t)(*ptr & 0x7f) << shift;
+      shift += 7;
+   } while (*ptr++ & 0x80);
+
+   *in = ptr;
+   *value = v;
+   return true;
+}
+
+// Doesn't trust its input, as it comes from a file.
+static bool unpack_checkpoint(uint32_t *state, const uint32_t *base, size_t words, const uint8_t *packed, size_t size)
+{
+   memcpy(state, base, words * sizeof(uint32_t));
+   return state_delta_apply_checked(state, words, packed, size);
+}
+
+static bool init_checkpoint_states(bsv_movie_t *handle, const uint8_t *state)
+{
+   handle->state_words = (handle->state_size + 3) >> 2;
+   handle->base = (uint32_t*)calloc(handle->state_words, sizeof(uint32_t));
+   handle->scratch = (uint32_t*)calloc(handle->state_words, sizeof(uint32_t));
+   if (!handle->base || !handle->scratch)
+      return false;
+
+   memcpy(handle->base, state, handle->state_size);
+   return true;
+}
+
+// Finds the checkpoints of a BSV2 movie. Without them playback still works, but seeking has to run from the start.
+static void load_index(bsv_movie_t *handle)
+{
+   handle->end = handle->size;
+   if (handle->size - handle->min_file_pos < BSV_FOOTER_SIZE)
+      goto error;
+
+   uint32_t footer[4];
+   memcpy(footer, handle->data + handle->size - BSV_FOOTER_SIZE, sizeof(footer));
+   if (swap_if_little32(footer[3]) != BSV_INDEX_MAGIC)
+      goto error;
+
+   size_t index = swap_if_big32(footer[0]);
+   size_t count = swap_if_big32(footer[1]);
+   size_t end = swap_if_big32(footer[2]);
+   size_t index_end = handle->size - BSV_FOOTER_SIZE;
+   if (end < handle->min_file_pos || end > index || index > index_end ||
+         (index_end - index) % BSV_INDEX_ENTRY_SIZE || (index_end - index) / BSV_INDEX_ENTRY_SIZE != count)
+      goto error;
+
+   if (count && !(handle->checkpoints = (struct bsv_checkpoint*)calloc(count, sizeof(*handle->checkpoints))))
+      goto error;
+
+   for (size_t i = 0; i < count; i++)
+   {
+      uint32_t entry[4];
+      memcpy(entry, handle->data + index + i * BSV_INDEX_ENTRY_SIZE, sizeof(entry));
+
+      struct bsv_checkpoint *checkpoint = &handle->checkpoints[i];
+      checkpoint->frame = swap_if_big32(entry[0]);
+      checkpoint->pos = swap_if_big32(entry[1]);
+      size_t offset = swap_if_big32(entry[2]);
+      checkpoint->size = swap_if_big32(entry[3]);
+      checkpoint->data = handle->data + offset;
+
+      if ((i && checkpoint->frame <= checkpoint[-1].frame) ||
+            checkpoint->pos < handle->min_file_pos || checkpoint->pos > end ||
+            offset < end || offset > index || checkpoint->size > index - offset)
+         goto error;
+   }
+
+   handle->num_checkpoints = count;
+   handle->end = end;
+   return;
+
+error:
+   SSNES_WARN("Movie has no valid checkpoint index, so seeking will run from the start. Recording was probably cut short.\n");
+   free(handle->checkpoints);
+   handle->checkpoints = NULL;
+   handle->end = handle->size;
+}
+
 static bool init_playback(bsv_movie_t *handle, const char *path)
 {
    handle->playback = true;
-   handle->file = fopen(path, "rb");
-   if (!handle->file)
+   if (!load_movie(handle, path))
    {
       SSNES_ERR("Couldn't open BSV file \"%s\" for playback.\n", path);
       return false;
    }
 
    uint32_t header[4] = {0};
-   if (fread(header, sizeof(uint32_t), 4, handle->file) != 4)
+   if (handle->size < sizeof(header))
    {
       SSNES_ERR("Couldn't read movie header.\n");
       return false;
    }
+   memcpy(header, handle->data, sizeof(header));
 
    // Compatibility with old implementation that used incorrect documentation.
-   if (swap_if_little32(header[MAGIC_INDEX]) != BSV_MAGIC && swap_if_big32(header[MAGIC_INDEX]) != BSV_MAGIC)
+   bool bsv2 = swap_if_little32(header[MAGIC_INDEX]) == BSV2_MAGIC;
+   if (!bsv2 && swap_if_little32(header[MAGIC_INDEX]) != BSV_MAGIC && swap_if_big32(header[MAGIC_INDEX]) != BSV_MAGIC)
    {
-      SSNES_ERR("Movie file is not a valid BSV1 file.\n");
+      SSNES_ERR("Movie file is not a valid BSV1 or BSV2 file.\n");
       return false;
    }
 
    if (swap_if_big32(header[CRC_INDEX]) != g_extern.cart_crc)
       SSNES_WARN("CRC32 checksum mismatch between ROM file and saved ROM checksum in replay file header; replay highly likely to desync on playback.\n");
 
+   if (bsv2)
+   {
+      uint32_t flags = swap_if_big32(header[SERIALIZER_INDEX]);
+      if (flags & ~BSV2_FLAG_PACKED_INPUT)
+      {
+         SSNES_ERR("Movie file uses features this version doesn't support.\n");
+         return false;
+      }
+      handle->packed = flags & BSV2_FLAG_PACKED_INPUT;
+   }
+
    uint32_t state_size = swap_if_big32(header[STATE_SIZE_INDEX]);
 
    if (state_size)
    {
-      handle->state = (uint8_t*)malloc(state_size);
-      handle->state_size = state_size;
-      if (!handle->state)
-         return false;
-
-      if (fread(handle->state, 1, state_size, handle->file) != state_size)
+      if (handle->size - sizeof(header) < state_size)
       {
          SSNES_ERR("Couldn't read state from movie.\n");
          return false;
       }
 
       if (psnes_serialize_size() == state_size)
-         psnes_unserialize(handle->state, state_size);
+         psnes_unserialize(handle->data + sizeof(header), state_size);
       else
          SSNES_WARN("Movie format seems to have a different serializer version. Will most likely fail.\n");
    }
 
+   handle->state_size = state_size;
    handle->min_file_pos = sizeof(header) + state_size;
+   handle->pos = handle->min_file_pos;
+   handle->end = handle->size;
+
+   if (bsv2)
+   {
+      load_index(handle);
+      if (handle->num_checkpoints && !init_checkpoint_states(handle, handle->data + sizeof(header)))
+         return false;
+   }
 
    return true;
 }
 
+// Writes data to the file at offset. Only one thread does this at a time.
+static void write_file(bsv_movie_t *handle, size_t offset, const uint8_t *data, size_t size)
+{
+   if (!size || handle->flush.failed)
+      return;
+
+   if (offset != handle->flush.file_pos)
+      fseek(handle->file, offset, SEEK_SET);
+
+   if (fwrite(data, 1, size, handle->file) != size || fflush(handle->file) != 0)
+   {
+      SSNES_ERR("Failed to write movie. Disk might be full.\n");
+      handle->flush.failed = true;
+      return;
+   }
+
+   handle->flush.file_pos = offset + size;
+   if (handle->flush.file_size < handle->flush.file_pos)
+      handle->flush.file_size = handle->flush.file_pos;
+}
+
+#ifdef HAVE_BSV_THREAD
+static void flush_thread(void *data)
+{
+   bsv_movie_t *handle = (bsv_movie_t*)data;
+
+   for (;;)
+   {
+      slock_lock(handle->flush.lock);
+      while (!handle->flush.quit && handle->flush.end - handle->flush.flushed < BSV_FLUSH_SIZE)
+      {
+         if (!scond_wait_timeout(handle->flush.cond, handle->flush.lock, BSV_FLUSH_INTERVAL_MS))
+            break;
+      }
+
+      bool quit = handle->flush.quit;
+      size_t offset = handle->flush.flushed;
+      size_t size = handle->flush.end - offset;
+
+      if (size > handle->flush.copy_size)
+      {
+         uint8_t *copy = (uint8_t*)realloc(handle->flush.copy, size);
+         if (copy)
+         {
+            handle->flush.copy = copy;
+            handle->flush.copy_size = size;
+         }
+         else
+            size = handle->flush.copy_size;
+      }
+
+      memcpy(handle->flush.copy, handle->data + offset, size);
+      handle->flush.flushed = offset + size;
+      slock_unlock(handle->flush.lock);
+
+      write_file(handle, offset, handle->flush.copy, size);
+      if (quit && handle->flush.flushed == handle->flush.end)
+         break;
+   }
+}
+
+static bool init_flush_thread(bsv_movie_t *handle)
+{
+   if (!(handle->flush.lock = slock_new()) || !(handle->flush.cond = scond_new()))
+      return false;
+
+   handle->flush.thread = sthread_create(flush_thread, handle);
+   return handle->flush.thread;
+}
+
+static void deinit_flush_thread(bsv_movie_t *handle)
+{
+   if (handle->flush.thread)
+   {
+      slock_lock(handle->flush.lock);
+      handle->flush.quit = true;
+      scond_signal(handle->flush.cond);
+      slock_unlock(handle->flush.lock);
+      sthread_join(handle->flush.thread);
+      handle->flush.thread = NULL;
+   }
+
+   if (handle->flush.lock)
+      slock_free(handle->flush.lock);
+   if (handle->flush.cond)
+      scond_free(handle->flush.cond);
+   free(handle->flush.copy);
+
+   handle->flush.lock = NULL;
+   handle->flush.cond = NULL;
+   handle->flush.copy = NULL;
+   handle->flush.copy_size = 0;
+}
+#endif
+
+// Makes what has been recorded so far available for writing, and writes it if we don't have a thread for it.
+static void flush_record(bsv_movie_t *handle, bool force)
+{
+#ifdef HAVE_BSV_THREAD
+   if (handle->flush.thread)
+   {
+      slock_lock(handle->flush.lock);
+      handle->flush.end = handle->pos;
+      if (handle->flush.end - handle->flush.flushed >= BSV_FLUSH_SIZE)
+         scond_signal(handle->flush.cond);
+      slock_unlock(handle->flush.lock);
+      return;
+   }
+#endif
+
+   handle->flush.end = handle->pos;
+   if (force || handle->flush.end - handle->flush.flushed >= BSV_FLUSH_SIZE)
+   {
+      write_file(handle, handle->flush.flushed, handle->data + handle->flush.flushed, handle->flush.end - handle->flush.flushed);
+      handle->flush.flushed = handle->flush.end;
+   }
+}
+
+static bool reserve_record(bsv_movie_t *handle, size_t size)
+{
+   if (handle->pos + size <= handle->size)
+      return true;
+
+   size_t new_size = handle->size * 2;
+   while (new_size < handle->pos + size)
+      new_size *= 2;
+
+   movie_lock(handle);
+   uint8_t *data = (uint8_t*)realloc(handle->data, new_size);
+   if (data)
+   {
+      handle->data = data;
+      handle->size = new_size;
+   }
+   movie_unlock(handle);
+
+   if (!data && !handle->flush.failed)
+   {
+      SSNES_ERR("Failed to allocate memory for movie.\n");
+      handle->flush.failed = true;
+   }
+   return data;
+}
+
 static bool init_record(bsv_movie_t *handle, const char *path)
 {
+   strlcpy(handle->path, path, sizeof(handle->path));
    handle->file = fopen(path, "wb");
    if (!handle->file)
    {
@@ -104,19 +539,32 @@ static bool init_record(bsv_movie_t *handle, const char *path)
 
    uint32_t header[4] = {0};
 
+   uint32_t state_size = psnes_serialize_size();
+
    // This value is supposed to show up as BSV1 in a HEX editor, big-endian.
-   header[MAGIC_INDEX] = swap_if_little32(BSV_MAGIC);
+   // Checkpoints and packed input make it BSV2, which older versions don't play back.
+   // Without save states there is nothing to checkpoint.
+   handle->checkpoint_interval = state_size ? g_settings.movie_checkpoint_interval : 0;
+   handle->packed = g_settings.movie_pack_input;
+   bool bsv2 = handle->checkpoint_interval || handle->packed;
+   header[MAGIC_INDEX] = swap_if_little32(bsv2 ? BSV2_MAGIC : BSV_MAGIC);
+   if (bsv2)
+      header[SERIALIZER_INDEX] = swap_if_big32(handle->packed ? BSV2_FLAG_PACKED_INPUT : 0);
 
    header[CRC_INDEX] = swap_if_big32(g_extern.cart_crc);
 
-   uint32_t state_size = psnes_serialize_size();
-
    header[STATE_SIZE_INDEX] = swap_if_big32(state_size);
-   fwrite(header, 4, sizeof(uint32_t), handle->file);
 
    handle->min_file_pos = sizeof(header) + state_size;
    handle->state_size = state_size;
 
+   handle->size = handle->min_file_pos + BSV_FLUSH_SIZE;
+   if (!(handle->data = (uint8_t*)malloc(handle->size)))
+      return false;
+
+   memcpy(handle->data, header, sizeof(header));
+   handle->pos = handle->min_file_pos;
+
    if (state_size)
    {
       handle->state = (uint8_t*)malloc(state_size);
@@ -124,37 +572,439 @@ static bool init_record(bsv_movie_t *handle, const char *path)
          return false;
 
       psnes_serialize(handle->state, state_size);
-      fwrite(handle->state, 1, state_size, handle->file);
+      memcpy(handle->data + sizeof(header), handle->state, state_size);
+   }
+
+   if (handle->checkpoint_interval && !init_checkpoint_states(handle, handle->state))
+      return false;
+
+   // The header goes to disk right away, so the file is valid from the start.
+   flush_record(handle, true);
+
+#ifdef HAVE_BSV_THREAD
+   if (!init_flush_thread(handle))
+   {
+      SSNES_WARN("Failed to start movie flush thread. Will write from the main thread.\n");
+      deinit_flush_thread(handle);
+   }
+#endif
+
+   return true;
+}
+
+static bool reserve_words(int16_t **words, size_t *cap, size_t count)
+{
+   if (count <= *cap)
+      return true;
+
+   size_t new_cap = *cap ? *cap * 2 : 64;
+   while (new_cap < count)
+      new_cap *= 2;
+
+   int16_t *new_words = (int16_t*)realloc(*words, new_cap * sizeof(int16_t));
+   if (!new_words)
+      return false;
+
+   *words = new_words;
+   *cap = new_cap;
+   return true;
+}
+
+// Decodes the stored frame at offset into input.words, and returns where the next record starts, or 0 if it's broken.
+static size_t read_frame(bsv_movie_t *handle, size_t offset, size_t end)
+{
+   const uint8_t *ptr = handle->data + offset;
+   const uint8_t *data_end = handle->data + end;
+
+   uint32_t head;
+   if (!read_varint(&ptr, data_end, &head) || (head & 1))
+      return 0;
+
+   size_t count = head >> 2;
+   bool ones = head & 2;
+   const uint8_t *mask = ptr;
+   if ((size_t)(data_end - ptr) < (count + 7) / 8)
+      return 0;
+   ptr += (count + 7) / 8;
+
+   if (!reserve_words(&handle->input.words, &handle->input.cap, count))
+      return 0;
+
+   for (size_t i = 0; i < count; i++)
+   {
+      uint32_t value = 0;
+      if (mask[i >> 3] & (1 << (i & 7)))
+      {
+         value = 1;
+         if (!ones)
+         {
+            uint32_t zigzag;
+            if (!read_varint(&ptr, data_end, &zigzag) || zigzag > 0xffff)
+               return 0;
+            value = (zigzag >> 1) ^ -(zigzag & 1);
+         }
+      }
+      handle->input.words[i] = (int16_t)value;
+   }
+
+   handle->input.count = count;
+   return ptr - handle->data;
+}
+
+// Reads the repeat record at offset into *repeats, and returns where the next record starts, or 0 if it isn't one.
+static size_t read_repeat(bsv_movie_t *handle, size_t offset, size_t end, unsigned *repeats)
+{
+   const uint8_t *ptr = handle->data + offset;
+   uint32_t head;
+   if (!read_varint(&ptr, handle->data + end, &head) || !(head & 1) || (head >> 1) == 0 || (head >> 1) > BSV_MAX_REPEAT)
+      return 0;
+
+   *repeats = head >> 1;
+   return ptr - handle->data;
+}
+
+// Playback: moves to the next frame. Returns false at the end of the movie.
+static bool next_frame(bsv_movie_t *handle)
+{
+   handle->input.read = 0;
+   if (handle->input.run_left)
+   {
+      handle->input.run_left--;
+      handle->input.run++;
+      return true;
    }
 
+   if (handle->pos >= handle->end)
+      return false;
+
+   unsigned repeats;
+   size_t next = read_repeat(handle, handle->pos, handle->end, &repeats);
+   if (next)
+   {
+      if (handle->input.run)
+         return false;
+
+      handle->input.run = 1;
+      handle->input.run_left = repeats - 1;
+   }
+   else
+   {
+      if (!(next = read_frame(handle, handle->pos, handle->end)))
+      {
+         SSNES_ERR("Movie input is corrupt at offset %u.\n", (unsigned)handle->pos);
+         return false;
+      }
+
+      handle->input.base = handle->pos;
+      handle->input.run = 0;
+   }
+
+   handle->pos = next;
    return true;
 }
 
+// Makes the next frame the one stored at base, run repeats into its run. Returns where recording continues from.
+static size_t seek_frame(bsv_movie_t *handle, size_t base, unsigned run)
+{
+   size_t end = handle->playback ? handle->end : handle->pos;
+
+   handle->input.count = 0;
+   handle->input.read = 0;
+   handle->input.run_left = 0;
+   handle->input.run = 0;
+   handle->input.prev_valid = false;
+   handle->input.ended = false;
+
+   if (!run)
+   {
+      handle->pos = base;
+      return base;
+   }
+
+   size_t next = read_frame(handle, base, end);
+   unsigned repeats = 0;
+   if (!next)
+      goto error;
+
+   handle->input.base = base;
+   if (!handle->playback)
+   {
+      // Whatever of the run came before this frame is recorded again when the run ends.
+      int16_t *words = handle->input.prev;
+      size_t cap = handle->input.prev_cap;
+      handle->input.prev = handle->input.words;
+      handle->input.prev_cap = handle->input.cap;
+      handle->input.prev_count = handle->input.count;
+      handle->input.prev_valid = true;
+      handle->input.words = words;
+      handle->input.cap = cap;
+      handle->input.count = 0;
+      handle->input.run = run - 1;
+      return handle->pos = next;
+   }
+
+   size_t after = read_repeat(handle, next, end, &repeats);
+   if (!after || run > repeats)
+      goto error;
+
+   handle->input.run = run - 1;
+   handle->input.run_left = repeats - run + 1;
+   return handle->pos = after;
+
+error:
+   SSNES_ERR("Movie input is corrupt at offset %u.\n", (unsigned)base);
+   handle->input.ended = true;
+   return handle->pos = base;
+}
+
+static void write_repeats(bsv_movie_t *handle)
+{
+   if (!handle->input.run || !reserve_record(handle, 5))
+      return;
+
+   handle->pos += write_varint(handle->data + handle->pos, (handle->input.run << 1) | 1);
+   handle->input.run = 0;
+}
+
+// Stores the frame in input.words, which becomes the one later frames can repeat.
+static void write_frame(bsv_movie_t *handle)
+{
+   size_t count = handle->input.count;
+   const int16_t *words = handle->input.words;
+   if (!reserve_record(handle, BSV_MAX_FRAME_SIZE(count)))
+      return;
+
+   bool ones = true;
+   for (size_t i = 0; i < count; i++)
+      ones &= words[i] == 0 || words[i] == 1;
+
+   handle->input.base = handle->pos;
+   uint8_t *ptr = handle->data + handle->pos;
+   ptr += write_varint(ptr, (count << 2) | (ones << 1));
+
+   uint8_t *mask = ptr;
+   memset(mask, 0, (count + 7) / 8);
+   ptr += (count + 7) / 8;
+
+   for (size_t i = 0; i < count; i++)
+   {
+      if (!words[i])
+         continue;
+
+      mask[i >> 3] |= 1 << (i & 7);
+      if (!ones)
+      {
+         int32_t value = words[i];
+         ptr += write_varint(ptr, ((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+      }
+   }
+
+   handle->pos = ptr - handle->data;
+
+   int16_t *prev = handle->input.prev;
+   size_t prev_cap = handle->input.prev_cap;
+   handle->input.prev = handle->input.words;
+   handle->input.prev_cap = handle->input.cap;
+   handle->input.prev_count = count;
+   handle->input.prev_valid = true;
+   handle->input.words = prev;
+   handle->input.cap = prev_cap;
+}
+
+// Recording: stores the frame just run, as a repeat of the one before if we can.
+static void end_frame(bsv_movie_t *handle)
+{
+   if (handle->input.prev_valid && handle->input.run < BSV_MAX_REPEAT &&
+         handle->input.count == handle->input.prev_count &&
+         !memcmp(handle->input.words, handle->input.prev, handle->input.count * sizeof(int16_t)))
+   {
+      handle->input.run++;
+   }
+   else
+   {
+      write_repeats(handle);
+      write_frame(handle);
+   }
+
+   handle->frame_pos[handle->frame_ptr] = handle->input.base;
+   handle->frame_run[handle->frame_ptr] = handle->input.run;
+   handle->input.count = 0;
+}
+
+// Appends the checkpoints and their index after the input.
+static void write_index(bsv_movie_t *handle)
+{
+   size_t index_size = handle->num_checkpoints * BSV_INDEX_ENTRY_SIZE + BSV_FOOTER_SIZE;
+   uint32_t *index = (uint32_t*)malloc(index_size);
+   if (!index)
+   {
+      SSNES_ERR("Failed to allocate movie index.\n");
+      return;
+   }
+
+   size_t offset = handle->flush.end;
+   size_t total = 0;
+   uint32_t *entry = index;
+   for (size_t i = 0; i < handle->num_checkpoints; i++, entry += 4)
+   {
+      const struct bsv_checkpoint *checkpoint = &handle->checkpoints[i];
+      write_file(handle, offset, checkpoint->data, checkpoint->size);
+
+      entry[0] = swap_if_big32(checkpoint->frame);
+      entry[1] = swap_if_big32(checkpoint->pos);
+      entry[2] = swap_if_big32(offset);
+      entry[3] = swap_if_big32(checkpoint->size);
+      offset += checkpoint->size;
+      total += checkpoint->size;
+   }
+
+   entry[0] = swap_if_big32(offset);
+   entry[1] = swap_if_big32(handle->num_checkpoints);
+   entry[2] = swap_if_big32(handle->flush.end);
+   entry[3] = swap_if_little32(BSV_INDEX_MAGIC);
+   write_file(handle, offset, (const uint8_t*)index, index_size);
+   free(index);
+
+   if (handle->num_checkpoints)
+   {
+      SSNES_LOG("Movie: stored %u checkpoints, %u KiB each on average.\n",
+            (unsigned)handle->num_checkpoints, (unsigned)(total / handle->num_checkpoints >> 10));
+   }
+}
+
+// Checkpoints are taken at the start of a frame, before any of its input is recorded.
+static void take_checkpoint(bsv_movie_t *handle)
+{
+   if (handle->num_checkpoints && handle->checkpoints[handle->num_checkpoints - 1].frame >= handle->frame)
+      return;
+
+   if (handle->num_checkpoints >= handle->checkpoints_cap)
+   {
+      size_t cap = handle->checkpoints_cap ? handle->checkpoints_cap * 2 : 64;
+      struct bsv_checkpoint *checkpoints = (struct bsv_checkpoint*)realloc(handle->checkpoints, cap * sizeof(*checkpoints));
+      if (!checkpoints)
+         return;
+      handle->checkpoints = checkpoints;
+      handle->checkpoints_cap = cap;
+   }
+
+   uint8_t *packed = (uint8_t*)malloc(STATE_DELTA_MAX_SIZE(handle->state_words));
+   if (!packed)
+      return;
+
+   if (handle->state_size & 3)
+      handle->scratch[handle->state_words - 1] = 0;
+   psnes_serialize((uint8_t*)handle->scratch, handle->state_size);
+   size_t size = state_delta_encode(packed, handle->base, handle->scratch, handle->state_words);
+
+   uint8_t *data = (uint8_t*)realloc(packed, size ? size : 1);
+   struct bsv_checkpoint *checkpoint = &handle->checkpoints[handle->num_checkpoints++];
+   checkpoint->frame = handle->frame;
+   checkpoint->pos = handle->pos;
+   checkpoint->data = data ? data : packed;
+   checkpoint->size = size;
+}
+
+// Rewinding while recording throws away the checkpoints of frames that will be recorded again.
+static void drop_checkpoints(bsv_movie_t *handle)
+{
+   while (handle->num_checkpoints && handle->checkpoints[handle->num_checkpoints - 1].frame > handle->frame)
+      free(handle->checkpoints[--handle->num_checkpoints].data);
+}
+
 void bsv_movie_free(bsv_movie_t *handle)
 {
    if (handle)
    {
       if (handle->file)
-         fclose(handle->file);
+      {
+         if (handle->packed)
+         {
+            write_repeats(handle);
+            SSNES_LOG("Movie: stored %u frames of input in %u bytes.\n",
+                  handle->frame, (unsigned)(handle->pos - handle->min_file_pos));
+         }
+
+         flush_record(handle, true);
+#ifdef HAVE_BSV_THREAD
+         deinit_flush_thread(handle);
+#endif
+
+         // Rewinding left input we don't want past the end. Rather than truncating, which stdio can't do, write it out again.
+         if (handle->flush.file_size > handle->flush.end && !handle->flush.failed)
+         {
+            fclose(handle->file);
+            handle->file = fopen(handle->path, "wb");
+            handle->flush.file_pos = 0;
+            if (handle->file)
+               write_file(handle, 0, handle->data, handle->flush.end);
+         }
+
+         if (handle->file && (handle->checkpoint_interval || handle->packed))
+            write_index(handle);
+
+         if (handle->file)
+            fclose(handle->file);
+
+         for (size_t i = 0; i < handle->num_checkpoints; i++)
+            free(handle->checkpoints[i].data);
+      }
+
+#ifdef HAVE_MMAP
+      if (handle->mapped)
+         munmap(handle->data, handle->size);
+      else
+#endif
+         free(handle->data);
+
       free(handle->state);
       free(handle->frame_pos);
+      free(handle->frame_run);
+      free(handle->input.words);
+      free(handle->input.prev);
+      free(handle->checkpoints);
+      free(handle->base);
+      free(handle->scratch);
       free(handle);
    }
 }
 
 bool bsv_movie_get_input(bsv_movie_t *handle, int16_t *input)
 {
-   if (fread(input, sizeof(int16_t), 1, handle->file) != 1)
+   if (handle->packed)
+   {
+      if (handle->input.ended)
+         return false;
+
+      // The core asking for more input than was recorded has desynced already.
+      *input = handle->input.read < handle->input.count ? handle->input.words[handle->input.read++] : 0;
+      return true;
+   }
+
+   if (handle->end - handle->pos < sizeof(int16_t))
       return false;
 
+   memcpy(input, handle->data + handle->pos, sizeof(int16_t));
+   handle->pos += sizeof(int16_t);
    *input = swap_if_big16(*input);
    return true;
 }
 
 void bsv_movie_set_input(bsv_movie_t *handle, int16_t input)
 {
+   if (handle->packed)
+   {
+      if (reserve_words(&handle->input.words, &handle->input.cap, handle->input.count + 1))
+         handle->input.words[handle->input.count++] = input;
+      return;
+   }
+
+   if (!reserve_record(handle, sizeof(input)))
+      return;
+
    input = swap_if_big16(input);
-   fwrite(&input, sizeof(int16_t), 1, handle->file);
+   memcpy(handle->data + handle->pos, &input, sizeof(input));
+   handle->pos += sizeof(input);
 }
 
 bsv_movie_t *bsv_movie_init(const char *path, enum ssnes_movie_type type)
@@ -174,9 +1024,12 @@ bsv_movie_t *bsv_movie_init(const char *path, enum ssnes_movie_type type)
    // Just pick something really large :D ~1 million frames rewind should do the trick.
    if (!(handle->frame_pos = (size_t*)calloc((1 << 20), sizeof(size_t))))
       goto error; 
+   if (handle->packed && !(handle->frame_run = (uint16_t*)calloc((1 << 20), sizeof(uint16_t))))
+      goto error;
 
    handle->frame_pos[0] = handle->min_file_pos;
    handle->frame_mask = (1 << 20) - 1;
+   handle->start_pos = handle->min_file_pos;
 
    return handle;
 
@@ -185,50 +1038,174 @@ error:
    return NULL;
 }
 
+bool bsv_movie_seek(bsv_movie_t *handle, unsigned frame, unsigned *start_frame)
+{
+   if (!handle->playback)
+      return false;
+
+   // Last checkpoint at or before frame.
+   size_t lo = 0, hi = handle->num_checkpoints;
+   while (lo < hi)
+   {
+      size_t mid = (lo + hi) / 2;
+      if (handle->checkpoints[mid].frame <= frame)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   bool same_size = psnes_serialize_size() == handle->state_size;
+   if (lo)
+   {
+      const struct bsv_checkpoint *checkpoint = &handle->checkpoints[lo - 1];
+      if (!same_size)
+      {
+         SSNES_ERR("Movie checkpoints are from a different serializer version, can't seek.\n");
+         return false;
+      }
+
+      if (!unpack_checkpoint(handle->scratch, handle->base, handle->state_words, checkpoint->data, checkpoint->size))
+      {
+         SSNES_ERR("Movie checkpoint at frame %u is corrupt.\n", (unsigned)checkpoint->frame);
+         return false;
+      }
+
+      psnes_unserialize((const uint8_t*)handle->scratch, handle->state_size);
+      handle->start_frame = checkpoint->frame;
+      handle->start_pos = checkpoint->pos;
+   }
+   else
+   {
+      if (handle->state_size && same_size)
+         psnes_unserialize(handle->data + 4 * sizeof(uint32_t), handle->state_size);
+      handle->start_frame = 0;
+      handle->start_pos = handle->min_file_pos;
+   }
+
+   handle->frame = handle->start_frame;
+   handle->pos = handle->start_pos;
+   handle->frame_ptr = 0;
+   handle->frame_pos[0] = handle->pos;
+   if (handle->packed)
+   {
+      seek_frame(handle, handle->pos, 0);
+      handle->frame_run[0] = 0;
+   }
+   handle->first_rewind = false;
+   handle->did_rewind = false;
+
+   *start_frame = handle->start_frame;
+   return true;
+}
+
 void bsv_movie_set_frame_start(bsv_movie_t *handle)
 {
-   handle->frame_pos[handle->frame_ptr] = ftell(handle->file);
+   bool checkpoint = handle->checkpoint_interval && handle->frame && handle->frame % handle->checkpoint_interval == 0;
+
+   if (!handle->packed)
+      handle->frame_pos[handle->frame_ptr] = handle->pos;
+   else if (handle->playback)
+   {
+      // Past the end, rewinding should find the end again, not the last frame.
+      handle->input.ended = !next_frame(handle);
+      handle->frame_pos[handle->frame_ptr] = handle->input.ended ? handle->pos : handle->input.base;
+      handle->frame_run[handle->frame_ptr] = handle->input.ended ? 0 : handle->input.run;
+   }
+   else if (checkpoint)
+   {
+      // Seeking to a checkpoint starts decoding at its offset, so the frame can't be a repeat.
+      write_repeats(handle);
+      handle->input.prev_valid = false;
+   }
+
+   if (checkpoint)
+      take_checkpoint(handle);
 }
 
 void bsv_movie_set_frame_end(bsv_movie_t *handle)
 {
+   if (handle->packed && !handle->playback)
+      end_frame(handle);
+
    handle->frame_ptr = (handle->frame_ptr + 1) & handle->frame_mask;
+   handle->frame++;
 
    handle->first_rewind = !handle->did_rewind;
    handle->did_rewind = false;
+
+   if (!handle->playback)
+      flush_record(handle, false);
 }
 
 void bsv_movie_frame_rewind(bsv_movie_t *handle)
 {
    handle->did_rewind = true;
 
+   size_t pos;
+   unsigned run = 0;
+
    // If we're at the beginning ... :)
-   if ((handle->frame_ptr <= 1) && (handle->frame_pos[0] == handle->min_file_pos))
+   if ((handle->frame_ptr <= 1) && (handle->frame_pos[0] == handle->start_pos))
    {
       handle->frame_ptr = 0;
-      fseek(handle->file, handle->min_file_pos, SEEK_SET);
+      handle->frame = handle->start_frame;
+      pos = handle->start_pos;
    }
    else
    {
       // First time rewind is performed, the old frame is simply replayed.
       // However, playing back that frame caused us to read data, and push data to the ring buffer.
       // Sucessively rewinding frames, we need to rewind past the read data, plus another.
-      handle->frame_ptr = (handle->frame_ptr - (handle->first_rewind ? 1 : 2)) & handle->frame_mask;
-      fseek(handle->file, handle->frame_pos[handle->frame_ptr], SEEK_SET);
+      unsigned frames = handle->first_rewind ? 1 : 2;
+      handle->frame_ptr = (handle->frame_ptr - frames) & handle->frame_mask;
+      handle->frame = handle->frame - handle->start_frame > frames ? handle->frame - frames : handle->start_frame;
+      pos = handle->frame_pos[handle->frame_ptr];
+      if (handle->frame_run)
+         run = handle->frame_run[handle->frame_ptr];
    }
 
    // We rewound past the beginning. :O
-   if (ftell(handle->file) <= (long)handle->min_file_pos)
+   // If recording, we simply reset the starting point. Nice and easy.
+   bool reset = pos < handle->start_pos || (pos == handle->start_pos && !run);
+   if (reset)
    {
-      // If recording, we simply reset the starting point. Nice and easy.
-      if (!handle->playback)
-      {
-         fseek(handle->file, 4 * sizeof(uint32_t), SEEK_SET);
-         psnes_serialize(handle->state, handle->state_size);
-         fwrite(handle->state, 1, handle->state_size, handle->file);
-      }
+      pos = handle->start_pos;
+      run = 0;
+      handle->frame = handle->start_frame;
+   }
+
+   if (handle->playback)
+   {
+      if (handle->packed)
+         seek_frame(handle, pos, run);
       else
-         fseek(handle->file, handle->min_file_pos, SEEK_SET);
+         handle->pos = pos;
+      return;
    }
-}
 
+   drop_checkpoints(handle);
+
+   // Packed input goes back to the frame the one we rewound to is a repeat of.
+   if (handle->packed)
+      pos = seek_frame(handle, pos, run);
+
+   if (reset)
+      psnes_serialize(handle->state, handle->state_size);
+
+   movie_lock(handle);
+   handle->pos = pos;
+   handle->flush.end = pos;
+   if (handle->flush.flushed > pos)
+      handle->flush.flushed = pos;
+
+   if (reset)
+   {
+      // Checkpoints are packed against the initial state, but they're all gone by now.
+      if (handle->base)
+         memcpy(handle->base, handle->state, handle->state_size);
+      memcpy(handle->data + 4 * sizeof(uint32_t), handle->state, handle->state_size);
+      if (handle->flush.flushed > 4 * sizeof(uint32_t))
+         handle->flush.flushed = 4 * sizeof(uint32_t);
+   }
+   movie_unlock(handle);
+}
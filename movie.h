@@ -23,6 +23,10 @@
 #include "boolean.h"
 
 #define BSV_MAGIC 0x42535631
+// BSV1 with flags in place of the serializer version, and optionally packed input,
+// save state checkpoints and an index of them at the end.
+#define BSV2_MAGIC 0x42535632
+#define BSV2_FLAG_PACKED_INPUT (1 << 0)
 
 #define MAGIC_INDEX 0
 #define SERIALIZER_INDEX 1
@@ -45,6 +49,10 @@ bool bsv_movie_get_input(bsv_movie_t *handle, int16_t *input);
 // Recording
 void bsv_movie_set_input(bsv_movie_t *handle, int16_t input);
 
+// Playback only. Restores the closest checkpoint at or before frame, and continues playback from there.
+// The frames from *start_frame up to frame still have to be run.
+bool bsv_movie_seek(bsv_movie_t *handle, unsigned frame, unsigned *start_frame);
+
 // Used for rewinding while playback/record.
 void bsv_movie_set_frame_start(bsv_movie_t *handle); // Debugging purposes.
 void bsv_movie_set_frame_end(bsv_movie_t *handle);
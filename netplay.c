@@ -40,6 +40,7 @@
 #include <netex/net.h>
 #else
 #include <signal.h>
+#include <fcntl.h>
 #endif
 
 #endif
@@ -49,10 +50,31 @@
 #include "autosave.h"
 #include "dynamic.h"
 #include "message.h"
+#include "timer.h"
+#include "rewind.h"
 #include <stdlib.h>
 #include <string.h>
 
 #include "netplay_compat.h"
+#include <errno.h>
+
+// Sockets are read on a separate thread where it's available. Consoles lack timed condition waits.
+#if defined(HAVE_THREADS) && !defined(SSNES_CONSOLE)
+#define HAVE_NETPLAY_THREAD
+#include "thread.h"
+
+#ifndef _WIN32
+#include <poll.h>
+#endif
+
+#ifdef _MSC_VER
+#define NETPLAY_BARRIER() MemoryBarrier()
+#else
+#define NETPLAY_BARRIER() __sync_synchronize()
+#endif
+#else
+#define NETPLAY_BARRIER()
+#endif
 
 // Checks if input port/index is controlled by netplay or not.
 static bool netplay_is_alive(netplay_t *handle);
@@ -67,14 +89,32 @@ static const struct snes_callbacks* netplay_callbacks(netplay_t *handle);
 static void netplay_set_spectate_input(netplay_t *handle, int16_t input);
 
 static bool netplay_send_cmd(netplay_t *handle, uint32_t cmd, const void *data, size_t size);
+#ifndef HAVE_NETPLAY_THREAD
 static bool netplay_get_cmd(netplay_t *handle);
+#endif
+static bool netplay_handle_cmd(netplay_t *handle, uint32_t cmd, const void *data, size_t size);
+static bool netplay_read_cmd(int fd, uint32_t *cmd, void *data, size_t *size, size_t max_size);
+
+#ifdef HAVE_NETPLAY_THREAD
+static bool init_io_thread(netplay_t *handle);
+static void deinit_io_thread(netplay_t *handle);
+#endif
+
+static bool init_spectators(netplay_t *handle);
+static void deinit_spectators(netplay_t *handle);
+static void init_input_delay(netplay_t *handle);
 
 #define PREV_PTR(x) ((x) == 0 ? handle->buffer_size - 1 : (x) - 1)
 #define NEXT_PTR(x) ((x + 1) % handle->buffer_size)
 
 struct delta_frame
 {
-   uint8_t *state;
+   // Delta from the state of the previous frame, see store_state().
+   uint8_t *delta;
+   size_t delta_size;
+   size_t delta_capacity;
+   bool has_state; // Replay only stores checkpoints, so some frames have no state.
+   uint64_t hash; // Hash of the state, if desync checks are on. See state_hash().
 
    uint16_t real_input_state;
    uint16_t simulated_input_state;
@@ -84,11 +124,212 @@ struct delta_frame
 };
 
 #define UDP_FRAME_PACKETS 16
-#define MAX_SPECTATORS 16
+// Replay only stores the state of every Nth frame, the newest frame, and the frame it will be confirmed up to.
+// Restoring other frames runs the emulator forward from the checkpoint before them.
+#define REPLAY_CHECKPOINT_INTERVAL 8
+// The peer can be ahead of us by its whole window, which might be bigger than ours.
+#define FLIP_DELAY_FRAMES (NETPLAY_MAX_FRAMES + UDP_FRAME_PACKETS)
+
+// Recorded input is streamed to spectators from a ring that every client has its own position in.
+// A client that falls more than SPECTATE_MAX_LAG bytes behind is dropped, so slow viewers never hold up the host.
+// The other half of the ring is slack for a frame being written while it's sent. Must be a power of two.
+#define SPECTATE_RING_SIZE (1 << 18)
+#define SPECTATE_MAX_LAG (SPECTATE_RING_SIZE / 2)
+#define SPECTATE_LISTEN_BACKLOG 64
+// Joining spectators share a save state as long as they don't have to fast-forward more than this to catch up.
+#define SPECTATE_SNAPSHOT_MAX_AGE 300
+// How long a joining spectator gets for each step of the handshake.
+#define SPECTATE_JOIN_TIMEOUT_MS 5000
+
+// Spectators get input a batch of frames at a time, in a single write, which delays them by up to a batch.
+// A batch is [u32 host frame of its first frame][u32 size], then size bytes of frames, each a varint tag:
+// (n << 2) | SPECTATE_FRAME_REPEAT: the previous frame n + 1 times.
+// (n << 2) | SPECTATE_FRAME_FULL: n words as zigzag varints.
+// (n << 2) | SPECTATE_FRAME_CHANGED: n + 1 words of the previous frame changed, as [varint words skipped][zigzag varint word].
+// Batches start with a full frame, so clients can join at any of them. The frame number lets clients check they're in step.
+#define SPECTATE_BATCH_FRAMES 8
+// A batch is cut short once it gets this big.
+#define SPECTATE_BATCH_FLUSH_SIZE 4096
+#define SPECTATE_BATCH_HEADER_SIZE 8
+// Input the core reads past this in a frame isn't sent. Keeps the biggest batch below SPECTATE_MAX_BATCH_SIZE.
+#define SPECTATE_MAX_FRAME_WORDS 4096
+#define SPECTATE_MAX_BATCH_SIZE (SPECTATE_MAX_LAG / 2)
+#define SPECTATE_FRAME_REPEAT 0
+#define SPECTATE_FRAME_FULL 1
+#define SPECTATE_FRAME_CHANGED 2
 
 #define NETPLAY_CMD_ACK 0
 #define NETPLAY_CMD_NAK 1
 #define NETPLAY_CMD_FLIP_PLAYERS 2
+#define NETPLAY_CMD_STATE_HASH 3
+#define NETPLAY_CMD_RESYNC 4
+
+// Largest command argument we take. Resync states are sent in pieces that fit.
+#define MAX_CMD_SIZE 4096
+// A resync piece starts with the frame, resync count, packed size and offset of the piece.
+#define RESYNC_HEADER_SIZE 16
+// State hashes we hold on to until the other player's hash of the same frame comes in.
+#define DESYNC_HASH_HISTORY 16
+#define DESYNC_CHECK_FRAME(handle, frame) ((handle)->desync.interval && (frame) % (handle)->desync.interval == 0)
+
+// Input packets are big endian, and start with a header:
+//   u32 stamp: when the packet was sent, for round trip time. 0 means no stamp.
+//   u32 echo: the newest stamp we got from the other player, moved forward by how long we held on to it.
+//   u32 advantage: how far ahead of the other player we think we are, in 1/1000 frames, for time sync.
+//   u32 cur_frame: the frame we're on, for time sync.
+//   u32 ack: the first frame of input from the other player we don't have yet.
+//   u16 loss: how many of the other player's packets we lose, in 1/1000.
+//   u32 base_frame, u8 frames: the frames of input in the packet, starting at base_frame.
+// Then runs of { u8 frames, u16 input } that add up to the frames. Input seldom changes from frame to frame,
+// so resending old input costs next to nothing.
+#define PACKET_HEADER_SIZE 27
+#define PACKET_RUN_SIZE 3
+#define MAX_PACKET_FRAMES (2 * (NETPLAY_MAX_FRAMES + 1) + NETPLAY_MAX_INPUT_DELAY + 1) // Fits in the u8.
+#define MAX_PACKET_SIZE (PACKET_HEADER_SIZE + MAX_PACKET_FRAMES * PACKET_RUN_SIZE)
+#define MAX_EVENT_SIZE (MAX_CMD_SIZE > MAX_PACKET_SIZE ? MAX_CMD_SIZE : MAX_PACKET_SIZE)
+
+// Packets always resend at least this many of our newest frames, so input from a lost packet is in the next one.
+// The more of our packets the other player loses, the further back we go, see update_redundancy().
+#define REDUNDANCY_MIN_FRAMES 2
+// Chance we accept of a frame of input being lost in every packet it goes out in.
+#define REDUNDANCY_MISS_CHANCE 0.0001
+
+struct packet_header
+{
+   uint32_t stamp;
+   uint32_t echo;
+   int32_t advantage;
+   uint32_t cur_frame;
+   uint32_t ack;
+   unsigned loss;
+   uint32_t base_frame;
+   unsigned frames;
+};
+
+#ifdef HAVE_NETPLAY_THREAD
+enum net_event_type
+{
+   NET_EVENT_PACKET = 0,
+   NET_EVENT_CMD,
+   NET_EVENT_HANGUP
+};
+
+// Something the I/O thread received, handed over to the emulation thread.
+struct net_event
+{
+   enum net_event_type type;
+   uint32_t cmd;
+   size_t size; // Bytes in data.
+   struct sockaddr_storage addr; // Sender of a packet.
+   int64_t recv_usec; // When a packet arrived, for RTT.
+   uint32_t data[(MAX_EVENT_SIZE + 3) / 4]; // Commands are words, packets are bytes.
+};
+
+// Must be a power of two.
+#define NET_EVENT_QUEUE_SIZE 64
+// How often the I/O thread checks whether it should quit.
+#define NET_THREAD_POLL_MS 100
+#endif
+
+struct desync_hash
+{
+   uint32_t frame;
+   uint32_t epoch; // Resyncs before the hash was taken.
+   uint64_t hash;
+   bool valid;
+};
+
+struct spectator
+{
+   int fd;
+   unsigned id;
+   uint32_t pos; // Position in the spectate ring of the next byte to send.
+};
+
+enum netplay_prediction
+{
+   NETPLAY_PREDICT_REPEAT = 0, // The other player keeps doing what they did last.
+   NETPLAY_PREDICT_HOLD, // Buttons are released and pressed after as many frames as they usually are.
+   NETPLAY_PREDICT_PATTERN // The last few inputs are followed by what followed them last time.
+};
+
+#define PREDICT_BUTTONS 16
+// Runs of a button being held or released for this long or longer are counted together, and never predicted to end.
+#define PREDICT_MAX_RUN 64
+// Run counts are halved once one gets this high, so old play fades out.
+#define PREDICT_RUN_DECAY 1024
+#define PREDICT_PATTERN_ORDER 3
+#define PREDICT_PATTERN_SIZE 4096
+
+// Learns from the other player's real input, in order, and guesses their input for frames that haven't arrived.
+struct netplay_predictor
+{
+   enum netplay_prediction type;
+
+   uint16_t history[PREDICT_PATTERN_ORDER]; // Newest last.
+
+   uint8_t run[PREDICT_BUTTONS]; // How long each button has been in its current state.
+   uint16_t runs[PREDICT_BUTTONS][2][PREDICT_MAX_RUN]; // Finished runs of released and held buttons by length.
+
+   // What followed each recent history, and how many times in a row that held up (up to 3).
+   // Histories that aren't confidently followed by anything are predicted like repeat.
+   uint16_t pattern[PREDICT_PATTERN_SIZE];
+   uint8_t pattern_confidence[PREDICT_PATTERN_SIZE];
+
+   uint64_t predicted; // Frames that were run with predicted input.
+   uint64_t hits;
+};
+
+// How often automatic input delay is adjusted, in frames.
+#define INPUT_DELAY_AUTO_INTERVAL 60
+// How often time sync compares how far ahead each side is, in frames. Has to be longer than a round trip,
+// so a wait has reached the other side before it's measured again.
+#define TIME_SYNC_INTERVAL 30
+// Most frames time sync waits out at once.
+#define TIME_SYNC_MAX_WAIT 2
+
+// Bucket i holds values from 2^i - 1 up to 2^(i + 1) - 2.
+#define TELEMETRY_BUCKETS 32
+// Stamps echoed back later than this are from before a stall or a clock jump, and aren't counted.
+#define TELEMETRY_MAX_RTT_USEC 10000000
+
+struct netplay_histogram
+{
+   uint32_t buckets[TELEMETRY_BUCKETS];
+   uint64_t count;
+   uint64_t sum;
+   uint32_t max;
+};
+
+struct netplay_telemetry_stats
+{
+   struct netplay_histogram rtt; // usec
+   struct netplay_histogram jitter; // Change in RTT from one packet to the next, usec.
+   struct netplay_histogram stall; // usec spent waiting for the other player, on frames we had to.
+   struct netplay_histogram rollback; // Frames replayed.
+   uint64_t packets;
+   uint64_t lost; // Packets the other player sent that never arrived.
+};
+
+struct netplay_telemetry
+{
+   struct netplay_telemetry_stats interval; // Since the last dump.
+   struct netplay_telemetry_stats total;
+
+   uint32_t newest_frame; // Newest frame the other player has sent us.
+   bool has_newest;
+   uint32_t last_rtt;
+   uint32_t rtt_avg; // Moving average, 0 until we have one.
+   bool has_rtt;
+   uint32_t loss_avg; // Moving average of how many of their packets we lose, 1 << 16 being all of them.
+
+   uint32_t their_stamp; // Newest stamp the other player sent, and when we got it. 0 if we have none.
+   int64_t their_stamp_usec;
+
+   unsigned dump_interval; // Seconds between dumps, 0 to only log totals on exit.
+   int64_t next_dump_usec;
+   FILE *file; // Dumps go to the log if there is none.
+};
 
 struct netplay
 {
@@ -104,18 +345,111 @@ struct netplay
 
    struct delta_frame *buffer;
    size_t buffer_size;
+   size_t window; // How far we may run ahead of the last confirmed frame. Less than buffer_size, see REPLAY_CHECKPOINT_INTERVAL.
 
    size_t self_ptr; // Ptr where we are now.
    size_t other_ptr; // Points to the last reliable state that self ever had.
-   size_t read_ptr; // Ptr to where we are reading. Generally, other_ptr <= read_ptr <= self_ptr.
+   size_t read_ptr; // Ptr to where we are reading. Generally, other_ptr <= read_ptr <= self_ptr + NETPLAY_MAX_INPUT_DELAY.
    size_t tmp_ptr; // A temporary pointer used on replay.
 
+   // States are not kept in full for every frame. Each frame stores a delta from the frame before it,
+   // and base_state holds the full state of base_ptr, which is rolled forward as other_ptr advances.
+   uint32_t *base_state;
+   uint32_t *last_state; // Full state of the newest stored frame.
+   uint32_t *cur_state; // Serialization target.
+   uint8_t *delta_scratch;
+   size_t base_ptr;
    size_t state_size;
+   size_t state_words;
+
+   size_t delta_bytes; // Sum of all deltas in the window.
+   size_t delta_bytes_peak;
+   size_t delta_alloc; // Sum of allocated delta buffers.
+   uint64_t delta_bytes_total;
+   uint64_t deltas;
+
+   struct
+   {
+      uint64_t rollbacks;
+      uint64_t frames; // Replayed frames.
+      uint64_t resimulated; // Frames run to get from a checkpoint to where replay starts.
+      uint64_t stored;
+      uint64_t skipped; // States not stored on replay.
+      uint64_t serialize_usec;
+      uint64_t run_usec;
+      uint64_t usec;
+   } replay;
+
+   struct netplay_predictor predictor;
+   struct netplay_telemetry telemetry;
+   int64_t start_usec;
 
    bool is_replay; // Are we replaying old frames?
    bool can_poll; // We don't want to poll several times on a frame.
 
-   uint32_t packet_buffer[UDP_FRAME_PACKETS * 2]; // To compat UDP packet loss we also send old data along with the packets.
+   // Our input is used input_delay frames after it's read, and sent that much ahead of time,
+   // so the other player has it before they need it. See update_input_delay().
+   unsigned input_delay;
+   unsigned input_delay_max;
+   bool input_delay_auto;
+   uint32_t input_send_frame; // First frame we haven't sent input for.
+
+   // Time sync, see update_time_sync().
+   struct
+   {
+      bool enable;
+      uint32_t their_frame; // Frame the other player was on when they sent their newest packet,
+      int64_t their_frame_usec; // and when we got it.
+      bool has_their_frame;
+      int32_t their_advantage; // How far ahead of us they think they are, in 1/1000 frames.
+      uint32_t next_check; // Frame we next compare advantages on.
+      unsigned wait_frames; // Frames left to wait out.
+      uint64_t waited;
+   } time_sync;
+
+   // Desync checks, see desync_check().
+   struct
+   {
+      unsigned interval; // Frames between checks, 0 if they're off.
+      uint64_t base_hash; // Hashes of base_state and last_state.
+      uint64_t last_hash;
+      uint32_t next_frame; // Next frame we send the hash of.
+      uint32_t epoch; // Resyncs so far. Only hashes from between the same resyncs are compared.
+      struct desync_hash ours[DESYNC_HASH_HISTORY];
+      struct desync_hash theirs[DESYNC_HASH_HISTORY];
+      unsigned ours_ptr;
+      unsigned theirs_ptr;
+
+      uint64_t checks;
+      uint64_t mismatches;
+      uint64_t resyncs;
+
+      // The host sends its state packed like a spectator save state. On the host, state is scratch space for packing.
+      uint8_t *packed;
+      size_t packed_size;
+      size_t packed_received;
+      bool receiving;
+      uint32_t *state;
+      uint32_t frame; // Frame of the state.
+      uint32_t pending_epoch;
+      bool pending; // All of state is here, and waits to be switched to.
+   } desync;
+
+   // To combat UDP packet loss we also send old input along with the packets, see packet_first_frame().
+   uint16_t *send_history; // Our input for the last packet_frames frames we sent, at frame % packet_frames.
+   size_t packet_frames; // Most frames of input in a packet. Larger than the window, so a stalled peer can catch up.
+   uint32_t their_ack; // First frame of our input the other player doesn't have, as of their newest packet.
+   bool has_their_ack;
+   unsigned their_loss; // How many of our packets the other player loses, in 1/1000.
+   unsigned redundancy; // How many of our newest frames each packet resends.
+
+   struct
+   {
+      uint64_t packets;
+      uint64_t bytes;
+      uint64_t frames;
+   } sent;
+
    uint32_t frame_count;
    uint32_t read_frame_count;
    uint32_t other_frame_count;
@@ -129,10 +463,117 @@ struct netplay
    // Spectating.
    bool spectate;
    bool spectate_client;
-   int spectate_fds[MAX_SPECTATORS];
    uint16_t *spectate_input;
    size_t spectate_input_ptr;
    size_t spectate_input_size;
+   uint32_t spectate_catchup; // Frames a joining spectator has to fast-forward through.
+
+   // Spectating clients decode the host's input a batch at a time.
+   struct
+   {
+      uint8_t *data;
+      size_t size;
+      size_t cap;
+      size_t pos;
+
+      uint16_t *words; // Input of the current frame.
+      size_t num_words;
+      size_t words_cap;
+      size_t read; // Words the core has read.
+
+      uint32_t repeat; // Times the current frame repeats.
+      uint32_t frame; // Host frame of the next frame.
+      bool has_frame;
+      bool fetched; // The current frame has been decoded.
+      bool lost;
+   } spectate_recv;
+
+   struct
+   {
+      uint8_t *ring;
+      volatile uint32_t write; // Bytes ever written to ring, wraps around.
+
+      // Only touched by whoever sends, which is the sender thread if we have one.
+      struct spectator *clients;
+      size_t num_clients;
+      size_t clients_cap;
+
+      unsigned next_id;
+      volatile unsigned dropped;
+      unsigned dropped_reported;
+      volatile uint32_t frames; // Frames written to ring.
+
+      // Frames that aren't in the ring yet. Only whole batches go in, so clients get a write per batch, not per frame.
+      struct
+      {
+         uint8_t *data; // Starts with room for the header.
+         size_t size;
+         size_t cap;
+         uint32_t frames;
+         uint32_t repeat; // Frames the same as prev that aren't encoded yet.
+
+         uint16_t *prev;
+         size_t prev_words;
+         size_t prev_cap;
+
+         uint64_t total_batches;
+         uint64_t total_frames;
+         uint64_t total_bytes;
+      } batch;
+
+      // Save state that joining clients start from. Their input starts at pos in the ring.
+      struct
+      {
+         uint32_t *state;
+         uint32_t *zero;
+         size_t words;
+         uint8_t *packed;
+         size_t packed_size;
+         bool is_packed;
+         uint32_t pos;
+         uint32_t frame;
+         bool valid;
+         volatile bool wanted; // Set by the join thread, the emulation thread takes a new one at the end of the frame.
+      } snapshot;
+
+#ifdef HAVE_NETPLAY_THREAD
+      // New clients are handed to the sender thread through pending.
+      sthread_t *thread;
+      volatile bool quit;
+      slock_t *lock;
+      scond_t *cond;
+
+      struct spectator *pending;
+      size_t num_pending;
+      size_t pending_cap;
+
+      // Accepted clients are handshaken with on the join thread, so the host never waits for them.
+      sthread_t *join_thread;
+      scond_t *join_cond;
+      struct spectator *joining;
+      size_t num_joining;
+      size_t joining_cap;
+#endif
+   } spectators;
+
+#ifdef HAVE_NETPLAY_THREAD
+   // The I/O thread reads both sockets and pushes what it gets to a single producer, single consumer queue.
+   // The emulation thread only sleeps on cond when it has to wait for the other player.
+   struct
+   {
+      sthread_t *thread;
+      volatile bool quit;
+
+      struct net_event *queue;
+      volatile unsigned read;
+      volatile unsigned write;
+
+      slock_t *lock;
+      scond_t *cond;
+   } io;
+
+   int cmd_response; // Response to a command we sent, -1 if we haven't got one.
+#endif
 
    // Player flipping
    // Flipping state. If ptr >= flip_frame, we apply the flip.
@@ -306,7 +747,7 @@ static bool init_tcp_socket(netplay_t *handle, const char *server, uint16_t port
       setsockopt(handle->fd, SOL_SOCKET, SO_REUSEADDR, CONST_CAST &yes, sizeof(int));
 
       if (bind(handle->fd, res->ai_addr, res->ai_addrlen) < 0 ||
-            listen(handle->fd, MAX_SPECTATORS) < 0)
+            listen(handle->fd, SPECTATE_LISTEN_BACKLOG) < 0)
       {
          SSNES_ERR("Failed to bind socket.\n");
          close(handle->fd);
@@ -507,6 +948,7 @@ static bool get_nickname(netplay_t *handle, int fd)
       SSNES_ERR("Failed to receive nick.\n");
       return false;
    }
+   handle->other_nick[nick_size] = '\0';
 
    return true;
 }
@@ -608,30 +1050,12 @@ static bool get_info(netplay_t *handle)
    return true;
 }
 
-static uint32_t *bsv_header_generate(size_t *size, uint32_t magic)
+static void bsv_header_generate(uint32_t *bsv_header, uint32_t magic)
 {
-   uint32_t bsv_header[4] = {0};
-   unsigned serialize_size = psnes_serialize_size();
-   size_t header_size = sizeof(bsv_header) + serialize_size;
-   *size = header_size;
-
-   uint32_t *header = (uint32_t*)malloc(header_size);
-   if (!header)
-      return NULL;
-
    bsv_header[MAGIC_INDEX] = swap_if_little32(BSV_MAGIC);
    bsv_header[SERIALIZER_INDEX] = swap_if_big32(magic);
    bsv_header[CRC_INDEX] = swap_if_big32(g_extern.cart_crc);
-   bsv_header[STATE_SIZE_INDEX] = swap_if_big32(serialize_size);
-
-   if (serialize_size && !psnes_serialize((uint8_t*)header + sizeof(bsv_header), serialize_size))
-   {
-      free(header);
-      return NULL;
-   }
-
-   memcpy(header, bsv_header, sizeof(bsv_header));
-   return header;
+   bsv_header[STATE_SIZE_INDEX] = swap_if_big32(psnes_serialize_size());
 }
 
 static bool bsv_parse_header(const uint32_t *header, uint32_t magic)
@@ -703,665 +1127,2846 @@ static bool get_info_spectate(netplay_t *handle)
       return false;
    }
 
-   uint8_t *buf = (uint8_t*)malloc(save_state_size);
-   if (!buf)
+   // The save state is packed as a delta against an all-zero state.
+   size_t words = (save_state_size + 3) >> 2;
+   uint32_t packed_size;
+   if (!recv_all(handle->fd, &packed_size, sizeof(packed_size)))
+   {
+      SSNES_ERR("Failed to receive save state size from host.\n");
       return false;
+   }
 
-   size_t size = save_state_size;
-   uint8_t *tmp_buf = buf;
+   packed_size = ntohl(packed_size);
+   if (packed_size > STATE_DELTA_MAX_SIZE(words))
+   {
+      SSNES_ERR("Received invalid save state size from host.\n");
+      return false;
+   }
 
-   if (!recv_all(handle->fd, tmp_buf, size))
+   uint32_t *state = (uint32_t*)calloc(words, sizeof(uint32_t));
+   uint8_t *packed = (uint8_t*)malloc(packed_size);
+   if (!state || !packed)
    {
-      SSNES_ERR("Failed to receive save state from host.\n");
-      free(tmp_buf);
+      free(state);
+      free(packed);
       return false;
    }
 
-   bool ret = true;
-   if (save_state_size)
-      ret = psnes_unserialize(buf, save_state_size);
+   bool ret = recv_all(handle->fd, packed, packed_size);
+   if (!ret)
+      SSNES_ERR("Failed to receive save state from host.\n");
+   else if (!(ret = state_delta_apply_checked(state, words, packed, packed_size)))
+      SSNES_ERR("Received corrupt save state from host.\n");
+   else if (save_state_size)
+      ret = psnes_unserialize((const uint8_t*)state, save_state_size);
+
+   free(state);
+   free(packed);
+   if (!ret)
+      return false;
 
-   free(buf);
-   return ret;
+   // The host kept running while we joined. Its input since the save state was taken is queued up for us.
+   uint32_t catchup;
+   if (!recv_all(handle->fd, &catchup, sizeof(catchup)))
+   {
+      SSNES_ERR("Failed to receive catch-up frames from host.\n");
+      return false;
+   }
+
+   handle->spectate_catchup = ntohl(catchup);
+   return true;
 }
 
-static void init_buffers(netplay_t *handle)
+static inline size_t delta_write_varint(uint8_t *out, uint32_t v)
 {
-   handle->buffer = (struct delta_frame*)calloc(handle->buffer_size, sizeof(*handle->buffer));
-   handle->state_size = psnes_serialize_size();
-   for (unsigned i = 0; i < handle->buffer_size; i++)
+   size_t len = 0;
+   while (v >= 0x80)
    {
-      handle->buffer[i].state = (uint8_t*)malloc(handle->state_size);
-      handle->buffer[i].is_simulated = true;
+      out[len++] = (uint8_t)(v | 0x80);
+      v >>= 7;
    }
+   out[len++] = (uint8_t)v;
+   return len;
 }
 
-netplay_t *netplay_new(const char *server, uint16_t port,
-      unsigned frames, const struct snes_callbacks *cb,
-      bool spectate,
-      const char *nick)
+static inline uint32_t delta_read_varint(const uint8_t **in)
 {
-   (void)spectate;
-
-   if (frames > UDP_FRAME_PACKETS)
-      frames = UDP_FRAME_PACKETS;
+   const uint8_t *ptr = *in;
+   uint32_t v = 0;
+   unsigned shift = 0;
+   do
+   {
+      v |= (uint32_t)(*ptr & 0x7f) << shift;
+      shift += 7;
+   } while (*ptr++ & 0x80);
+   *in = ptr;
+   return v;
+}
 
-   netplay_t *handle = (netplay_t*)calloc(1, sizeof(*handle));
-   if (!handle)
-      return NULL;
+// The hash of a state is the sum of a hash of each word and where it is. A delta changes it by the difference
+// between the old and new hashes of the words it changes, so states are hashed for about what storing them costs anyway.
+// Words are hashed as little endian, so both sides agree even if they don't.
+static inline uint64_t state_word_hash(size_t pos, uint32_t word)
+{
+   uint64_t hash = ((uint64_t)pos << 32) | swap_if_big32(word);
+   hash ^= hash >> 33;
+   hash *= UINT64_C(0xff51afd7ed558ccd);
+   hash ^= hash >> 33;
+   hash *= UINT64_C(0xc4ceb9fe1a85ec53);
+   hash ^= hash >> 33;
+   return hash;
+}
 
-   handle->fd = -1;
-   handle->udp_fd = -1;
-   handle->cbs = *cb;
-   handle->port = server ? 0 : 1;
-   handle->spectate = spectate;
-   handle->spectate_client = server != NULL;
-   strlcpy(handle->nick, nick, sizeof(handle->nick));
+static uint64_t state_hash(const uint32_t *state, size_t words)
+{
+   uint64_t hash = 0;
+   for (size_t i = 0; i < words; i++)
+      hash += state_word_hash(i, state[i]);
+   return hash;
+}
 
-   if (!init_socket(handle, server, port))
+// How much the hash of state changes when delta is applied to it.
+static uint64_t delta_hash(const uint32_t *state, const uint8_t *delta, size_t size)
+{
+   uint64_t diff = 0;
+   size_t pos = 0;
+   const uint8_t *end = delta + size;
+   while (delta < end)
    {
-      free(handle);
-      return NULL;
+      pos += delta_read_varint(&delta);
+      uint32_t len = delta_read_varint(&delta);
+      for (; len; len--, pos++, delta += sizeof(uint32_t))
+      {
+         uint32_t xor_;
+         memcpy(&xor_, delta, sizeof(xor_));
+         diff += state_word_hash(pos, state[pos] ^ xor_) - state_word_hash(pos, state[pos]);
+      }
    }
+   return diff;
+}
 
-   if (spectate)
+static const char *prediction_names[] = { "repeat", "hold", "pattern" };
+
+static void init_predictor(struct netplay_predictor *pred, const char *type)
+{
+   memset(pred, 0, sizeof(*pred));
+   for (unsigned i = 0; i < sizeof(prediction_names) / sizeof(prediction_names[0]); i++)
    {
-      if (server)
+      if (strcmp(type, prediction_names[i]) == 0)
       {
-         if (!get_info_spectate(handle))
-            goto error;
+         pred->type = (enum netplay_prediction)i;
+         return;
       }
+   }
+
+   SSNES_WARN("Unknown netplay prediction \"%s\", using \"%s\".\n", type, prediction_names[NETPLAY_PREDICT_REPEAT]);
+}
+
+static inline unsigned predict_pattern_hash(const uint16_t *history)
+{
+   uint32_t hash = 0;
+   for (unsigned i = 0; i < PREDICT_PATTERN_ORDER; i++)
+      hash = (hash ^ history[i]) * 0x9e3779b1u;
+   return hash >> (32 - 12);
+}
+
+// Feeds the next real input of the other player.
+static void predictor_update(struct netplay_predictor *pred, uint16_t input)
+{
+   uint16_t last = pred->history[PREDICT_PATTERN_ORDER - 1];
 
-      for (unsigned i = 0; i < MAX_SPECTATORS; i++)
-         handle->spectate_fds[i] = -1;
+   if (pred->type == NETPLAY_PREDICT_HOLD)
+   {
+      for (unsigned i = 0; i < PREDICT_BUTTONS; i++)
+      {
+         unsigned state = (last >> i) & 1;
+         if (((input >> i) & 1) == state)
+         {
+            if (pred->run[i] < PREDICT_MAX_RUN)
+               pred->run[i]++;
+            continue;
+         }
+
+         uint16_t *runs = pred->runs[i][state];
+         if (pred->run[i] && ++runs[pred->run[i] - 1] >= PREDICT_RUN_DECAY)
+         {
+            for (unsigned j = 0; j < PREDICT_MAX_RUN; j++)
+               runs[j] >>= 1;
+         }
+         pred->run[i] = 1;
+      }
    }
-   else
+   else if (pred->type == NETPLAY_PREDICT_PATTERN)
    {
-      if (server)
+      unsigned hash = predict_pattern_hash(pred->history);
+      if (pred->pattern[hash] == input)
       {
-         if (!send_info(handle))
-            goto error;
+         if (pred->pattern_confidence[hash] < 3)
+            pred->pattern_confidence[hash]++;
       }
+      else if (pred->pattern_confidence[hash])
+         pred->pattern_confidence[hash]--;
       else
+         pred->pattern[hash] = input;
+   }
+
+   memmove(pred->history, pred->history + 1, (PREDICT_PATTERN_ORDER - 1) * sizeof(pred->history[0]));
+   pred->history[PREDICT_PATTERN_ORDER - 1] = input;
+}
+
+// Guesses the input ahead frames after the newest real input.
+static uint16_t predictor_predict(const struct netplay_predictor *pred, unsigned ahead)
+{
+   uint16_t last = pred->history[PREDICT_PATTERN_ORDER - 1];
+
+   switch (pred->type)
+   {
+      case NETPLAY_PREDICT_HOLD:
       {
-         if (!get_info(handle))
-            goto error;
+         // A button flips if most runs we've seen that got as long as this one ended before ahead more frames.
+         uint16_t input = last;
+         for (unsigned i = 0; i < PREDICT_BUTTONS; i++)
+         {
+            unsigned run = pred->run[i];
+            if (!run)
+               continue;
+
+            const uint16_t *runs = pred->runs[i][(last >> i) & 1];
+            unsigned ended = 0, total = 0;
+            for (unsigned j = run - 1; j < PREDICT_MAX_RUN; j++)
+            {
+               total += runs[j];
+               if (j + 1 < run + ahead && j + 1 < PREDICT_MAX_RUN)
+                  ended += runs[j];
+            }
+
+            if (2 * ended > total)
+               input ^= 1 << i;
+         }
+         return input;
       }
 
-      handle->buffer_size = frames + 1;
+      case NETPLAY_PREDICT_PATTERN:
+      {
+         uint16_t history[PREDICT_PATTERN_ORDER];
+         memcpy(history, pred->history, sizeof(history));
+         for (unsigned i = 0; i < ahead; i++)
+         {
+            unsigned hash = predict_pattern_hash(history);
+            uint16_t next = pred->pattern_confidence[hash] ? pred->pattern[hash] : history[PREDICT_PATTERN_ORDER - 1];
+            memmove(history, history + 1, (PREDICT_PATTERN_ORDER - 1) * sizeof(history[0]));
+            history[PREDICT_PATTERN_ORDER - 1] = next;
+         }
+         return history[PREDICT_PATTERN_ORDER - 1];
+      }
 
-      init_buffers(handle);
-      handle->has_connection = true;
+      default:
+         return last;
    }
+}
 
-   return handle;
+// Save states for spectators are packed as a delta against an all-zero state, which squeezes out cleared memory.
+// zero is scratch space for the all-zero state.
+static size_t pack_state(uint8_t *out, uint32_t *zero, const uint32_t *state, size_t words)
+{
+   memset(zero, 0, words * sizeof(uint32_t));
+   return state_delta_encode(out, zero, state, words);
+}
 
-error:
-   if (handle->fd >= 0)
-      close(handle->fd);
-   if (handle->udp_fd >= 0)
-      close(handle->udp_fd);
 
-   free(handle);
-   return NULL;
-}
+static bool init_buffers(netplay_t *handle)
+{
+   handle->buffer = (struct delta_frame*)calloc(handle->buffer_size, sizeof(*handle->buffer));
+   if (!handle->buffer)
+      return false;
 
+   for (unsigned i = 0; i < handle->buffer_size; i++)
+      handle->buffer[i].is_simulated = true;
 
-static bool netplay_is_alive(netplay_t *handle)
+   // Padding words are zeroed and never touched by serialization, so they never show up in deltas.
+   handle->state_size = psnes_serialize_size();
+   handle->state_words = (handle->state_size + 3) >> 2;
+   handle->base_state = (uint32_t*)calloc(handle->state_words, sizeof(uint32_t));
+   handle->last_state = (uint32_t*)calloc(handle->state_words, sizeof(uint32_t));
+   handle->cur_state = (uint32_t*)calloc(handle->state_words, sizeof(uint32_t));
+   handle->delta_scratch = (uint8_t*)malloc(STATE_DELTA_MAX_SIZE(handle->state_words));
+   if (!handle->base_state || !handle->last_state || !handle->cur_state || !handle->delta_scratch)
+      return false;
+
+   // The delta chain starts from the state we have right now.
+   // It's stored as if it were the frame before the first one, which then gets an empty delta.
+   if (!psnes_serialize((uint8_t*)handle->base_state, handle->state_size))
+      return false;
+   memcpy(handle->last_state, handle->base_state, handle->state_words * sizeof(uint32_t));
+   handle->base_ptr = PREV_PTR(0);
+   if (handle->desync.interval)
+      handle->desync.base_hash = handle->desync.last_hash = state_hash(handle->base_state, handle->state_words);
+
+   // The peer can be a whole window behind us, and stall a whole window ahead of the oldest frame it still needs from us.
+   // We also send input ahead by the delay. Any of those frames might have been lost in every packet it went out in.
+   size_t packet_frames = 2 * handle->window + 1 + handle->input_delay_max;
+   handle->packet_frames = packet_frames > UDP_FRAME_PACKETS ? packet_frames : UDP_FRAME_PACKETS;
+   handle->send_history = (uint16_t*)calloc(handle->packet_frames, sizeof(uint16_t));
+   if (!handle->send_history)
+      return false;
+   handle->redundancy = REDUNDANCY_MIN_FRAMES;
+
+   SSNES_LOG("Netplay: %u frame window, %u byte states.\n",
+         (unsigned)(handle->window - 1), (unsigned)handle->state_size);
+   return true;
+}
+
+static void deinit_buffers(netplay_t *handle)
 {
-   return handle->has_connection;
+   if (handle->buffer)
+   {
+      for (unsigned i = 0; i < handle->buffer_size; i++)
+         free(handle->buffer[i].delta);
+   }
+   free(handle->buffer);
+   free(handle->base_state);
+   free(handle->last_state);
+   free(handle->cur_state);
+   free(handle->delta_scratch);
+   free(handle->send_history);
+   free(handle->desync.packed);
+   free(handle->desync.state);
 }
 
-static bool send_chunk(netplay_t *handle)
+// Serializes the current state as the state of frame ptr, which must come after the newest stored frame.
+// The delta is taken against last_state, so frames between the two are left without a state.
+static bool store_state(netplay_t *handle, size_t ptr)
 {
-   const struct sockaddr *addr = NULL;
-   if (handle->addr)
-      addr = handle->addr->ai_addr;
-   else if (handle->has_client_addr)
-      addr = (const struct sockaddr*)&handle->their_addr;
+   if (!psnes_serialize((uint8_t*)handle->cur_state, handle->state_size))
+      return false;
 
-   if (addr)
+   struct delta_frame *frame = &handle->buffer[ptr];
+   size_t size = state_delta_encode(handle->delta_scratch, handle->last_state, handle->cur_state, handle->state_words);
+   if (handle->desync.interval)
+      handle->desync.last_hash += delta_hash(handle->last_state, handle->delta_scratch, size);
+
+   if (size > frame->delta_capacity)
    {
-      if (sendto(handle->udp_fd, CONST_CAST handle->packet_buffer,
-               sizeof(handle->packet_buffer), 0, addr,
-               sizeof(struct sockaddr)) != sizeof(handle->packet_buffer))
-      {
-         warn_hangup();
-         handle->has_connection = false;
+      uint8_t *delta = (uint8_t*)realloc(frame->delta, size);
+      if (!delta)
          return false;
-      }
+      handle->delta_alloc += size - frame->delta_capacity;
+      frame->delta = delta;
+      frame->delta_capacity = size;
    }
+
+   memcpy(frame->delta, handle->delta_scratch, size);
+   handle->delta_bytes += size;
+   handle->delta_bytes -= frame->delta_size;
+   frame->delta_size = size;
+   frame->has_state = true;
+   frame->hash = handle->desync.last_hash;
+
+   if (handle->delta_bytes > handle->delta_bytes_peak)
+      handle->delta_bytes_peak = handle->delta_bytes;
+   handle->delta_bytes_total += size;
+   handle->deltas++;
+
+   uint32_t *tmp = handle->last_state;
+   handle->last_state = handle->cur_state;
+   handle->cur_state = tmp;
    return true;
 }
 
-#define MAX_RETRIES 16
-#define RETRY_MS 500
-
-static int poll_input(netplay_t *handle, bool block)
+static void drop_state(netplay_t *handle, size_t ptr)
 {
-   int max_fd = (handle->fd > handle->udp_fd ? handle->fd : handle->udp_fd) + 1;
+   struct delta_frame *frame = &handle->buffer[ptr];
+   handle->delta_bytes -= frame->delta_size;
+   frame->delta_size = 0;
+   frame->has_state = false;
+}
 
-   struct timeval tv = {0};
-   tv.tv_sec = 0;
-   tv.tv_usec = block ? (RETRY_MS * 1000) : 0;
+// Rolls base_state forward to the newest stored frame up to and including ptr.
+static void advance_base(netplay_t *handle, size_t ptr)
+{
+   for (size_t i = handle->base_ptr; i != ptr; )
+   {
+      i = NEXT_PTR(i);
+      const struct delta_frame *frame = &handle->buffer[i];
+      if (frame->has_state)
+      {
+         state_delta_apply(handle->base_state, frame->delta, frame->delta_size);
+         handle->base_ptr = i;
+         handle->desync.base_hash = frame->hash;
+      }
+   }
+}
 
-   do
-   { 
-      handle->timeout_cnt++;
+static void histogram_add(struct netplay_histogram *hist, uint32_t value)
+{
+   unsigned bucket = 0;
+   while (bucket < TELEMETRY_BUCKETS - 1 && ((uint64_t)value + 1) >> (bucket + 1))
+      bucket++;
+
+   hist->buckets[bucket]++;
+   hist->count++;
+   hist->sum += value;
+   if (value > hist->max)
+      hist->max = value;
+}
 
-      // select() does not take pointer to const struct timeval.
-      // Technically possible for select() to modify tmp_tv, so we go paranoia mode.
-      struct timeval tmp_tv = tv;
+// Only the bucket of a percentile is known, so this gives the most it can be.
+static uint32_t histogram_percentile(const struct netplay_histogram *hist, unsigned percent)
+{
+   uint64_t target = (hist->count * percent + 99) / 100;
+   uint64_t seen = 0;
+   for (unsigned i = 0; i < TELEMETRY_BUCKETS; i++)
+   {
+      seen += hist->buckets[i];
+      if (seen >= target)
+      {
+         uint64_t upper = (UINT64_C(2) << i) - 2;
+         return upper < hist->max ? upper : hist->max;
+      }
+   }
+   return hist->max;
+}
 
-      fd_set fds;
-      FD_ZERO(&fds);
-      FD_SET(handle->udp_fd, &fds);
-      FD_SET(handle->fd, &fds);
+static void histogram_print(char *buf, size_t size, const struct netplay_histogram *hist)
+{
+   if (!hist->count)
+   {
+      strlcpy(buf, "none", size);
+      return;
+   }
 
-      if (select(max_fd, &fds, NULL, NULL, &tmp_tv) < 0)
-         return -1;
+   snprintf(buf, size, "mean %.0f, p50 %u, p95 %u, p99 %u, max %u",
+         (double)hist->sum / hist->count,
+         (unsigned)histogram_percentile(hist, 50), (unsigned)histogram_percentile(hist, 95),
+         (unsigned)histogram_percentile(hist, 99), (unsigned)hist->max);
+}
 
-      // Somewhat hacky,
-      // but we aren't using the TCP connection for anything useful atm.
-      if (FD_ISSET(handle->fd, &fds) && !netplay_get_cmd(handle))
+static void telemetry_dump(netplay_t *handle, const struct netplay_telemetry_stats *stats, const char *what)
+{
+   char rtt[128], jitter[128], stall[128], rollback[128];
+   histogram_print(rtt, sizeof(rtt), &stats->rtt);
+   histogram_print(jitter, sizeof(jitter), &stats->jitter);
+   histogram_print(stall, sizeof(stall), &stats->stall);
+   histogram_print(rollback, sizeof(rollback), &stats->rollback);
+
+   uint64_t sent = stats->packets + stats->lost;
+   char line[1024];
+   snprintf(line, sizeof(line),
+         "%s, frame %u: RTT usec [%s], jitter usec [%s], %.2f %% of %u packets lost, "
+         "%u stalls usec [%s], %u rollbacks frames [%s]",
+         what, (unsigned)handle->frame_count, rtt, jitter,
+         sent ? 100.0 * stats->lost / sent : 0.0, (unsigned)sent,
+         (unsigned)stats->stall.count, stall, (unsigned)stats->rollback.count, rollback);
+
+   if (handle->telemetry.file)
+   {
+      fprintf(handle->telemetry.file, "%s\n", line);
+      fflush(handle->telemetry.file);
+   }
+   else
+      SSNES_LOG("Netplay telemetry, %s.\n", line);
+}
+
+static void init_telemetry(netplay_t *handle)
+{
+   struct netplay_telemetry *tel = &handle->telemetry;
+   tel->dump_interval = g_settings.netplay_telemetry_interval;
+   tel->next_dump_usec = ssnes_get_time_usec() + tel->dump_interval * UINT64_C(1000000);
+
+   if (*g_settings.netplay_telemetry_path)
+   {
+      tel->file = fopen(g_settings.netplay_telemetry_path, "a");
+      if (!tel->file)
+         SSNES_WARN("Failed to open netplay telemetry file \"%s\", logging it instead.\n",
+               g_settings.netplay_telemetry_path);
+   }
+}
+
+static void deinit_telemetry(netplay_t *handle)
+{
+   if (handle->telemetry.total.packets)
+      telemetry_dump(handle, &handle->telemetry.total, "total");
+
+   if (handle->telemetry.file)
+      fclose(handle->telemetry.file);
+   handle->telemetry.file = NULL;
+}
+
+// Dumps what we have seen since the last dump, every dump_interval seconds.
+static void telemetry_poll(netplay_t *handle)
+{
+   struct netplay_telemetry *tel = &handle->telemetry;
+   if (!tel->dump_interval)
+      return;
+
+   int64_t now = ssnes_get_time_usec();
+   if (now < tel->next_dump_usec)
+      return;
+
+   telemetry_dump(handle, &tel->interval, "interval");
+   memset(&tel->interval, 0, sizeof(tel->interval));
+   tel->next_dump_usec = now + tel->dump_interval * UINT64_C(1000000);
+}
+
+static void telemetry_stall(netplay_t *handle, int64_t usec)
+{
+   histogram_add(&handle->telemetry.interval.stall, usec);
+   histogram_add(&handle->telemetry.total.stall, usec);
+}
+
+static void telemetry_rollback(netplay_t *handle, uint32_t frames)
+{
+   histogram_add(&handle->telemetry.interval.rollback, frames);
+   histogram_add(&handle->telemetry.total.rollback, frames);
+}
+
+static void telemetry_rtt(netplay_t *handle, uint32_t rtt)
+{
+   struct netplay_telemetry *tel = &handle->telemetry;
+   histogram_add(&tel->interval.rtt, rtt);
+   histogram_add(&tel->total.rtt, rtt);
+
+   if (tel->has_rtt)
+   {
+      uint32_t jitter = rtt > tel->last_rtt ? rtt - tel->last_rtt : tel->last_rtt - rtt;
+      histogram_add(&tel->interval.jitter, jitter);
+      histogram_add(&tel->total.jitter, jitter);
+   }
+
+   tel->rtt_avg = tel->rtt_avg ? tel->rtt_avg - tel->rtt_avg / 16 + rtt / 16 : rtt;
+   if (!tel->rtt_avg)
+      tel->rtt_avg = 1;
+   tel->last_rtt = rtt;
+   tel->has_rtt = true;
+}
+
+static unsigned netplay_frame_usec(void)
+{
+   float fps = g_settings.video.refresh_rate > 0.0f ? g_settings.video.refresh_rate : 60.0f;
+   return (unsigned)(1000000.0f / fps);
+}
+
+// How far ahead of the other player we are right now, in 1/1000 frames.
+// Their frame is guessed from the last one they told us about, how long ago that was, and half the round trip time.
+static int32_t time_sync_advantage(netplay_t *handle, int64_t now)
+{
+   if (!handle->time_sync.has_their_frame || !handle->telemetry.rtt_avg)
+      return 0;
+
+   double frame_usec = netplay_frame_usec();
+   double elapsed = handle->telemetry.rtt_avg / 2 + (now - handle->time_sync.their_frame_usec);
+   double their_frame = handle->time_sync.their_frame + elapsed / frame_usec;
+   return (int32_t)((handle->frame_count - their_frame) * 1000.0);
+}
+
+static void packet_put16(uint8_t **ptr, uint16_t value)
+{
+   value = htons(value);
+   memcpy(*ptr, &value, sizeof(value));
+   *ptr += sizeof(value);
+}
+
+static void packet_put32(uint8_t **ptr, uint32_t value)
+{
+   value = htonl(value);
+   memcpy(*ptr, &value, sizeof(value));
+   *ptr += sizeof(value);
+}
+
+static uint16_t packet_get16(const uint8_t **ptr)
+{
+   uint16_t value;
+   memcpy(&value, *ptr, sizeof(value));
+   *ptr += sizeof(value);
+   return ntohs(value);
+}
+
+static uint32_t packet_get32(const uint8_t **ptr)
+{
+   uint32_t value;
+   memcpy(&value, *ptr, sizeof(value));
+   *ptr += sizeof(value);
+   return ntohl(value);
+}
+
+static unsigned redundancy_frames(netplay_t *handle, double loss)
+{
+   double miss = loss;
+   unsigned frames = 1;
+   while (miss > REDUNDANCY_MISS_CHANCE && frames < handle->packet_frames)
+   {
+      miss *= loss;
+      frames++;
+   }
+   return frames > REDUNDANCY_MIN_FRAMES ? frames : REDUNDANCY_MIN_FRAMES;
+}
+
+// Each frame goes out in enough packets that all of them getting lost is unlikely.
+// Going back down takes a quarter less loss than it would take to go up, so a steady loss rate doesn't make it flip back and forth.
+static void update_redundancy(netplay_t *handle)
+{
+   double loss = handle->their_loss / 1000.0;
+   unsigned frames = redundancy_frames(handle, loss);
+   if (frames < handle->redundancy)
+   {
+      unsigned down = redundancy_frames(handle, min(loss * 1.25, 1.0));
+      frames = down < handle->redundancy ? down : handle->redundancy;
+   }
+
+   if (frames == handle->redundancy)
+      return;
+
+   handle->redundancy = frames;
+   SSNES_LOG("Netplay: resending %u frames of input in every packet, %.1f %% of our packets are lost.\n",
+         frames, handle->their_loss / 10.0);
+}
+
+// Oldest frame of input to put in the next packet. The ack we have from the other player is a round trip old,
+// so the frames we sent since are likely still on the way, and only the newest few are resent.
+// Frames that should have been acked by now were lost in every packet they went out in, and everything from the ack on is resent.
+static uint32_t packet_first_frame(netplay_t *handle, bool resend)
+{
+   uint32_t end = handle->input_send_frame;
+   uint32_t oldest = end > handle->packet_frames ? end - handle->packet_frames : 0;
+   if (!handle->has_their_ack)
+      return oldest;
+
+   uint32_t ack = handle->their_ack;
+   if (ack < oldest)
+      ack = oldest;
+   if (ack > end)
+      ack = end;
+   if (resend || !handle->telemetry.rtt_avg)
+      return ack;
+
+   uint32_t in_flight = handle->telemetry.rtt_avg / netplay_frame_usec() + 2;
+   if (end - ack > in_flight + handle->redundancy)
+      return ack;
+
+   uint32_t first = end > handle->redundancy ? end - handle->redundancy : 0;
+   return first > ack ? first : ack;
+}
+
+// Builds the packet we send after every frame, or again when we're stalling. Returns its size.
+static size_t encode_packet(netplay_t *handle, uint8_t *packet, bool resend)
+{
+   struct netplay_telemetry *tel = &handle->telemetry;
+   int64_t now = ssnes_get_time_usec();
+
+   uint32_t echo = 0;
+   if (tel->their_stamp)
+      echo = tel->their_stamp + (uint32_t)(now - tel->their_stamp_usec);
+
+   uint32_t first = packet_first_frame(handle, resend);
+   uint32_t end = handle->input_send_frame;
+
+   uint8_t *ptr = packet;
+   packet_put32(&ptr, (uint32_t)now | 1); // 0 means no stamp.
+   packet_put32(&ptr, echo);
+   packet_put32(&ptr, (uint32_t)time_sync_advantage(handle, now));
+   packet_put32(&ptr, handle->frame_count);
+   packet_put32(&ptr, handle->read_frame_count);
+   packet_put16(&ptr, (tel->loss_avg * 1000 + (1 << 15)) >> 16);
+   packet_put32(&ptr, first);
+   *ptr++ = end - first;
+
+   for (uint32_t frame = first; frame < end; )
+   {
+      uint16_t state = handle->send_history[frame % handle->packet_frames];
+      unsigned run = 1;
+      while (run < 255 && frame + run < end && handle->send_history[(frame + run) % handle->packet_frames] == state)
+         run++;
+
+      *ptr++ = run;
+      packet_put16(&ptr, state);
+      frame += run;
+   }
+
+   handle->sent.frames += end - first;
+   return ptr - packet;
+}
+
+// Reads the header of a packet, and checks that the runs after it add up to its frames.
+static bool decode_packet_header(struct packet_header *header, const uint8_t *packet, size_t size)
+{
+   if (size < PACKET_HEADER_SIZE)
+      return false;
+
+   const uint8_t *ptr = packet;
+   header->stamp = packet_get32(&ptr);
+   header->echo = packet_get32(&ptr);
+   header->advantage = (int32_t)packet_get32(&ptr);
+   header->cur_frame = packet_get32(&ptr);
+   header->ack = packet_get32(&ptr);
+   header->loss = packet_get16(&ptr);
+   header->base_frame = packet_get32(&ptr);
+   header->frames = *ptr++;
+
+   unsigned frames = 0;
+   for (; ptr + PACKET_RUN_SIZE <= packet + size; ptr += PACKET_RUN_SIZE)
+   {
+      if (!*ptr)
+         return false;
+      frames += *ptr;
+   }
+
+   return ptr == packet + size && frames == header->frames;
+}
+
+// Takes in the header of a packet, and counts the packets the other player sent before it that never arrived.
+static void telemetry_packet(netplay_t *handle, const struct packet_header *header, int64_t recv_usec)
+{
+   struct netplay_telemetry *tel = &handle->telemetry;
+
+   if (header->stamp && (!tel->their_stamp || (int32_t)(header->stamp - tel->their_stamp) > 0))
+   {
+      tel->their_stamp = header->stamp;
+      tel->their_stamp_usec = recv_usec;
+   }
+
+   if (header->echo && (uint32_t)recv_usec - header->echo < TELEMETRY_MAX_RTT_USEC)
+      telemetry_rtt(handle, (uint32_t)recv_usec - header->echo);
+
+   if (!handle->has_their_ack || header->ack > handle->their_ack)
+   {
+      handle->their_ack = header->ack;
+      handle->has_their_ack = true;
+   }
+
+   // The other player sends one packet per frame. Resent packets don't count.
+   // Anything from packets that arrive out of order is older than what we have.
+   uint32_t newest = header->cur_frame;
+   if (!tel->has_newest || newest > tel->newest_frame)
+   {
+      if (tel->has_newest)
+      {
+         uint32_t lost = newest - tel->newest_frame - 1;
+         tel->interval.lost += lost;
+         tel->total.lost += lost;
+         for (uint32_t i = 0; i < lost && i < 64; i++)
+            tel->loss_avg += ((1 << 16) - tel->loss_avg) >> 5;
+      }
+      tel->loss_avg -= tel->loss_avg >> 5;
+
+      tel->newest_frame = newest;
+      tel->has_newest = true;
+      tel->interval.packets++;
+      tel->total.packets++;
+
+      handle->time_sync.their_frame = header->cur_frame;
+      handle->time_sync.their_frame_usec = recv_usec;
+      handle->time_sync.has_their_frame = true;
+      handle->time_sync.their_advantage = header->advantage;
+
+      handle->their_loss = header->loss > 1000 ? 1000 : header->loss;
+      update_redundancy(handle);
+   }
+   else if (newest < tel->newest_frame)
+   {
+      // Late, not lost after all.
+      if (tel->interval.lost)
+         tel->interval.lost--;
+      if (tel->total.lost)
+         tel->total.lost--;
+      tel->interval.packets++;
+      tel->total.packets++;
+   }
+}
+
+static void log_state_stats(netplay_t *handle)
+{
+   if (!handle->deltas)
+      return;
+
+   size_t frames = handle->window - 1;
+   size_t full_size = handle->state_words * sizeof(uint32_t);
+   SSNES_LOG("Netplay: %u bytes per frame of window on average (%.1f %% of state size).\n",
+         (unsigned)(handle->delta_bytes_total / handle->deltas),
+         100.0 * handle->delta_bytes_total / (handle->deltas * full_size));
+   SSNES_LOG("Netplay: %u frame window peaked at %u KiB, with %u KiB of deltas and 3 full states allocated. Full states would take %u KiB.\n",
+         (unsigned)frames, (unsigned)((handle->delta_bytes_peak + 3 * full_size) >> 10),
+         (unsigned)(handle->delta_alloc >> 10), (unsigned)((handle->window * full_size) >> 10));
+
+   if (handle->replay.rollbacks)
+   {
+      uint64_t rollbacks = handle->replay.rollbacks;
+      SSNES_LOG("Netplay: %u rollbacks, %.1f frames replayed and %.1f frames re-simulated from checkpoints on average.\n",
+            (unsigned)rollbacks, (double)handle->replay.frames / rollbacks, (double)handle->replay.resimulated / rollbacks);
+
+      // Estimate what storing every replayed frame would have cost from the measured serialization and run times.
+      double serialize_usec = handle->replay.stored ? (double)handle->replay.serialize_usec / handle->replay.stored : 0.0;
+      double run_usec = (double)handle->replay.run_usec / (handle->replay.frames + handle->replay.resimulated);
+      double saved_usec = (handle->replay.skipped * serialize_usec - handle->replay.resimulated * run_usec) / rollbacks;
+      SSNES_LOG("Netplay: rollback took %.1f usec on average, %.1f usec spent serializing, %.1f usec saved by checkpointing.\n",
+            (double)handle->replay.usec / rollbacks, (double)handle->replay.serialize_usec / rollbacks, saved_usec);
+   }
+
+   if (handle->desync.checks)
+   {
+      SSNES_LOG("Netplay: compared %u state hashes, %u didn't match, resynced %u times.\n",
+            (unsigned)handle->desync.checks, (unsigned)handle->desync.mismatches, (unsigned)handle->desync.resyncs);
+   }
+
+   if (handle->sent.packets)
+   {
+      SSNES_LOG("Netplay: sent %u packets, %.1f bytes and %.1f frames of input each on average.\n",
+            (unsigned)handle->sent.packets, (double)handle->sent.bytes / handle->sent.packets,
+            (double)handle->sent.frames / handle->sent.packets);
+   }
+
+   if (handle->time_sync.waited)
+      SSNES_LOG("Netplay: waited out %u frames to let the other player catch up.\n", (unsigned)handle->time_sync.waited);
+
+   if (handle->predictor.predicted)
+   {
+      double seconds = (ssnes_get_time_usec() - handle->start_usec) / 1000000.0;
+      SSNES_LOG("Netplay: \"%s\" prediction was right for %.1f %% of %u frames, %.2f rollbacks per second, %.1f frames deep on average.\n",
+            prediction_names[handle->predictor.type],
+            100.0 * handle->predictor.hits / handle->predictor.predicted, (unsigned)handle->predictor.predicted,
+            seconds > 0.0 ? handle->replay.rollbacks / seconds : 0.0,
+            handle->replay.rollbacks ? (double)handle->replay.frames / handle->replay.rollbacks : 0.0);
+   }
+}
+
+void netplay_get_stats(netplay_t *handle, struct netplay_stats *stats)
+{
+   memset(stats, 0, sizeof(*stats));
+   if (handle->spectate)
+      return;
+
+   const struct netplay_telemetry_stats *total = &handle->telemetry.total;
+   stats->frames = handle->frame_count;
+   stats->rollbacks = handle->replay.rollbacks;
+   stats->replayed_frames = handle->replay.frames;
+   stats->resimulated_frames = handle->replay.resimulated;
+   stats->replay_usec = handle->replay.usec;
+   stats->predicted_frames = handle->predictor.predicted;
+   stats->prediction_hits = handle->predictor.hits;
+   stats->time_sync_frames = handle->time_sync.waited;
+   stats->stalls = total->stall.count;
+   stats->stall_usec = total->stall.sum;
+   stats->packets = total->packets;
+   stats->packets_lost = total->lost;
+   stats->desync_checks = handle->desync.checks;
+   stats->desyncs = handle->desync.mismatches;
+   stats->resyncs = handle->desync.resyncs;
+   stats->packets_sent = handle->sent.packets;
+   stats->bytes_sent = handle->sent.bytes;
+   stats->frames_sent = handle->sent.frames;
+   stats->rtt_samples = total->rtt.count;
+   stats->rtt_usec_total = total->rtt.sum;
+}
+
+netplay_t *netplay_new(const char *server, uint16_t port,
+      unsigned frames, const struct snes_callbacks *cb,
+      bool spectate,
+      const char *nick)
+{
+   (void)spectate;
+
+   if (frames > NETPLAY_MAX_FRAMES)
+      frames = NETPLAY_MAX_FRAMES;
+
+   netplay_t *handle = (netplay_t*)calloc(1, sizeof(*handle));
+   if (!handle)
+      return NULL;
+
+   handle->fd = -1;
+   handle->udp_fd = -1;
+   handle->cbs = *cb;
+   handle->port = server ? 0 : 1;
+   handle->spectate = spectate;
+   handle->spectate_client = server != NULL;
+   strlcpy(handle->nick, nick, sizeof(handle->nick));
+
+   if (!init_socket(handle, server, port))
+   {
+      free(handle);
+      return NULL;
+   }
+
+   if (spectate)
+   {
+      if (server)
+      {
+         if (!get_info_spectate(handle))
+            goto error;
+      }
+
+      else if (!init_spectators(handle))
+      {
+         SSNES_ERR("Failed to start spectator stream.\n");
+         goto error;
+      }
+   }
+   else
+   {
+      if (server)
+      {
+         if (!send_info(handle))
+            goto error;
+      }
+      else
+      {
+         if (!get_info(handle))
+            goto error;
+      }
+
+      // Base state can trail the last confirmed frame by up to a checkpoint interval,
+      // so the ring needs room for those frames on top of the window.
+      // Input from either side can also be for frames up to NETPLAY_MAX_INPUT_DELAY frames ahead.
+      handle->window = frames + 1;
+      handle->buffer_size = handle->window + REPLAY_CHECKPOINT_INTERVAL - 1 + NETPLAY_MAX_INPUT_DELAY;
+      init_input_delay(handle);
+      handle->time_sync.enable = g_settings.netplay_time_sync;
+      handle->desync.interval = g_settings.netplay_check_frames;
+      handle->desync.next_frame = handle->desync.interval;
+
+      if (!init_buffers(handle))
+      {
+         SSNES_ERR("Failed to allocate netplay state buffers.\n");
+         goto error;
+      }
+
+      init_predictor(&handle->predictor, g_settings.netplay_prediction);
+      init_telemetry(handle);
+      handle->start_usec = ssnes_get_time_usec();
+
+#ifdef HAVE_NETPLAY_THREAD
+      if (!init_io_thread(handle))
+      {
+         SSNES_ERR("Failed to start netplay I/O thread.\n");
+         goto error;
+      }
+#endif
+      handle->has_connection = true;
+   }
+
+   return handle;
+
+error:
+   if (handle->fd >= 0)
+      close(handle->fd);
+   if (handle->udp_fd >= 0)
+      close(handle->udp_fd);
+
+#ifdef HAVE_NETPLAY_THREAD
+   deinit_io_thread(handle);
+#endif
+   deinit_spectators(handle);
+   deinit_buffers(handle);
+   free(handle);
+   return NULL;
+}
+
+
+static bool netplay_is_alive(netplay_t *handle)
+{
+   return handle->has_connection;
+}
+
+// Sends our input. If resend is set, the last packet didn't get us anything back,
+// and everything the other player hasn't acked goes out again.
+static bool send_chunk(netplay_t *handle, bool resend)
+{
+   const struct sockaddr *addr = NULL;
+   if (handle->addr)
+      addr = handle->addr->ai_addr;
+   else if (handle->has_client_addr)
+      addr = (const struct sockaddr*)&handle->their_addr;
+
+   if (addr)
+   {
+      uint8_t packet[MAX_PACKET_SIZE];
+      ssize_t size = encode_packet(handle, packet, resend);
+      if (sendto(handle->udp_fd, CONST_CAST packet,
+               size, 0, addr,
+               sizeof(struct sockaddr)) != size)
+      {
+         warn_hangup();
+         handle->has_connection = false;
+         return false;
+      }
+
+      handle->sent.packets++;
+      handle->sent.bytes += size;
+   }
+   return true;
+}
+
+#define MAX_RETRIES 16
+#define RETRY_MS 500
+
+// Called after our input for this frame is stored. Once we're a whole window ahead of the other player, we have to wait.
+static bool netplay_window_full(netplay_t *handle)
+{
+   return handle->frame_count + 1 - handle->other_frame_count >= handle->window;
+}
+
+#ifndef HAVE_NETPLAY_THREAD
+static int poll_input(netplay_t *handle, bool block)
+{
+   int max_fd = (handle->fd > handle->udp_fd ? handle->fd : handle->udp_fd) + 1;
+
+   struct timeval tv = {0};
+   tv.tv_sec = 0;
+   tv.tv_usec = block ? (RETRY_MS * 1000) : 0;
+
+   do
+   { 
+      // select() does not take pointer to const struct timeval.
+      // Technically possible for select() to modify tmp_tv, so we go paranoia mode.
+      struct timeval tmp_tv = tv;
+
+      fd_set fds;
+      FD_ZERO(&fds);
+      FD_SET(handle->udp_fd, &fds);
+      FD_SET(handle->fd, &fds);
+
+      int ret = select(max_fd, &fds, NULL, NULL, &tmp_tv);
+      if (ret < 0)
+         return -1;
+
+      if (FD_ISSET(handle->fd, &fds) && !netplay_get_cmd(handle))
          return -1; 
 
-      if (FD_ISSET(handle->udp_fd, &fds))
-         return 1;
+      if (FD_ISSET(handle->udp_fd, &fds))
+         return 1;
+
+      // A command came in over TCP (e.g. a state hash), or we're only polling, so nothing has timed out.
+      if (ret > 0 || !block)
+         continue;
+
+      if (++handle->timeout_cnt >= MAX_RETRIES)
+         break;
+
+      if (!send_chunk(handle, true))
+      {
+         warn_hangup();
+         handle->has_connection = false;
+         return -1;
+      }
+
+      SSNES_LOG("Network is stalling, resending packet... Count %u of %d ...\n",
+            handle->timeout_cnt, MAX_RETRIES);
+   } while (block);
+
+   if (block)
+      return -1;
+   return 0;
+}
+#endif
+
+// Grab our own input state and send this over the network.
+static void init_input_delay(netplay_t *handle)
+{
+   handle->input_delay_auto = g_settings.netplay_input_delay_auto;
+   handle->input_delay_max = g_settings.netplay_input_delay;
+   if (handle->input_delay_max > NETPLAY_MAX_INPUT_DELAY || (handle->input_delay_auto && !handle->input_delay_max))
+      handle->input_delay_max = NETPLAY_MAX_INPUT_DELAY;
+
+   // Automatic delay starts out at none, and grows once we know the round trip time.
+   handle->input_delay = handle->input_delay_auto ? 0 : handle->input_delay_max;
+   if (handle->input_delay_auto)
+      SSNES_LOG("Netplay: input delay follows round trip time, up to %u frames.\n", handle->input_delay_max);
+   else if (handle->input_delay)
+      SSNES_LOG("Netplay: %u frames of input delay.\n", handle->input_delay);
+}
+
+// With automatic delay, our input is delayed by about as long as it takes to reach the other player,
+// so it gets there right when they need it. The delay moves a frame at a time, so a spike in ping doesn't cause a jump.
+static void update_input_delay(netplay_t *handle)
+{
+   if (!handle->input_delay_auto || !handle->telemetry.rtt_avg || handle->frame_count % INPUT_DELAY_AUTO_INTERVAL)
+      return;
+
+   unsigned frame_usec = netplay_frame_usec();
+   unsigned wanted = (handle->telemetry.rtt_avg / 2 + frame_usec / 2) / frame_usec;
+   if (wanted > handle->input_delay_max)
+      wanted = handle->input_delay_max;
+
+   if (wanted == handle->input_delay)
+      return;
+
+   handle->input_delay += wanted > handle->input_delay ? 1 : -1;
+   SSNES_LOG("Netplay: input delay is now %u frames, round trip time is %u ms.\n",
+         handle->input_delay, handle->telemetry.rtt_avg / 1000);
+}
+
+static bool get_self_input_state(netplay_t *handle)
+{
+   uint32_t state = 0;
+   if (handle->frame_count > 0) // First frame we always give zero input since relying on input from first frame screws up when we use -F 0.
+   {
+      snes_input_state_t cb = handle->cbs.state_cb;
+      for (unsigned i = 0; i < SSNES_FIRST_META_KEY; i++)
+      {
+         int16_t tmp = cb(g_settings.input.netplay_client_swap_input ? 0 : !handle->port,
+               SNES_DEVICE_JOYPAD, 0, i);
+         state |= tmp ? 1 << i : 0;
+      }
+   }
+
+   // Our input is for the frame input_delay frames from now. If the delay grew, the frames in between get it too.
+   // If it shrank, we have sent input for that frame already, and this input is dropped.
+   uint32_t target = handle->frame_count + handle->input_delay;
+   for (; handle->input_send_frame <= target; handle->input_send_frame++)
+   {
+      size_t ptr = (handle->self_ptr + handle->input_send_frame - handle->frame_count) % handle->buffer_size;
+      handle->buffer[ptr].self_state = state;
+      handle->send_history[handle->input_send_frame % handle->packet_frames] = state;
+   }
+
+   if (!send_chunk(handle, false))
+   {
+      warn_hangup();
+      handle->has_connection = false;
+      return false;
+   }
+
+   handle->self_ptr = NEXT_PTR(handle->self_ptr);
+   return true;
+}
+
+static void simulate_input(netplay_t *handle)
+{
+   size_t ptr = PREV_PTR(handle->self_ptr);
+   unsigned ahead = handle->frame_count + 1 - handle->read_frame_count;
+
+   handle->buffer[ptr].simulated_input_state = predictor_predict(&handle->predictor, ahead);
+   handle->buffer[ptr].is_simulated = true;
+   handle->buffer[ptr].used_real = false;
+}
+
+static void parse_packet(netplay_t *handle, const uint8_t *packet, size_t size, int64_t recv_usec)
+{
+   struct packet_header header;
+   if (!decode_packet_header(&header, packet, size))
+   {
+      SSNES_WARN("Netplay: got a broken packet, ignoring it.\n");
+      return;
+   }
+
+   telemetry_packet(handle, &header, recv_usec);
+
+   uint32_t frame = header.base_frame;
+   const uint8_t *ptr = packet + PACKET_HEADER_SIZE;
+   while (ptr < packet + size)
+   {
+      unsigned run = *ptr++;
+      uint16_t state = packet_get16(&ptr);
+
+      for (uint32_t end = frame + run; frame < end; frame++)
+      {
+         if (frame != handle->read_frame_count || handle->read_frame_count > handle->frame_count + NETPLAY_MAX_INPUT_DELAY)
+            continue;
+
+         // Frames we have run already were run with predicted input.
+         if (frame < handle->frame_count)
+         {
+            handle->predictor.predicted++;
+            if (handle->buffer[handle->read_ptr].simulated_input_state == state)
+               handle->predictor.hits++;
+         }
+         predictor_update(&handle->predictor, state);
+
+         handle->buffer[handle->read_ptr].is_simulated = false;
+         handle->buffer[handle->read_ptr].real_input_state = state;
+         handle->read_ptr = NEXT_PTR(handle->read_ptr);
+         handle->read_frame_count++;
+         handle->timeout_cnt = 0;
+      }
+   }
+}
+
+#ifndef HAVE_NETPLAY_THREAD
+// Packets carry as many frames as the sender has to resend, so their size is not known up front.
+// Returns the size of the packet, or 0 on error.
+static size_t receive_data(netplay_t *handle, uint8_t *buffer, size_t size)
+{
+   socklen_t addrlen = sizeof(handle->their_addr);
+   ssize_t ret = recvfrom(handle->udp_fd, NONCONST_CAST buffer, size, 0, (struct sockaddr*)&handle->their_addr, &addrlen);
+   if (ret <= 0)
+      return 0;
+   handle->has_client_addr = true;
+   return ret;
+}
+#endif
+
+#ifdef HAVE_NETPLAY_THREAD
+// Waits until a socket is readable, or timeout_ms passes. Returns false on error.
+static bool wait_readable(netplay_t *handle, unsigned timeout_ms, bool *udp_ready, bool *tcp_ready)
+{
+#ifdef _WIN32
+   // WSAPoll() is not available on XP.
+   fd_set fds;
+   FD_ZERO(&fds);
+   FD_SET(handle->udp_fd, &fds);
+   FD_SET(handle->fd, &fds);
+
+   struct timeval tv = {0};
+   tv.tv_sec = timeout_ms / 1000;
+   tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+   int max_fd = (handle->fd > handle->udp_fd ? handle->fd : handle->udp_fd) + 1;
+   if (select(max_fd, &fds, NULL, NULL, &tv) < 0)
+      return false;
+
+   *udp_ready = FD_ISSET(handle->udp_fd, &fds);
+   *tcp_ready = FD_ISSET(handle->fd, &fds);
+#else
+   struct pollfd fds[2];
+   memset(fds, 0, sizeof(fds));
+   fds[0].fd = handle->udp_fd;
+   fds[0].events = POLLIN;
+   fds[1].fd = handle->fd;
+   fds[1].events = POLLIN;
+
+   int ret = poll(fds, 2, timeout_ms);
+   if (ret < 0)
+      return errno == EINTR;
+
+   *udp_ready = fds[0].revents & POLLIN;
+   *tcp_ready = fds[1].revents & (POLLIN | POLLHUP | POLLERR);
+#endif
+   return true;
+}
+
+// Only the I/O thread writes events, and only the emulation thread reads them.
+static struct net_event *io_queue_reserve(netplay_t *handle)
+{
+   if (handle->io.write - handle->io.read >= NET_EVENT_QUEUE_SIZE)
+      return NULL;
+   return &handle->io.queue[handle->io.write & (NET_EVENT_QUEUE_SIZE - 1)];
+}
+
+static void io_queue_commit(netplay_t *handle)
+{
+   NETPLAY_BARRIER();
+   handle->io.write++;
+
+   slock_lock(handle->io.lock);
+   scond_signal(handle->io.cond);
+   slock_unlock(handle->io.lock);
+}
+
+static void netplay_io_thread(void *data)
+{
+   netplay_t *handle = (netplay_t*)data;
+
+   while (!handle->io.quit)
+   {
+      // If the emulation thread is far behind, let the socket buffers hold on to the data.
+      struct net_event *event = io_queue_reserve(handle);
+      if (!event)
+      {
+         ssnes_sleep(1);
+         continue;
+      }
+
+      bool udp_ready = false, tcp_ready = false;
+      if (!wait_readable(handle, NET_THREAD_POLL_MS, &udp_ready, &tcp_ready))
+         goto hangup;
+
+      if (udp_ready)
+      {
+         socklen_t addrlen = sizeof(event->addr);
+         ssize_t ret = recvfrom(handle->udp_fd, NONCONST_CAST event->data, sizeof(event->data), 0,
+               (struct sockaddr*)&event->addr, &addrlen);
+         if (ret <= 0)
+            goto hangup;
+
+         event->type = NET_EVENT_PACKET;
+         event->size = ret;
+         event->recv_usec = ssnes_get_time_usec();
+         io_queue_commit(handle);
+
+         if (!(event = io_queue_reserve(handle)))
+            continue;
+      }
+
+      if (tcp_ready)
+      {
+         if (!netplay_read_cmd(handle->fd, &event->cmd, event->data, &event->size, sizeof(event->data)))
+            goto hangup;
+         event->type = NET_EVENT_CMD;
+         io_queue_commit(handle);
+      }
+   }
+   return;
+
+hangup:
+   // Leave room for the hangup event, the emulation thread will drain the queue eventually.
+   while (!handle->io.quit)
+   {
+      struct net_event *event = io_queue_reserve(handle);
+      if (event)
+      {
+         event->type = NET_EVENT_HANGUP;
+         io_queue_commit(handle);
+         return;
+      }
+      ssnes_sleep(1);
+   }
+}
+
+static bool init_io_thread(netplay_t *handle)
+{
+   handle->cmd_response = -1;
+   handle->io.queue = (struct net_event*)calloc(NET_EVENT_QUEUE_SIZE, sizeof(*handle->io.queue));
+   handle->io.lock = slock_new();
+   handle->io.cond = scond_new();
+   if (!handle->io.queue || !handle->io.lock || !handle->io.cond)
+      return false;
+
+   handle->io.thread = sthread_create(netplay_io_thread, handle);
+   return handle->io.thread;
+}
+
+static void deinit_io_thread(netplay_t *handle)
+{
+   if (handle->io.thread)
+   {
+      handle->io.quit = true;
+      sthread_join(handle->io.thread);
+   }
+
+   if (handle->io.lock)
+      slock_free(handle->io.lock);
+   if (handle->io.cond)
+      scond_free(handle->io.cond);
+   free(handle->io.queue);
+   memset(&handle->io, 0, sizeof(handle->io));
+}
+
+// Handles everything the I/O thread has received so far. Returns false if the connection is lost.
+static bool drain_io_queue(netplay_t *handle)
+{
+   while (handle->io.read != handle->io.write)
+   {
+      NETPLAY_BARRIER();
+      struct net_event *event = &handle->io.queue[handle->io.read & (NET_EVENT_QUEUE_SIZE - 1)];
+
+      switch (event->type)
+      {
+         case NET_EVENT_PACKET:
+            memcpy(&handle->their_addr, &event->addr, sizeof(handle->their_addr));
+            handle->has_client_addr = true;
+            parse_packet(handle, (const uint8_t*)event->data, event->size, event->recv_usec);
+            break;
+
+         case NET_EVENT_CMD:
+            if (!netplay_handle_cmd(handle, event->cmd, event->data, event->size))
+               return false;
+            break;
+
+         case NET_EVENT_HANGUP:
+            return false;
+      }
+
+      NETPLAY_BARRIER();
+      handle->io.read++;
+   }
+
+   return true;
+}
+
+// Sleeps until the I/O thread has something for us. Returns false on timeout.
+static bool wait_io_queue(netplay_t *handle, unsigned timeout_ms)
+{
+   slock_lock(handle->io.lock);
+   bool ret = handle->io.read != handle->io.write ||
+      scond_wait_timeout(handle->io.cond, handle->io.lock, timeout_ms);
+   slock_unlock(handle->io.lock);
+   return ret;
+}
+
+// Takes new input from the I/O thread. Only blocks if we're a whole window ahead of the other player,
+// in which case our packet is resent every RETRY_MS until we hear from them again.
+static bool poll_io_queue(netplay_t *handle)
+{
+   uint32_t first_read = handle->read_frame_count;
+   if (!drain_io_queue(handle))
+      return false;
+
+   if (!netplay_window_full(handle))
+      return true;
+
+   int64_t stall_start = ssnes_get_time_usec();
+   while (first_read == handle->read_frame_count)
+   {
+      if (!wait_io_queue(handle, RETRY_MS))
+      {
+         if (++handle->timeout_cnt >= MAX_RETRIES || !send_chunk(handle, true))
+            return false;
+
+         SSNES_LOG("Network is stalling, resending packet... Count %u of %d ...\n",
+               handle->timeout_cnt, MAX_RETRIES);
+      }
+
+      if (!drain_io_queue(handle))
+         return false;
+   }
+
+   telemetry_stall(handle, ssnes_get_time_usec() - stall_start);
+   return true;
+}
+
+static bool netplay_get_response(netplay_t *handle)
+{
+   handle->cmd_response = -1;
+   for (unsigned i = 0; i < MAX_RETRIES && handle->cmd_response < 0; i++)
+   {
+      wait_io_queue(handle, RETRY_MS);
+      if (!drain_io_queue(handle))
+         return false;
+   }
+
+   return handle->cmd_response > 0;
+}
+#else
+// The other player can send commands of their own before answering ours.
+static bool netplay_get_response(netplay_t *handle)
+{
+   for (;;)
+   {
+      uint32_t cmd;
+      uint32_t data[(MAX_EVENT_SIZE + 3) / 4];
+      size_t size;
+      if (!netplay_read_cmd(handle->fd, &cmd, data, &size, sizeof(data)))
+         return false;
+
+      if (cmd == NETPLAY_CMD_ACK || cmd == NETPLAY_CMD_NAK)
+         return cmd == NETPLAY_CMD_ACK;
+
+      if (!netplay_handle_cmd(handle, cmd, data, size))
+         return false;
+   }
+}
+#endif
+
+// Poll network to see if we have anything new. If our network buffer is full, we simply have to block for new input data.
+static bool netplay_poll(netplay_t *handle)
+{
+   if (!handle->has_connection)
+      return false;
+
+   handle->can_poll = false;
+
+   update_input_delay(handle);
+   if (!get_self_input_state(handle))
+      return false;
+
+   // We skip reading the first frame so the host has a chance to grab our host info so we don't block forever :')
+   if (handle->frame_count == 0)
+   {
+      handle->buffer[0].used_real = true;
+      handle->buffer[0].is_simulated = false;
+      handle->buffer[0].real_input_state = 0;
+      handle->read_ptr = NEXT_PTR(handle->read_ptr);
+      handle->read_frame_count++;
+      return true;
+   }
+
+#ifdef HAVE_NETPLAY_THREAD
+   if (!poll_io_queue(handle))
+   {
+      handle->has_connection = false;
+      warn_hangup();
+      return false;
+   }
+#else
+   // We might have reached the end of the buffer, where we simply have to block.
+   bool stall = netplay_window_full(handle);
+   int64_t stall_start = ssnes_get_time_usec();
+   int res = poll_input(handle, stall);
+   if (res == -1)
+   {
+      handle->has_connection = false;
+      warn_hangup();
+      return false;
+   }
+
+   if (res == 1)
+   {
+      uint32_t first_read = handle->read_frame_count;
+      do 
+      {
+         uint8_t buffer[MAX_PACKET_SIZE];
+         size_t size = receive_data(handle, buffer, sizeof(buffer));
+         if (!size)
+         {
+            warn_hangup();
+            handle->has_connection = false;
+            return false;
+         }
+         // We only read the socket once a frame, so RTT includes however long the packet waited for that.
+         parse_packet(handle, buffer, size, ssnes_get_time_usec());
+
+      } while ((handle->read_frame_count <= handle->frame_count + NETPLAY_MAX_INPUT_DELAY) && 
+            poll_input(handle, netplay_window_full(handle) && 
+               (first_read == handle->read_frame_count)) == 1);
+   }
+   else
+   {
+      // Cannot allow this. Should not happen though.
+      if (netplay_window_full(handle))
+      {
+         warn_hangup();
+         return false;
+      }
+   }
+
+   if (stall)
+      telemetry_stall(handle, ssnes_get_time_usec() - stall_start);
+#endif
+
+   if (handle->read_frame_count <= handle->frame_count)
+      simulate_input(handle);
+   else
+      handle->buffer[PREV_PTR(handle->self_ptr)].used_real = true;
+
+   return true;
+}
+
+static bool netplay_send_cmd(netplay_t *handle, uint32_t cmd, const void *data, size_t size)
+{
+   cmd = (cmd << 16) | (size & 0xffff);
+   cmd = htonl(cmd);
+
+   if (!send_all(handle->fd, &cmd, sizeof(cmd)))
+      return false;
+
+   if (!send_all(handle->fd, data, size))
+      return false;
+
+   return true;
+}
+
+static bool netplay_cmd_ack(netplay_t *handle)
+{
+   uint32_t cmd = htonl(NETPLAY_CMD_ACK);
+   return send_all(handle->fd, &cmd, sizeof(cmd));
+}
+
+static bool netplay_cmd_nak(netplay_t *handle)
+{
+   uint32_t cmd = htonl(NETPLAY_CMD_NAK);
+   return send_all(handle->fd, &cmd, sizeof(cmd));
+}
+
+// Reads a command and its argument. Arguments that don't fit in max_size are skipped,
+// so the command handler will reject them by size.
+static bool netplay_read_cmd(int fd, uint32_t *cmd, void *data, size_t *size, size_t max_size)
+{
+   uint32_t header;
+   if (!recv_all(fd, &header, sizeof(header)))
+      return false;
+
+   header = ntohl(header);
+   *cmd = header >> 16;
+   *size = header & 0xffff;
+
+   if (*size <= max_size)
+      return recv_all(fd, data, *size);
+
+   uint8_t discard[256];
+   for (size_t left = *size; left; )
+   {
+      size_t chunk = left < sizeof(discard) ? left : sizeof(discard);
+      if (!recv_all(fd, discard, chunk))
+         return false;
+      left -= chunk;
+   }
+   return true;
+}
+
+static bool desync_alloc(netplay_t *handle)
+{
+   if (!handle->desync.packed)
+      handle->desync.packed = (uint8_t*)malloc(STATE_DELTA_MAX_SIZE(handle->state_words));
+   if (!handle->desync.state)
+      handle->desync.state = (uint32_t*)malloc(handle->state_words * sizeof(uint32_t));
+   return handle->desync.packed && handle->desync.state;
+}
+
+// Sends the newest state we know to be right, in pieces that fit in a command. Hashes taken from now on belong to the next resync.
+static bool desync_send_state(netplay_t *handle)
+{
+   if (!desync_alloc(handle))
+   {
+      SSNES_ERR("Failed to allocate netplay resync state.\n");
+      return true;
+   }
+
+   advance_base(handle, handle->other_ptr == handle->self_ptr ? PREV_PTR(handle->self_ptr) : handle->other_ptr);
+   uint32_t frame = handle->other_frame_count -
+      (handle->other_ptr + handle->buffer_size - handle->base_ptr) % handle->buffer_size;
+   size_t size = pack_state(handle->desync.packed, handle->desync.state, handle->base_state, handle->state_words);
+   handle->desync.epoch++;
+
+   size_t offset = 0;
+   do
+   {
+      uint8_t piece[MAX_CMD_SIZE];
+      size_t len = size - offset < MAX_CMD_SIZE - RESYNC_HEADER_SIZE ? size - offset : MAX_CMD_SIZE - RESYNC_HEADER_SIZE;
+
+      uint8_t *ptr = piece;
+      packet_put32(&ptr, frame);
+      packet_put32(&ptr, handle->desync.epoch);
+      packet_put32(&ptr, size);
+      packet_put32(&ptr, offset);
+      memcpy(ptr, handle->desync.packed + offset, len);
+
+      if (!netplay_send_cmd(handle, NETPLAY_CMD_RESYNC, piece, RESYNC_HEADER_SIZE + len))
+         return false;
+      offset += len;
+   } while (offset < size);
+
+   handle->desync.resyncs++;
+   SSNES_LOG("Netplay: sent our state of frame %u to resync, %u bytes packed.\n", (unsigned)frame, (unsigned)size);
+   return true;
+}
+
+// Hashes are matched up with the other player's hash of the same frame. Only the host can act on a mismatch,
+// by sending its state over, so the client waits for it.
+static void desync_add_hash(netplay_t *handle, bool ours, uint32_t frame, uint32_t epoch, uint64_t hash)
+{
+   if (epoch != handle->desync.epoch)
+      return;
+
+   struct desync_hash *list = ours ? handle->desync.ours : handle->desync.theirs;
+   struct desync_hash *other = ours ? handle->desync.theirs : handle->desync.ours;
+   unsigned *ptr = ours ? &handle->desync.ours_ptr : &handle->desync.theirs_ptr;
+
+   for (unsigned i = 0; i < DESYNC_HASH_HISTORY; i++)
+   {
+      if (!other[i].valid || other[i].frame != frame || other[i].epoch != epoch)
+         continue;
+
+      other[i].valid = false;
+      handle->desync.checks++;
+      if (other[i].hash == hash)
+         return;
+
+      handle->desync.mismatches++;
+      SSNES_WARN("Netplay: desync at frame %u.\n", (unsigned)frame);
+
+      if (handle->port == 1)
+      {
+         msg_queue_push(g_extern.msg_queue, "Netplay desync, sending our state to the other player ...", 1, 180);
+         if (!desync_send_state(handle))
+         {
+            warn_hangup();
+            handle->has_connection = false;
+         }
+      }
+      else
+         msg_queue_push(g_extern.msg_queue, "Netplay desync, waiting for the host's state ...", 1, 180);
+      return;
+   }
+
+   struct desync_hash *entry = &list[(*ptr)++ % DESYNC_HASH_HISTORY];
+   entry->frame = frame;
+   entry->epoch = epoch;
+   entry->hash = hash;
+   entry->valid = true;
+}
+
+// Sends the hash of every interval-th frame once it's confirmed, which is when both players have run it with the same input.
+static void desync_check(netplay_t *handle)
+{
+   while (handle->desync.interval && handle->has_connection && handle->desync.next_frame < handle->other_frame_count)
+   {
+      uint32_t frame = handle->desync.next_frame;
+      handle->desync.next_frame += handle->desync.interval;
+
+      size_t ptr = (handle->other_ptr + handle->buffer_size -
+            (handle->other_frame_count - frame) % handle->buffer_size) % handle->buffer_size;
+      if (!handle->buffer[ptr].has_state)
+         continue;
+
+      uint64_t hash = handle->buffer[ptr].hash;
+      uint32_t data[4] = {
+         htonl(frame), htonl(handle->desync.epoch),
+         htonl((uint32_t)(hash >> 32)), htonl((uint32_t)hash),
+      };
+
+      if (!netplay_send_cmd(handle, NETPLAY_CMD_STATE_HASH, data, sizeof(data)))
+      {
+         warn_hangup();
+         handle->has_connection = false;
+         return;
+      }
+
+      desync_add_hash(handle, true, frame, handle->desync.epoch, hash);
+   }
+}
+
+static bool desync_receive_hash(netplay_t *handle, const void *data, size_t size)
+{
+   uint32_t hash[4];
+   if (size != sizeof(hash))
+   {
+      SSNES_ERR("CMD_STATE_HASH has unexpected command size.\n");
+      return true;
+   }
+
+   if (!handle->desync.interval)
+      return true;
+
+   memcpy(hash, data, sizeof(hash));
+   desync_add_hash(handle, false, ntohl(hash[0]), ntohl(hash[1]),
+         ((uint64_t)ntohl(hash[2]) << 32) | ntohl(hash[3]));
+   return true;
+}
+
+static bool desync_receive_state(netplay_t *handle, const void *data, size_t size)
+{
+   if (size < RESYNC_HEADER_SIZE)
+   {
+      SSNES_ERR("CMD_RESYNC has unexpected command size.\n");
+      return true;
+   }
+
+   // Only the host sends its state.
+   if (handle->port == 1 || !desync_alloc(handle))
+      return true;
+
+   const uint8_t *ptr = (const uint8_t*)data;
+   uint32_t frame = packet_get32(&ptr);
+   uint32_t epoch = packet_get32(&ptr);
+   uint32_t packed_size = packet_get32(&ptr);
+   uint32_t offset = packet_get32(&ptr);
+   size_t len = size - RESYNC_HEADER_SIZE;
+
+   if (offset == 0)
+   {
+      handle->desync.receiving = true;
+      handle->desync.packed_received = 0;
+      handle->desync.packed_size = packed_size;
+      handle->desync.frame = frame;
+      handle->desync.pending_epoch = epoch;
+   }
+
+   if (!handle->desync.receiving || frame != handle->desync.frame || epoch != handle->desync.pending_epoch ||
+         offset != handle->desync.packed_received || packed_size != handle->desync.packed_size ||
+         packed_size > STATE_DELTA_MAX_SIZE(handle->state_words) || len > packed_size - offset)
+   {
+      SSNES_ERR("Got a broken netplay resync state.\n");
+      handle->desync.receiving = false;
+      return true;
+   }
+
+   memcpy(handle->desync.packed + offset, ptr, len);
+   handle->desync.packed_received += len;
+   if (handle->desync.packed_received < packed_size)
+      return true;
+
+   handle->desync.receiving = false;
+   memset(handle->desync.state, 0, handle->state_words * sizeof(uint32_t));
+   if (!state_delta_apply_checked(handle->desync.state, handle->state_words, handle->desync.packed, packed_size))
+   {
+      SSNES_ERR("Got a broken netplay resync state.\n");
+      return true;
+   }
+
+   handle->desync.pending = true;
+   return true;
+}
+
+// Switches to the host's state once we have confirmed its frame too, so it's behind everything we might replay.
+// The frame has to still be in the ring, as we need the input that came after it. Returns true if we switched.
+static bool desync_apply(netplay_t *handle)
+{
+   if (!handle->desync.pending)
+      return false;
+
+   uint32_t frame = handle->desync.frame;
+   if (frame >= handle->frame_count || frame > handle->other_frame_count)
+      return false;
+
+   handle->desync.pending = false;
+   handle->desync.epoch = handle->desync.pending_epoch;
+
+   if (handle->frame_count + NETPLAY_MAX_INPUT_DELAY - frame >= handle->buffer_size)
+   {
+      SSNES_WARN("Netplay: resync state of frame %u is too old to use, waiting for another.\n", (unsigned)frame);
+      return false;
+   }
+
+   memcpy(handle->base_state, handle->desync.state, handle->state_words * sizeof(uint32_t));
+   handle->base_ptr = (handle->self_ptr + handle->buffer_size - (handle->frame_count - frame)) % handle->buffer_size;
+   handle->desync.base_hash = state_hash(handle->base_state, handle->state_words);
+   handle->buffer[handle->base_ptr].hash = handle->desync.base_hash;
+
+   handle->other_ptr = handle->base_ptr;
+   handle->other_frame_count = frame;
+   handle->desync.resyncs++;
+
+   SSNES_LOG("Netplay: resynced to the host's state of frame %u.\n", (unsigned)frame);
+   msg_queue_push(g_extern.msg_queue, "Netplay resynced with the host.", 1, 180);
+   return true;
+}
+
+#ifndef HAVE_NETPLAY_THREAD
+static bool netplay_get_cmd(netplay_t *handle)
+{
+   uint32_t cmd;
+   uint32_t data[(MAX_EVENT_SIZE + 3) / 4];
+   size_t size;
+   if (!netplay_read_cmd(handle->fd, &cmd, data, &size, sizeof(data)))
+      return false;
+
+   return netplay_handle_cmd(handle, cmd, data, size);
+}
+#endif
+
+static bool netplay_handle_cmd(netplay_t *handle, uint32_t cmd, const void *data, size_t size)
+{
+   switch (cmd)
+   {
+#ifdef HAVE_NETPLAY_THREAD
+      // Responses come through the I/O thread as well.
+      case NETPLAY_CMD_ACK:
+      case NETPLAY_CMD_NAK:
+         handle->cmd_response = cmd == NETPLAY_CMD_ACK;
+         return true;
+#endif
+
+      case NETPLAY_CMD_FLIP_PLAYERS:
+      {
+         if (size != sizeof(uint32_t))
+         {
+            SSNES_ERR("CMD_FLIP_PLAYERS has unexpected command size.\n");
+            return netplay_cmd_nak(handle);
+         }
+
+         uint32_t flip_frame;
+         memcpy(&flip_frame, data, sizeof(flip_frame));
+         flip_frame = ntohl(flip_frame);
+         if (flip_frame < handle->flip_frame)
+         {
+            SSNES_ERR("Host asked us to flip players in the past. Not possible ...\n");
+            return netplay_cmd_nak(handle);
+         }
+
+         handle->flip ^= true;
+         handle->flip_frame = flip_frame;
+
+         SSNES_LOG("Netplay players are flipped.\n");
+         msg_queue_push(g_extern.msg_queue, "Netplay players are flipped.", 1, 180);
+
+         return netplay_cmd_ack(handle);
+      }
+
+      case NETPLAY_CMD_STATE_HASH:
+         return desync_receive_hash(handle, data, size);
+
+      case NETPLAY_CMD_RESYNC:
+         return desync_receive_state(handle, data, size);
+
+      default:
+         SSNES_ERR("Unknown netplay command received.\n");
+         return netplay_cmd_nak(handle);
+   }
+}
+
+void netplay_flip_players(netplay_t *handle)
+{
+   uint32_t flip_frame = handle->frame_count + FLIP_DELAY_FRAMES;
+   uint32_t flip_frame_net = htonl(flip_frame);
+   const char *msg = NULL;
+
+   if (handle->spectate)
+   {
+      msg = "Cannot flip players in spectate mode.";
+      goto error;
+   }
+
+   if (handle->port == 0)
+   {
+      msg = "Cannot flip players if you're not the host.";
+      goto error;
+   }
+
+   // Make sure both clients are definitely synced up.
+   if (handle->frame_count < (handle->flip_frame + FLIP_DELAY_FRAMES))
+   {
+      msg = "Cannot flip players yet. Wait a second or two before attempting flip.";
+      goto error;
+   }
+
+   if (netplay_send_cmd(handle, NETPLAY_CMD_FLIP_PLAYERS, &flip_frame_net, sizeof(flip_frame_net))
+         && netplay_get_response(handle))
+   {
+      SSNES_LOG("Netplay players are flipped.\n");
+      msg_queue_push(g_extern.msg_queue, "Netplay players are flipped.", 1, 180);
+
+      // Queue up a flip well enough in the future.
+      handle->flip ^= true;
+      handle->flip_frame = flip_frame;
+   }
+   else
+   {
+      msg = "Failed to flip players.";
+      goto error;
+   }
+
+   return;
+
+error:
+   SSNES_WARN("%s\n", msg);
+   msg_queue_push(g_extern.msg_queue, msg, 1, 180);
+}
+
+static bool netplay_flip_port(netplay_t *handle, bool port)
+{
+   if (handle->flip_frame == 0)
+      return port;
+
+   size_t frame = handle->is_replay ? handle->tmp_frame_count : handle->frame_count;
+
+   return port ^ handle->flip ^ (frame < handle->flip_frame);
+}
+
+int16_t netplay_input_state(netplay_t *handle, bool port, unsigned device, unsigned index, unsigned id)
+{
+   uint16_t input_state = 0;
+   size_t ptr = handle->is_replay ? handle->tmp_ptr : PREV_PTR(handle->self_ptr);
+
+   port = netplay_flip_port(handle, port);
+
+   if ((port ? 1 : 0) == handle->port)
+   {
+      if (handle->buffer[ptr].is_simulated)
+         input_state = handle->buffer[ptr].simulated_input_state;
+      else
+         input_state = handle->buffer[ptr].real_input_state;
+   }
+   else
+      input_state = handle->buffer[ptr].self_state;
+
+   return ((1 << id) & input_state) ? 1 : 0;
+}
+
+void netplay_free(netplay_t *handle)
+{
+#ifdef HAVE_NETPLAY_THREAD
+   // The I/O thread has to be gone before its sockets are.
+   if (!handle->spectate)
+      deinit_io_thread(handle);
+#endif
+
+   close(handle->fd);
+
+   if (handle->spectate)
+   {
+      deinit_spectators(handle);
+      free(handle->spectate_input);
+      free(handle->spectate_recv.data);
+      free(handle->spectate_recv.words);
+   }
+   else
+   {
+      close(handle->udp_fd);
+
+      log_state_stats(handle);
+      deinit_telemetry(handle);
+      deinit_buffers(handle);
+   }
 
-      if (block && !send_chunk(handle))
-      {
-         warn_hangup();
-         handle->has_connection = false;
-         return -1;
-      }
+   if (handle->addr)
+      freeaddrinfo(handle->addr);
 
-      if (block)
-      {
-         SSNES_LOG("Network is stalling, resending packet... Count %u of %d ...\n",
-               handle->timeout_cnt, MAX_RETRIES);
-      }
-   } while ((handle->timeout_cnt < MAX_RETRIES) && block);
+   free(handle);
+}
 
-   if (block)
-      return -1;
-   return 0;
+static const struct snes_callbacks* netplay_callbacks(netplay_t *handle)
+{
+   return &handle->cbs;
 }
 
-// Grab our own input state and send this over the network.
-static bool get_self_input_state(netplay_t *handle)
+static bool netplay_should_skip(netplay_t *handle)
 {
-   struct delta_frame *ptr = &handle->buffer[handle->self_ptr];
+   return handle->is_replay && (handle->has_connection || handle->spectate_client);
+}
 
-   uint32_t state = 0;
-   if (handle->frame_count > 0) // First frame we always give zero input since relying on input from first frame screws up when we use -F 0.
+// If one side runs ahead, the other side's input always arrives late for it, so it keeps rolling back.
+// Both sides tell each other how far ahead they think they are. Errors in guessing the other's frame,
+// e.g. from an uneven route, are the same size but opposite sign on both sides, so they cancel out in half the difference.
+// The side that is ahead by more than a frame waits a frame out, like a frame dropped by vsync.
+static void update_time_sync(netplay_t *handle)
+{
+   if (!handle->time_sync.enable || !handle->has_connection)
+      return;
+
+   if (handle->time_sync.wait_frames)
    {
-      snes_input_state_t cb = handle->cbs.state_cb;
-      for (unsigned i = 0; i < SSNES_FIRST_META_KEY; i++)
-      {
-         int16_t tmp = cb(g_settings.input.netplay_client_swap_input ? 0 : !handle->port,
-               SNES_DEVICE_JOYPAD, 0, i);
-         state |= tmp ? 1 << i : 0;
-      }
+      handle->time_sync.wait_frames--;
+      handle->time_sync.waited++;
+      // Rounded up, so a vsynced frame surely misses a vblank.
+      ssnes_sleep((netplay_frame_usec() + 999) / 1000);
+      return;
    }
 
-   memmove(handle->packet_buffer, handle->packet_buffer + 2,
-         sizeof (handle->packet_buffer) - 2 * sizeof(uint32_t));
-   handle->packet_buffer[(UDP_FRAME_PACKETS - 1) * 2] = htonl(handle->frame_count); 
-   handle->packet_buffer[(UDP_FRAME_PACKETS - 1) * 2 + 1] = htonl(state);
+   if (handle->frame_count < handle->time_sync.next_check)
+      return;
+   handle->time_sync.next_check = handle->frame_count + TIME_SYNC_INTERVAL;
+
+   int32_t wait = (time_sync_advantage(handle, ssnes_get_time_usec()) - handle->time_sync.their_advantage) / 2;
+   if (wait >= 1000)
+      handle->time_sync.wait_frames = wait / 1000 < TIME_SYNC_MAX_WAIT ? wait / 1000 : TIME_SYNC_MAX_WAIT;
+}
+
+static void netplay_pre_frame_net(netplay_t *handle)
+{
+   update_time_sync(handle);
 
-   if (!send_chunk(handle))
+   // Roll the base forward before the slot we store into can be one it still needs.
+   // If all frames are confirmed, other_ptr is the frame we're about to store, so the base trails by one.
+   advance_base(handle, handle->other_ptr == handle->self_ptr ? PREV_PTR(handle->self_ptr) : handle->other_ptr);
+
+   if (!store_state(handle, handle->self_ptr) && handle->has_connection)
    {
+      SSNES_ERR("Failed to store netplay state.\n");
       warn_hangup();
       handle->has_connection = false;
-      return false;
    }
+   handle->can_poll = true;
 
-   ptr->self_state = state;
-   handle->self_ptr = NEXT_PTR(handle->self_ptr);
-   return true;
+   input_poll_net();
 }
 
-// TODO: Somewhat better prediction. :P
-static void simulate_input(netplay_t *handle)
+static void netplay_set_spectate_input(netplay_t *handle, int16_t input)
 {
-   size_t ptr = PREV_PTR(handle->self_ptr);
-   size_t prev = PREV_PTR(handle->read_ptr);
+   if (handle->spectate_input_ptr >= handle->spectate_input_size)
+   {
+      handle->spectate_input_size++;
+      handle->spectate_input_size *= 2;
+      handle->spectate_input = (uint16_t*)realloc(handle->spectate_input,
+            handle->spectate_input_size * sizeof(uint16_t));
+   }
 
-   handle->buffer[ptr].simulated_input_state = handle->buffer[prev].real_input_state;
-   handle->buffer[ptr].is_simulated = true;
-   handle->buffer[ptr].used_real = false;
+   handle->spectate_input[handle->spectate_input_ptr++] = input;
 }
 
-static void parse_packet(netplay_t *handle, uint32_t *buffer, unsigned size)
+static inline uint32_t spectate_zigzag(uint16_t word)
 {
-   for (unsigned i = 0; i < size * 2; i++)
-      buffer[i] = ntohl(buffer[i]);
+   return (uint16_t)(word << 1) ^ (word & 0x8000 ? 0xffff : 0);
+}
+
+static inline uint16_t spectate_unzigzag(uint32_t value)
+{
+   return (uint16_t)((value >> 1) ^ (value & 1 ? 0xffff : 0));
+}
 
-   for (unsigned i = 0; i < size && handle->read_frame_count <= handle->frame_count; i++)
+static bool spectate_batch_reserve(netplay_t *handle, size_t size, size_t words)
+{
+   if (handle->spectators.batch.size + size > handle->spectators.batch.cap)
    {
-      uint32_t frame = buffer[2 * i + 0];
-      uint32_t state = buffer[2 * i + 1];
+      size_t cap = handle->spectators.batch.cap ? handle->spectators.batch.cap : SPECTATE_BATCH_FLUSH_SIZE;
+      while (cap < handle->spectators.batch.size + size)
+         cap *= 2;
 
-      if (frame == handle->read_frame_count)
-      {
-         handle->buffer[handle->read_ptr].is_simulated = false;
-         handle->buffer[handle->read_ptr].real_input_state = state;
-         handle->read_ptr = NEXT_PTR(handle->read_ptr);
-         handle->read_frame_count++;
-         handle->timeout_cnt = 0;
-      }
+      uint8_t *data = (uint8_t*)realloc(handle->spectators.batch.data, cap);
+      if (!data)
+         return false;
+      handle->spectators.batch.data = data;
+      handle->spectators.batch.cap = cap;
+   }
+
+   if (words > handle->spectators.batch.prev_cap)
+   {
+      uint16_t *prev = (uint16_t*)realloc(handle->spectators.batch.prev, words * sizeof(uint16_t));
+      if (!prev)
+         return false;
+      handle->spectators.batch.prev = prev;
+      handle->spectators.batch.prev_cap = words;
    }
+
+   return true;
 }
 
-static bool receive_data(netplay_t *handle, uint32_t *buffer, size_t size)
+static void spectate_batch_end_repeat(netplay_t *handle)
 {
-   socklen_t addrlen = sizeof(handle->their_addr);
-   if (recvfrom(handle->udp_fd, NONCONST_CAST buffer, size, 0, (struct sockaddr*)&handle->their_addr, &addrlen) != (ssize_t)size)
-      return false;
-   handle->has_client_addr = true;
-   return true;
+   if (!handle->spectators.batch.repeat)
+      return;
+
+   handle->spectators.batch.size += delta_write_varint(handle->spectators.batch.data + handle->spectators.batch.size,
+         ((handle->spectators.batch.repeat - 1) << 2) | SPECTATE_FRAME_REPEAT);
+   handle->spectators.batch.repeat = 0;
 }
 
-// Poll network to see if we have anything new. If our network buffer is full, we simply have to block for new input data.
-static bool netplay_poll(netplay_t *handle)
+// Encodes the input the core read this frame.
+static void spectate_batch_add_frame(netplay_t *handle, const uint16_t *words, size_t num_words)
 {
-   if (!handle->has_connection)
-      return false;
+   if (num_words > SPECTATE_MAX_FRAME_WORDS)
+      num_words = SPECTATE_MAX_FRAME_WORDS;
 
-   handle->can_poll = false;
+   // Worst case is a repeat tag, a frame tag, and every word changing.
+   if (!spectate_batch_reserve(handle, SPECTATE_BATCH_HEADER_SIZE + 10 + num_words * 8, num_words))
+   {
+      SSNES_ERR("Failed to allocate spectator input.\n");
+      return;
+   }
 
-   if (!get_self_input_state(handle))
-      return false;
+   if (!handle->spectators.batch.size)
+      handle->spectators.batch.size = SPECTATE_BATCH_HEADER_SIZE;
 
-   // We skip reading the first frame so the host has a chance to grab our host info so we don't block forever :')
-   if (handle->frame_count == 0)
+   const uint16_t *prev = handle->spectators.batch.prev;
+   bool same_size = handle->spectators.batch.frames && num_words == handle->spectators.batch.prev_words;
+   if (same_size && memcmp(words, prev, num_words * sizeof(uint16_t)) == 0)
    {
-      handle->buffer[0].used_real = true;
-      handle->buffer[0].is_simulated = false;
-      handle->buffer[0].real_input_state = 0;
-      handle->read_ptr = NEXT_PTR(handle->read_ptr);
-      handle->read_frame_count++;
-      return true;
+      handle->spectators.batch.repeat++;
+      handle->spectators.batch.frames++;
+      return;
    }
 
-   // We might have reached the end of the buffer, where we simply have to block.
-   int res = poll_input(handle, handle->other_ptr == handle->self_ptr);
-   if (res == -1)
+   spectate_batch_end_repeat(handle);
+
+   size_t changed = 0;
+   if (same_size)
    {
-      handle->has_connection = false;
-      warn_hangup();
-      return false;
+      for (size_t i = 0; i < num_words; i++)
+         changed += words[i] != prev[i];
    }
 
-   if (res == 1)
+   uint8_t *out = handle->spectators.batch.data + handle->spectators.batch.size;
+   // A changed word costs at least two bytes, a word of a full frame usually one.
+   if (same_size && changed * 2 < num_words)
    {
-      uint32_t first_read = handle->read_frame_count;
-      do 
+      out += delta_write_varint(out, ((changed - 1) << 2) | SPECTATE_FRAME_CHANGED);
+      size_t next = 0;
+      for (size_t i = 0; i < num_words; i++)
       {
-         uint32_t buffer[UDP_FRAME_PACKETS * 2];
-         if (!receive_data(handle, buffer, sizeof(buffer)))
-         {
-            warn_hangup();
-            handle->has_connection = false;
-            return false;
-         }
-         parse_packet(handle, buffer, UDP_FRAME_PACKETS);
+         if (words[i] == prev[i])
+            continue;
 
-      } while ((handle->read_frame_count <= handle->frame_count) && 
-            poll_input(handle, (handle->other_ptr == handle->self_ptr) && 
-               (first_read == handle->read_frame_count)) == 1);
+         out += delta_write_varint(out, i - next);
+         out += delta_write_varint(out, spectate_zigzag(words[i]));
+         next = i + 1;
+      }
    }
    else
    {
-      // Cannot allow this. Should not happen though.
-      if (handle->self_ptr == handle->other_ptr)
-      {
-         warn_hangup();
-         return false;
-      }
+      out += delta_write_varint(out, (num_words << 2) | SPECTATE_FRAME_FULL);
+      for (size_t i = 0; i < num_words; i++)
+         out += delta_write_varint(out, spectate_zigzag(words[i]));
    }
 
-   if (handle->read_ptr != handle->self_ptr)
-      simulate_input(handle);
-   else
-      handle->buffer[PREV_PTR(handle->self_ptr)].used_real = true;
+   handle->spectators.batch.size = out - handle->spectators.batch.data;
+   memcpy(handle->spectators.batch.prev, words, num_words * sizeof(uint16_t));
+   handle->spectators.batch.prev_words = num_words;
+   handle->spectators.batch.frames++;
+}
 
-   return true;
+int16_t input_state_spectate(bool port, unsigned device, unsigned index, unsigned id)
+{
+   int16_t res = netplay_callbacks(g_extern.netplay)->state_cb(port, device, index, id);
+   netplay_set_spectate_input(g_extern.netplay, res);
+   return res;
 }
 
-static bool netplay_send_cmd(netplay_t *handle, uint32_t cmd, const void *data, size_t size)
+// Reads the next batch of input from the host. Blocks until it's here.
+static bool spectate_recv_batch(netplay_t *handle)
 {
-   cmd = (cmd << 16) | (size & 0xffff);
-   cmd = htonl(cmd);
+   uint32_t header[2];
+   if (!recv_all(handle->fd, header, sizeof(header)))
+      return false;
 
-   if (!send_all(handle->fd, &cmd, sizeof(cmd)))
+   uint32_t frame = ntohl(header[0]);
+   uint32_t size = ntohl(header[1]);
+   if (!size || size > SPECTATE_MAX_BATCH_SIZE)
+   {
+      SSNES_ERR("Received invalid input batch from host.\n");
       return false;
+   }
 
-   if (!send_all(handle->fd, data, size))
+   if (handle->spectate_recv.has_frame && frame != handle->spectate_recv.frame)
+   {
+      SSNES_ERR("Input from host is out of step, expected frame %u, got %u.\n",
+            (unsigned)handle->spectate_recv.frame, (unsigned)frame);
       return false;
+   }
 
-   return true;
-}
+   if (size > handle->spectate_recv.cap)
+   {
+      uint8_t *data = (uint8_t*)realloc(handle->spectate_recv.data, size);
+      if (!data)
+         return false;
+      handle->spectate_recv.data = data;
+      handle->spectate_recv.cap = size;
+   }
 
-static bool netplay_cmd_ack(netplay_t *handle)
-{
-   uint32_t cmd = htonl(NETPLAY_CMD_ACK);
-   return send_all(handle->fd, &cmd, sizeof(cmd));
-}
+   if (!recv_all(handle->fd, handle->spectate_recv.data, size))
+      return false;
 
-static bool netplay_cmd_nak(netplay_t *handle)
-{
-   uint32_t cmd = htonl(NETPLAY_CMD_NAK);
-   return send_all(handle->fd, &cmd, sizeof(cmd));
+   handle->spectate_recv.size = size;
+   handle->spectate_recv.pos = 0;
+   handle->spectate_recv.frame = frame;
+   handle->spectate_recv.has_frame = true;
+   return true;
 }
 
-static bool netplay_get_response(netplay_t *handle)
+static bool spectate_read_varint(netplay_t *handle, uint32_t *value)
 {
-   uint32_t response;
-   if (!recv_all(handle->fd, &response, sizeof(response)))
-      return false;
+   uint32_t v = 0;
+   unsigned shift = 0;
+   uint8_t byte;
+   do
+   {
+      if (handle->spectate_recv.pos >= handle->spectate_recv.size || shift > 28)
+         return false;
+      byte = handle->spectate_recv.data[handle->spectate_recv.pos++];
+      v |= (uint32_t)(byte & 0x7f) << shift;
+      shift += 7;
+   } while (byte & 0x80);
 
-   return ntohl(response) == NETPLAY_CMD_ACK;
+   *value = v;
+   return true;
 }
 
-static bool netplay_get_cmd(netplay_t *handle)
+// Decodes the input of the next frame. Doesn't trust the host.
+static bool spectate_decode_frame(netplay_t *handle)
 {
-   uint32_t cmd;
-   if (!recv_all(handle->fd, &cmd, sizeof(cmd)))
-      return false;
+   handle->spectate_recv.read = 0;
+   if (handle->spectate_recv.repeat)
+   {
+      handle->spectate_recv.repeat--;
+      goto done;
+   }
 
-   cmd = ntohl(cmd);
+   if (handle->spectate_recv.pos >= handle->spectate_recv.size && !spectate_recv_batch(handle))
+      return false;
 
-   size_t cmd_size = cmd & 0xffff;
-   cmd = cmd >> 16;
+   uint32_t tag;
+   if (!spectate_read_varint(handle, &tag))
+      goto error;
 
-   switch (cmd)
+   uint32_t num = tag >> 2;
+   switch (tag & 3)
    {
-      case NETPLAY_CMD_FLIP_PLAYERS:
-      {
-         if (cmd_size != sizeof(uint32_t))
+      case SPECTATE_FRAME_REPEAT:
+         handle->spectate_recv.repeat = num;
+         goto done;
+
+      case SPECTATE_FRAME_FULL:
+         if (num > handle->spectate_recv.size - handle->spectate_recv.pos)
+            goto error;
+
+         if (num > handle->spectate_recv.words_cap)
          {
-            SSNES_ERR("CMD_FLIP_PLAYERS has unexpected command size.\n");
-            return netplay_cmd_nak(handle);
+            uint16_t *words = (uint16_t*)realloc(handle->spectate_recv.words, num * sizeof(uint16_t));
+            if (!words)
+               return false;
+            handle->spectate_recv.words = words;
+            handle->spectate_recv.words_cap = num;
          }
 
-         uint32_t flip_frame;
-         if (!recv_all(handle->fd, &flip_frame, sizeof(flip_frame)))
+         for (uint32_t i = 0; i < num; i++)
          {
-            SSNES_ERR("Failed to receive CMD_FLIP_PLAYERS argument.\n");
-            return netplay_cmd_nak(handle);
+            uint32_t value;
+            if (!spectate_read_varint(handle, &value))
+               goto error;
+            handle->spectate_recv.words[i] = spectate_unzigzag(value);
          }
+         handle->spectate_recv.num_words = num;
+         goto done;
 
-         flip_frame = ntohl(flip_frame);
-         if (flip_frame < handle->flip_frame)
+      case SPECTATE_FRAME_CHANGED:
+      {
+         size_t next = 0;
+         for (uint32_t i = 0; i <= num; i++)
          {
-            SSNES_ERR("Host asked us to flip players in the past. Not possible ...\n");
-            return netplay_cmd_nak(handle);
+            uint32_t skip, value;
+            if (!spectate_read_varint(handle, &skip) || !spectate_read_varint(handle, &value) ||
+                  skip >= handle->spectate_recv.num_words - next)
+               goto error;
+
+            next += skip;
+            handle->spectate_recv.words[next++] = spectate_unzigzag(value);
          }
+         goto done;
+      }
+   }
+
+error:
+   SSNES_ERR("Received corrupt input from host.\n");
+   return false;
+
+done:
+   handle->spectate_recv.frame++;
+   return true;
+}
+
+static void spectate_lost_host(netplay_t *handle)
+{
+   SSNES_ERR("Connection with host was cut.\n");
+   msg_queue_clear(g_extern.msg_queue);
+   msg_queue_push(g_extern.msg_queue, "Connection with host was cut.", 1, 180);
+
+   handle->spectate_recv.lost = true;
+   psnes_set_input_state(netplay_callbacks(handle)->state_cb);
+}
+
+// Frames where the core read no input still have their place in the stream.
+static void spectate_end_frame(netplay_t *handle)
+{
+   if (!handle->spectate_recv.fetched && !handle->spectate_recv.lost && !spectate_decode_frame(handle))
+      spectate_lost_host(handle);
+   handle->spectate_recv.fetched = false;
+}
+
+static int16_t netplay_get_spectate_input(netplay_t *handle, bool port, unsigned device, unsigned index, unsigned id)
+{
+   if (!handle->spectate_recv.fetched && !handle->spectate_recv.lost)
+   {
+      if (spectate_decode_frame(handle))
+         handle->spectate_recv.fetched = true;
+      else
+         spectate_lost_host(handle);
+   }
+
+   if (handle->spectate_recv.lost)
+      return netplay_callbacks(handle)->state_cb(port, device, index, id);
+
+   // The core reads input the same way the host's did, so this only runs out if the host cut the frame short.
+   if (handle->spectate_recv.read >= handle->spectate_recv.num_words)
+      return 0;
+   return (int16_t)handle->spectate_recv.words[handle->spectate_recv.read++];
+}
+
+int16_t input_state_spectate_client(bool port, unsigned device, unsigned index, unsigned id)
+{
+   return netplay_get_spectate_input(g_extern.netplay, port, device, index, id);
+}
+
+static bool set_nonblocking(int fd)
+{
+#if defined(_WIN32)
+   u_long mode = 1;
+   return ioctlsocket(fd, FIONBIO, &mode) == 0;
+#elif defined(__CELLOS_LV2__)
+   int yes = 1;
+   return setsockopt(fd, SOL_SOCKET, SO_NBIO, &yes, sizeof(int)) == 0;
+#else
+   return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0;
+#endif
+}
+
+static bool send_would_block(void)
+{
+#if defined(_WIN32)
+   return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+   return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+// Appends input to the spectate ring. Clients read it from their own position.
+static void spectate_ring_write(netplay_t *handle, const void *data_, size_t size)
+{
+   const uint8_t *data = (const uint8_t*)data_;
+   uint32_t write = handle->spectators.write;
+
+   // Larger writes would overwrite what's being sent right now. Nobody could keep up with that anyway.
+   if (size > SPECTATE_MAX_LAG)
+   {
+      data += size - SPECTATE_MAX_LAG;
+      write += size - SPECTATE_MAX_LAG;
+      size = SPECTATE_MAX_LAG;
+   }
+
+   size_t offset = write & (SPECTATE_RING_SIZE - 1);
+   size_t first = SPECTATE_RING_SIZE - offset;
+   if (first > size)
+      first = size;
+
+   memcpy(handle->spectators.ring + offset, data, first);
+   memcpy(handle->spectators.ring, data + first, size - first);
+
+   NETPLAY_BARRIER();
+   handle->spectators.write = write + size;
+}
+
+// Puts the frames encoded so far in the ring for clients to get.
+static void spectate_write_batch(netplay_t *handle)
+{
+   if (!handle->spectators.batch.frames)
+      return;
+
+   spectate_batch_end_repeat(handle);
+
+   uint8_t *header = handle->spectators.batch.data;
+   packet_put32(&header, handle->spectators.frames);
+   packet_put32(&header, handle->spectators.batch.size - SPECTATE_BATCH_HEADER_SIZE);
+   spectate_ring_write(handle, handle->spectators.batch.data, handle->spectators.batch.size);
+   handle->spectators.frames += handle->spectators.batch.frames;
+
+   handle->spectators.batch.total_batches++;
+   handle->spectators.batch.total_frames += handle->spectators.batch.frames;
+   handle->spectators.batch.total_bytes += handle->spectators.batch.size;
+   handle->spectators.batch.size = 0;
+   handle->spectators.batch.frames = 0;
+}
+
+// Sends as much as the client will take without blocking. Returns false if the client has to be dropped.
+static bool spectate_send(netplay_t *handle, struct spectator *client, uint32_t write)
+{
+   while (client->pos != write)
+   {
+      uint32_t behind = write - client->pos;
+      if (behind > SPECTATE_MAX_LAG)
+      {
+         SSNES_WARN("Spectator (#%u) fell too far behind.\n", client->id);
+         return false;
+      }
 
-         handle->flip ^= true;
-         handle->flip_frame = flip_frame;
+      size_t offset = client->pos & (SPECTATE_RING_SIZE - 1);
+      size_t size = SPECTATE_RING_SIZE - offset;
+      if (size > behind)
+         size = behind;
 
-         SSNES_LOG("Netplay players are flipped.\n");
-         msg_queue_push(g_extern.msg_queue, "Netplay players are flipped.", 1, 180);
+      ssize_t ret = send(client->fd, CONST_CAST (handle->spectators.ring + offset), size, 0);
+      if (ret < 0 && send_would_block())
+         return true;
+      if (ret <= 0)
+      {
+         SSNES_LOG("Spectator (#%u) disconnected ...\n", client->id);
+         return false;
+      }
 
-         return netplay_cmd_ack(handle);
+      // The ring might have caught up with what we just sent while send() copied it.
+      NETPLAY_BARRIER();
+      if (handle->spectators.write - client->pos > SPECTATE_MAX_LAG)
+      {
+         SSNES_WARN("Spectator (#%u) fell too far behind.\n", client->id);
+         return false;
       }
 
-      default:
-         SSNES_ERR("Unknown netplay command received.\n");
-         return netplay_cmd_nak(handle);
+      client->pos += ret;
    }
+
+   return true;
 }
 
-void netplay_flip_players(netplay_t *handle)
+// Sends pending input to every client, and drops the ones that disconnected or can't keep up.
+static void spectate_flush(netplay_t *handle)
 {
-   uint32_t flip_frame = handle->frame_count + 2 * UDP_FRAME_PACKETS;
-   uint32_t flip_frame_net = htonl(flip_frame);
-   const char *msg = NULL;
+   uint32_t write = handle->spectators.write;
+   NETPLAY_BARRIER();
 
-   if (handle->spectate)
+   for (size_t i = 0; i < handle->spectators.num_clients; )
    {
-      msg = "Cannot flip players in spectate mode.";
-      goto error;
-   }
+      struct spectator *client = &handle->spectators.clients[i];
+      if (spectate_send(handle, client, write))
+      {
+         i++;
+         continue;
+      }
 
-   if (handle->port == 0)
-   {
-      msg = "Cannot flip players if you're not the host.";
-      goto error;
+      close(client->fd);
+      *client = handle->spectators.clients[--handle->spectators.num_clients];
+      NETPLAY_BARRIER();
+      handle->spectators.dropped++;
    }
+}
 
-   // Make sure both clients are definitely synced up.
-   if (handle->frame_count < (handle->flip_frame + 2 * UDP_FRAME_PACKETS))
+static bool spectate_append_client(struct spectator **list, size_t *num, size_t *cap, const struct spectator *client)
+{
+   if (*num >= *cap)
    {
-      msg = "Cannot flip players yet. Wait a second or two before attempting flip.";
-      goto error;
+      size_t new_cap = *cap ? *cap * 2 : 16;
+      struct spectator *new_list = (struct spectator*)realloc(*list, new_cap * sizeof(*new_list));
+      if (!new_list)
+         return false;
+
+      *list = new_list;
+      *cap = new_cap;
    }
 
-   if (netplay_send_cmd(handle, NETPLAY_CMD_FLIP_PLAYERS, &flip_frame_net, sizeof(flip_frame_net))
-         && netplay_get_response(handle))
+   (*list)[(*num)++] = *client;
+   return true;
+}
+
+#ifdef HAVE_NETPLAY_THREAD
+static void netplay_spectate_thread(void *data)
+{
+   netplay_t *handle = (netplay_t*)data;
+   uint32_t sent = handle->spectators.write;
+
+   for (;;)
    {
-      SSNES_LOG("Netplay players are flipped.\n");
-      msg_queue_push(g_extern.msg_queue, "Netplay players are flipped.", 1, 180);
+      slock_lock(handle->spectators.lock);
+      // Clients that would block are retried on the next frame, or after a timeout if the host is paused.
+      while (!handle->spectators.quit && !handle->spectators.num_pending && sent == handle->spectators.write)
+      {
+         if (!scond_wait_timeout(handle->spectators.cond, handle->spectators.lock, NET_THREAD_POLL_MS))
+            break;
+      }
 
-      // Queue up a flip well enough in the future.
-      handle->flip ^= true;
-      handle->flip_frame = flip_frame;
+      bool quit = handle->spectators.quit;
+      for (size_t i = 0; i < handle->spectators.num_pending; i++)
+      {
+         struct spectator *client = &handle->spectators.pending[i];
+         if (!spectate_append_client(&handle->spectators.clients,
+                  &handle->spectators.num_clients, &handle->spectators.clients_cap, client))
+         {
+            close(client->fd);
+            handle->spectators.dropped++;
+         }
+      }
+      handle->spectators.num_pending = 0;
+      slock_unlock(handle->spectators.lock);
+
+      // Whatever fits in the socket buffers still goes out when we quit.
+      sent = handle->spectators.write;
+      spectate_flush(handle);
+      if (quit)
+         break;
    }
-   else
+}
+#endif
+
+// Takes over a client that has been sent the header. It gets input from client->pos on.
+static void spectate_add_client(netplay_t *handle, const struct spectator *client)
+{
+   if (!set_nonblocking(client->fd))
    {
-      msg = "Failed to flip players.";
-      goto error;
+      SSNES_ERR("Failed to make spectator socket non-blocking.\n");
+      close(client->fd);
+      return;
    }
 
-   return;
+#ifdef HAVE_NETPLAY_THREAD
+   slock_lock(handle->spectators.lock);
+   bool ret = spectate_append_client(&handle->spectators.pending,
+         &handle->spectators.num_pending, &handle->spectators.pending_cap, client);
+   scond_signal(handle->spectators.cond);
+   slock_unlock(handle->spectators.lock);
+#else
+   bool ret = spectate_append_client(&handle->spectators.clients,
+         &handle->spectators.num_clients, &handle->spectators.clients_cap, client);
+#endif
 
-error:
-   SSNES_WARN("%s\n", msg);
-   msg_queue_push(g_extern.msg_queue, msg, 1, 180);
+   if (!ret)
+      close(client->fd);
 }
 
-static bool netplay_flip_port(netplay_t *handle, bool port)
+// Serializes the state at the end of the current frame for joining clients.
+// The frames before it go in the ring first, so clients start at a batch.
+static bool spectate_take_snapshot(netplay_t *handle)
 {
-   if (handle->flip_frame == 0)
-      return port;
+   spectate_write_batch(handle);
+   bool ret = psnes_serialize((uint8_t*)handle->spectators.snapshot.state, psnes_serialize_size());
 
-   size_t frame = handle->is_replay ? handle->tmp_frame_count : handle->frame_count;
+#ifdef HAVE_NETPLAY_THREAD
+   slock_lock(handle->spectators.lock);
+#endif
+   handle->spectators.snapshot.pos = handle->spectators.write;
+   handle->spectators.snapshot.frame = handle->spectators.frames;
+   handle->spectators.snapshot.is_packed = false;
+   handle->spectators.snapshot.valid = ret;
+   handle->spectators.snapshot.wanted = false;
+#ifdef HAVE_NETPLAY_THREAD
+   scond_signal(handle->spectators.join_cond);
+   slock_unlock(handle->spectators.lock);
+#endif
 
-   return port ^ handle->flip ^ (frame < handle->flip_frame);
+   return ret;
 }
 
-int16_t netplay_input_state(netplay_t *handle, bool port, unsigned device, unsigned index, unsigned id)
+// Makes sure there is a snapshot that a client can catch up from, and packs it.
+static bool spectate_get_snapshot(netplay_t *handle)
 {
-   uint16_t input_state = 0;
-   size_t ptr = handle->is_replay ? handle->tmp_ptr : PREV_PTR(handle->self_ptr);
+#ifdef HAVE_NETPLAY_THREAD
+   slock_lock(handle->spectators.lock);
+   if (handle->spectators.snapshot.valid &&
+         (handle->spectators.write - handle->spectators.snapshot.pos > SPECTATE_MAX_LAG / 2 ||
+          handle->spectators.frames - handle->spectators.snapshot.frame > SPECTATE_SNAPSHOT_MAX_AGE))
+      handle->spectators.snapshot.valid = false;
+
+   if (!handle->spectators.snapshot.valid)
+   {
+      handle->spectators.snapshot.wanted = true;
+      while (!handle->spectators.snapshot.valid && !handle->spectators.quit)
+         scond_wait(handle->spectators.join_cond, handle->spectators.lock);
+   }
 
-   port = netplay_flip_port(handle, port);
+   bool ret = handle->spectators.snapshot.valid;
+   slock_unlock(handle->spectators.lock);
 
-   if ((port ? 1 : 0) == handle->port)
+   if (!ret)
+      return false;
+#else
+   if (!spectate_take_snapshot(handle))
+      return false;
+#endif
+
+   // Only joins touch the snapshot while it's valid, so it can be packed without the lock.
+   if (!handle->spectators.snapshot.is_packed)
    {
-      if (handle->buffer[ptr].is_simulated)
-         input_state = handle->buffer[ptr].simulated_input_state;
-      else
-         input_state = handle->buffer[ptr].real_input_state;
+      handle->spectators.snapshot.packed_size = pack_state(handle->spectators.snapshot.packed,
+            handle->spectators.snapshot.zero, handle->spectators.snapshot.state, handle->spectators.snapshot.words);
+      handle->spectators.snapshot.is_packed = true;
    }
-   else
-      input_state = handle->buffer[ptr].self_state;
 
-   return ((1 << id) & input_state) ? 1 : 0;
+   return true;
 }
 
-void netplay_free(netplay_t *handle)
+// Handshakes with a client and sends it the save state. Blocks, so only the join thread does this if we have one.
+static void spectate_join(netplay_t *handle, struct spectator *client)
 {
-   close(handle->fd);
-
-   if (handle->spectate)
+   if (!get_nickname(handle, client->fd))
    {
-      for (unsigned i = 0; i < MAX_SPECTATORS; i++)
-         if (handle->spectate_fds[i] >= 0)
-            close(handle->spectate_fds[i]);
+      SSNES_ERR("Failed to get nickname from client.\n");
+      goto error;
+   }
 
-      free(handle->spectate_input);
+   if (!send_nickname(handle, client->fd))
+   {
+      SSNES_ERR("Failed to send nickname to client.\n");
+      goto error;
    }
-   else
+
+   if (!spectate_get_snapshot(handle))
    {
-      close(handle->udp_fd);
+      SSNES_ERR("Failed to take save state for client.\n");
+      goto error;
+   }
 
-      for (unsigned i = 0; i < handle->buffer_size; i++)
-         free(handle->buffer[i].state);
+   uint32_t header[4] = {0};
+   bsv_header_generate(header, implementation_magic_value());
+   uint32_t packed_size = htonl(handle->spectators.snapshot.packed_size);
+
+   int bufsize = sizeof(header) + handle->spectators.snapshot.packed_size;
+   setsockopt(client->fd, SOL_SOCKET, SO_SNDBUF, CONST_CAST &bufsize, sizeof(int));
 
-      free(handle->buffer);
+   if (!send_all(client->fd, header, sizeof(header)) ||
+         !send_all(client->fd, &packed_size, sizeof(packed_size)) ||
+         !send_all(client->fd, handle->spectators.snapshot.packed, handle->spectators.snapshot.packed_size))
+   {
+      SSNES_ERR("Failed to send header to client.\n");
+      goto error;
    }
 
-   if (handle->addr)
-      freeaddrinfo(handle->addr);
+   // The client fast-forwards through whatever we've run since the snapshot.
+   // Frames we run while it does so end up as a little extra delay.
+   uint32_t catchup = handle->spectators.frames - handle->spectators.snapshot.frame;
+   client->pos = handle->spectators.snapshot.pos;
+   catchup = htonl(catchup);
+   if (!send_all(client->fd, &catchup, sizeof(catchup)))
+   {
+      SSNES_ERR("Failed to send header to client.\n");
+      goto error;
+   }
 
-   free(handle);
-}
+   SSNES_LOG("Spectator (#%u) \"%s\" joined, %u frames behind.\n",
+         client->id, handle->other_nick, (unsigned)ntohl(catchup));
+   spectate_add_client(handle, client);
+   return;
 
-static const struct snes_callbacks* netplay_callbacks(netplay_t *handle)
-{
-   return &handle->cbs;
+error:
+   close(client->fd);
 }
 
-static bool netplay_should_skip(netplay_t *handle)
+#ifdef HAVE_NETPLAY_THREAD
+static void set_join_timeout(int fd)
 {
-   return handle->is_replay && handle->has_connection;
+#ifdef _WIN32
+   DWORD timeout = SPECTATE_JOIN_TIMEOUT_MS;
+#else
+   struct timeval timeout = {0};
+   timeout.tv_sec = SPECTATE_JOIN_TIMEOUT_MS / 1000;
+   timeout.tv_usec = (SPECTATE_JOIN_TIMEOUT_MS % 1000) * 1000;
+#endif
+   setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, CONST_CAST &timeout, sizeof(timeout));
+   setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, CONST_CAST &timeout, sizeof(timeout));
 }
 
-static void netplay_pre_frame_net(netplay_t *handle)
+static void netplay_join_thread(void *data)
 {
-   psnes_serialize(handle->buffer[handle->self_ptr].state, handle->state_size);
-   handle->can_poll = true;
-
-   input_poll_net();
-}
+   netplay_t *handle = (netplay_t*)data;
 
-static void netplay_set_spectate_input(netplay_t *handle, int16_t input)
-{
-   if (handle->spectate_input_ptr >= handle->spectate_input_size)
+   for (;;)
    {
-      handle->spectate_input_size++;
-      handle->spectate_input_size *= 2;
-      handle->spectate_input = (uint16_t*)realloc(handle->spectate_input,
-            handle->spectate_input_size * sizeof(uint16_t));
-   }
+      slock_lock(handle->spectators.lock);
+      while (!handle->spectators.quit && !handle->spectators.num_joining)
+         scond_wait(handle->spectators.join_cond, handle->spectators.lock);
 
-   handle->spectate_input[handle->spectate_input_ptr++] = swap_if_big16(input);
-}
-
-int16_t input_state_spectate(bool port, unsigned device, unsigned index, unsigned id)
-{
-   int16_t res = netplay_callbacks(g_extern.netplay)->state_cb(port, device, index, id);
-   netplay_set_spectate_input(g_extern.netplay, res);
-   return res;
-}
+      if (handle->spectators.quit)
+      {
+         slock_unlock(handle->spectators.lock);
+         break;
+      }
 
-static int16_t netplay_get_spectate_input(netplay_t *handle, bool port, unsigned device, unsigned index, unsigned id)
-{
-   int16_t inp;
-   if (recv_all(handle->fd, NONCONST_CAST &inp, sizeof(inp)))
-      return swap_if_big16(inp);
-   else
-   {
-      SSNES_ERR("Connection with host was cut.\n");
-      msg_queue_clear(g_extern.msg_queue);
-      msg_queue_push(g_extern.msg_queue, "Connection with host was cut.", 1, 180);
+      struct spectator client = handle->spectators.joining[0];
+      memmove(handle->spectators.joining, handle->spectators.joining + 1,
+            --handle->spectators.num_joining * sizeof(client));
+      slock_unlock(handle->spectators.lock);
 
-      psnes_set_input_state(netplay_callbacks(g_extern.netplay)->state_cb);
-      return netplay_callbacks(g_extern.netplay)->state_cb(port, device, index, id);
+      set_join_timeout(client.fd);
+      spectate_join(handle, &client);
    }
 }
+#endif
 
-int16_t input_state_spectate_client(bool port, unsigned device, unsigned index, unsigned id)
+static bool init_spectators(netplay_t *handle)
 {
-   return netplay_get_spectate_input(g_extern.netplay, port, device, index, id);
-}
+   handle->spectators.ring = (uint8_t*)malloc(SPECTATE_RING_SIZE);
+   handle->spectators.snapshot.words = (psnes_serialize_size() + 3) >> 2;
+   handle->spectators.snapshot.state = (uint32_t*)calloc(handle->spectators.snapshot.words, sizeof(uint32_t));
+   handle->spectators.snapshot.zero = (uint32_t*)calloc(handle->spectators.snapshot.words, sizeof(uint32_t));
+   handle->spectators.snapshot.packed = (uint8_t*)malloc(STATE_DELTA_MAX_SIZE(handle->spectators.snapshot.words));
+   if (!handle->spectators.ring || !handle->spectators.snapshot.state ||
+         !handle->spectators.snapshot.zero || !handle->spectators.snapshot.packed)
+      return false;
 
-static void netplay_pre_frame_spectate(netplay_t *handle)
-{
-   if (handle->spectate_client)
-      return;
+#ifdef HAVE_NETPLAY_THREAD
+   handle->spectators.lock = slock_new();
+   handle->spectators.cond = scond_new();
+   handle->spectators.join_cond = scond_new();
+   if (!handle->spectators.lock || !handle->spectators.cond || !handle->spectators.join_cond)
+      return false;
 
-   fd_set fds;
-   FD_ZERO(&fds);
-   FD_SET(handle->fd, &fds);
+   handle->spectators.thread = sthread_create(netplay_spectate_thread, handle);
+   if (!handle->spectators.thread)
+      return false;
 
-   struct timeval tmp_tv = {0};
-   if (select(handle->fd + 1, &fds, NULL, NULL, &tmp_tv) <= 0)
-      return;
+   handle->spectators.join_thread = sthread_create(netplay_join_thread, handle);
+   if (!handle->spectators.join_thread)
+      return false;
+#endif
 
-   if (!FD_ISSET(handle->fd, &fds))
-      return;
+   return true;
+}
 
-   struct sockaddr_storage their_addr;
-   socklen_t addr_size = sizeof(their_addr);
-   int new_fd = accept(handle->fd, (struct sockaddr*)&their_addr, &addr_size);
-   if (new_fd < 0)
-   {
-      SSNES_ERR("Failed to accept incoming spectator.\n");
-      return;
-   }
+static void deinit_spectators(netplay_t *handle)
+{
+   if (handle->spectators.ring)
+      spectate_write_batch(handle);
 
-   int index = -1;
-   for (unsigned i = 0; i < MAX_SPECTATORS; i++)
+   if (handle->spectators.batch.total_frames)
    {
-      if (handle->spectate_fds[i] == -1)
-      {
-         index = i;
-         break;
-      }
+      SSNES_LOG("Netplay: sent spectators %.1f frames per batch, %.1f bytes of input per frame.\n",
+            (double)handle->spectators.batch.total_frames / handle->spectators.batch.total_batches,
+            (double)handle->spectators.batch.total_bytes / handle->spectators.batch.total_frames);
    }
 
-   // No vacant client streams :(
-   if (index == -1)
+#ifdef HAVE_NETPLAY_THREAD
+   if (handle->spectators.lock)
    {
-      close(new_fd);
-      return;
+      slock_lock(handle->spectators.lock);
+      handle->spectators.quit = true;
+      if (handle->spectators.cond)
+         scond_signal(handle->spectators.cond);
+      if (handle->spectators.join_cond)
+         scond_signal(handle->spectators.join_cond);
+      slock_unlock(handle->spectators.lock);
    }
 
-   if (!get_nickname(handle, new_fd))
+   if (handle->spectators.thread)
+      sthread_join(handle->spectators.thread);
+   if (handle->spectators.join_thread)
+      sthread_join(handle->spectators.join_thread);
+
+   if (handle->spectators.lock)
+      slock_free(handle->spectators.lock);
+   if (handle->spectators.cond)
+      scond_free(handle->spectators.cond);
+   if (handle->spectators.join_cond)
+      scond_free(handle->spectators.join_cond);
+
+   for (size_t i = 0; i < handle->spectators.num_pending; i++)
+      close(handle->spectators.pending[i].fd);
+   free(handle->spectators.pending);
+
+   for (size_t i = 0; i < handle->spectators.num_joining; i++)
+      close(handle->spectators.joining[i].fd);
+   free(handle->spectators.joining);
+#endif
+
+   for (size_t i = 0; i < handle->spectators.num_clients; i++)
+      close(handle->spectators.clients[i].fd);
+   free(handle->spectators.clients);
+
+   free(handle->spectators.ring);
+   free(handle->spectators.batch.data);
+   free(handle->spectators.batch.prev);
+   free(handle->spectators.snapshot.state);
+   free(handle->spectators.snapshot.zero);
+   free(handle->spectators.snapshot.packed);
+   memset(&handle->spectators, 0, sizeof(handle->spectators));
+}
+
+// Runs the frames we missed while joining without showing them.
+static void netplay_catchup_spectate(netplay_t *handle)
+{
+   SSNES_LOG("Fast-forwarding %u frames to catch up with host.\n", (unsigned)handle->spectate_catchup);
+
+   handle->is_replay = true;
+   while (handle->spectate_catchup)
    {
-      SSNES_ERR("Failed to get nickname from client.\n");
-      close(new_fd);
-      return;
+      handle->spectate_catchup--;
+      psnes_run();
+      spectate_end_frame(handle);
    }
+   handle->is_replay = false;
+}
 
-   if (!send_nickname(handle, new_fd))
+static void netplay_pre_frame_spectate(netplay_t *handle)
+{
+   if (handle->spectate_client)
    {
-      SSNES_ERR("Failed to send nickname to client.\n");
-      close(new_fd);
+      if (handle->spectate_catchup)
+         netplay_catchup_spectate(handle);
       return;
    }
 
-   size_t header_size;
-   uint32_t *header = bsv_header_generate(&header_size, implementation_magic_value());
-   if (!header)
+   // Accept everyone who's waiting. Handshakes happen elsewhere if we have threads.
+   for (;;)
    {
-      SSNES_ERR("Failed to generate BSV header.\n");
-      close(new_fd);
-      return;
-   }
+      fd_set fds;
+      FD_ZERO(&fds);
+      FD_SET(handle->fd, &fds);
 
-   int bufsize = header_size;
-   setsockopt(new_fd, SOL_SOCKET, SO_SNDBUF, CONST_CAST &bufsize, sizeof(int));
+      struct timeval tmp_tv = {0};
+      if (select(handle->fd + 1, &fds, NULL, NULL, &tmp_tv) <= 0)
+         return;
 
-   if (!send_all(new_fd, header, header_size))
-   {
-      SSNES_ERR("Failed to send header to client.\n");
-      close(new_fd);
-      free(header);
-      return;
-   }
+      if (!FD_ISSET(handle->fd, &fds))
+         return;
+
+      struct sockaddr_storage their_addr;
+      socklen_t addr_size = sizeof(their_addr);
+      int new_fd = accept(handle->fd, (struct sockaddr*)&their_addr, &addr_size);
+      if (new_fd < 0)
+      {
+         SSNES_ERR("Failed to accept incoming spectator.\n");
+         return;
+      }
 
-   free(header);
-   handle->spectate_fds[index] = new_fd;
+      struct spectator client = {0};
+      client.fd = new_fd;
+      client.id = handle->spectators.next_id++;
 
 #ifndef HAVE_SOCKET_LEGACY
-   log_connection(&their_addr, index, handle->other_nick);
+      log_connection(&their_addr, client.id, "spectator");
+#endif
+
+#ifdef HAVE_NETPLAY_THREAD
+      slock_lock(handle->spectators.lock);
+      if (spectate_append_client(&handle->spectators.joining,
+               &handle->spectators.num_joining, &handle->spectators.joining_cap, &client))
+         scond_signal(handle->spectators.join_cond);
+      else
+         close(new_fd);
+      slock_unlock(handle->spectators.lock);
+#else
+      spectate_join(handle, &client);
 #endif
+   }
 }
 
 void netplay_pre_frame(netplay_t *handle)
@@ -1376,12 +3981,20 @@ static void netplay_post_frame_net(netplay_t *handle)
 {
    handle->frame_count++;
 
+   // Input can arrive ahead of its frame, but only frames we have run can be confirmed.
+   bool read_ahead = handle->read_frame_count > handle->frame_count;
+   uint32_t confirm_frame_count = read_ahead ? handle->frame_count : handle->read_frame_count;
+   size_t confirm_ptr = read_ahead ? handle->self_ptr : handle->read_ptr;
+
+   // A resync puts the host's state in place of ours, and everything after it is replayed.
+   bool resync = desync_apply(handle);
+
    // Nothing to do...
-   if (handle->other_frame_count == handle->read_frame_count)
+   if (!resync && handle->other_frame_count == confirm_frame_count)
       return;
 
    // Skip ahead if we predicted correctly. Skip until our simulation failed.
-   while (handle->other_frame_count < handle->read_frame_count)
+   while (!resync && handle->other_frame_count < confirm_frame_count)
    {
       const struct delta_frame *ptr = &handle->buffer[handle->other_ptr];
       if ((ptr->simulated_input_state != ptr->real_input_state) && !ptr->used_real)
@@ -1390,18 +4003,48 @@ static void netplay_post_frame_net(netplay_t *handle)
       handle->other_frame_count++;
    }
 
-   if (handle->other_frame_count < handle->read_frame_count)
+   if (resync || handle->other_frame_count < confirm_frame_count)
    {
       // Replay frames
+      int64_t start_time = ssnes_get_time_usec();
       handle->is_replay = true;
-      handle->tmp_ptr = handle->other_ptr;
-      handle->tmp_frame_count = handle->other_frame_count;
+      handle->replay.rollbacks++;
+      telemetry_rollback(handle, handle->frame_count - handle->other_frame_count);
+
+      // Start from the nearest checkpoint, and run up to where the replay actually starts.
+      advance_base(handle, handle->other_ptr);
+      psnes_unserialize((uint8_t*)handle->base_state, handle->state_size);
+      memcpy(handle->last_state, handle->base_state, handle->state_words * sizeof(uint32_t));
+      handle->desync.last_hash = handle->desync.base_hash;
+
+      handle->tmp_ptr = handle->base_ptr;
+      handle->tmp_frame_count = handle->other_frame_count -
+         (handle->other_ptr + handle->buffer_size - handle->base_ptr) % handle->buffer_size;
 
-      psnes_unserialize(handle->buffer[handle->other_ptr].state, handle->state_size);
       bool first = true;
       while (first || (handle->tmp_ptr != handle->self_ptr))
       {
-         psnes_serialize(handle->buffer[handle->tmp_ptr].state, handle->state_size);
+         bool replayed = handle->tmp_frame_count >= handle->other_frame_count;
+         if (replayed && handle->tmp_ptr != handle->base_ptr)
+         {
+            if (handle->tmp_frame_count % REPLAY_CHECKPOINT_INTERVAL == 0 ||
+                  handle->tmp_ptr == confirm_ptr ||
+                  NEXT_PTR(handle->tmp_ptr) == handle->self_ptr ||
+                  DESYNC_CHECK_FRAME(handle, handle->tmp_frame_count))
+            {
+               int64_t serialize_start = ssnes_get_time_usec();
+               store_state(handle, handle->tmp_ptr);
+               handle->replay.serialize_usec += ssnes_get_time_usec() - serialize_start;
+               handle->replay.stored++;
+            }
+            else
+            {
+               drop_state(handle, handle->tmp_ptr);
+               handle->replay.skipped++;
+            }
+         }
+
+         int64_t run_start = ssnes_get_time_usec();
 #ifdef HAVE_THREADS
          lock_autosave();
 #endif
@@ -1409,13 +4052,21 @@ static void netplay_post_frame_net(netplay_t *handle)
 #ifdef HAVE_THREADS
          unlock_autosave();
 #endif
+         handle->replay.run_usec += ssnes_get_time_usec() - run_start;
+         if (replayed)
+            handle->replay.frames++;
+         else
+            handle->replay.resimulated++;
+
          handle->tmp_ptr = NEXT_PTR(handle->tmp_ptr);
          handle->tmp_frame_count++;
          first = false;
       }
 
-      handle->other_ptr = handle->read_ptr;
-      handle->other_frame_count = handle->read_frame_count;
+      handle->replay.usec += ssnes_get_time_usec() - start_time;
+
+      handle->other_ptr = confirm_ptr;
+      handle->other_frame_count = confirm_frame_count;
       handle->is_replay = false;
    }
 }
@@ -1423,29 +4074,45 @@ static void netplay_post_frame_net(netplay_t *handle)
 static void netplay_post_frame_spectate(netplay_t *handle)
 {
    if (handle->spectate_client)
+   {
+      spectate_end_frame(handle);
       return;
+   }
 
-   for (unsigned i = 0; i < MAX_SPECTATORS; i++)
-   {
-      if (handle->spectate_fds[i] == -1)
-         continue;
+#ifdef HAVE_NETPLAY_THREAD
+   uint32_t write = handle->spectators.write;
+#endif
+   spectate_batch_add_frame(handle, handle->spectate_input, handle->spectate_input_ptr);
+   handle->spectate_input_ptr = 0;
 
-      if (!send_all(handle->spectate_fds[i],
-               handle->spectate_input, handle->spectate_input_ptr * sizeof(int16_t)))
-      {
-         SSNES_LOG("Client (#%u) disconnected ...\n", i);
+   if (handle->spectators.batch.frames >= SPECTATE_BATCH_FRAMES ||
+         handle->spectators.batch.size >= SPECTATE_BATCH_FLUSH_SIZE)
+      spectate_write_batch(handle);
 
-         char msg[512];
-         snprintf(msg, sizeof(msg), "Client (#%u) disconnected.", i);
-         msg_queue_push(g_extern.msg_queue, msg, 1, 180);
+#ifdef HAVE_NETPLAY_THREAD
+   // Joining clients all share one save state, so a burst of them costs a single serialize.
+   if (handle->spectators.snapshot.wanted && !spectate_take_snapshot(handle))
+      SSNES_ERR("Failed to take save state for joining spectators.\n");
 
-         close(handle->spectate_fds[i]);
-         handle->spectate_fds[i] = -1;
-         break;
-      }
+   // The sender only has to wake up once there's a new batch.
+   if (write != handle->spectators.write)
+   {
+      slock_lock(handle->spectators.lock);
+      scond_signal(handle->spectators.cond);
+      slock_unlock(handle->spectators.lock);
    }
+#else
+   spectate_flush(handle);
+#endif
 
-   handle->spectate_input_ptr = 0;
+   unsigned dropped = handle->spectators.dropped;
+   if (dropped != handle->spectators.dropped_reported)
+   {
+      char msg[512];
+      snprintf(msg, sizeof(msg), "%u spectator(s) disconnected.", dropped - handle->spectators.dropped_reported);
+      msg_queue_push(g_extern.msg_queue, msg, 1, 180);
+      handle->spectators.dropped_reported = dropped;
+   }
 }
 
 // Here we check if we have new input and replay from recorded input.
@@ -1454,7 +4121,11 @@ void netplay_post_frame(netplay_t *handle)
    if (handle->spectate)
       netplay_post_frame_spectate(handle);
    else
+   {
       netplay_post_frame_net(handle);
+      desync_check(handle);
+      telemetry_poll(handle);
+   }
 }
 
 #ifdef HAVE_SOCKET_LEGACY
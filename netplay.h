@@ -33,6 +33,11 @@ int16_t input_state_spectate_client(bool port, unsigned device, unsigned index,
 
 typedef struct netplay netplay_t;
 
+// Upper bound for the frames argument of netplay_new().
+#define NETPLAY_MAX_FRAMES 120
+// Upper bound for netplay_input_delay.
+#define NETPLAY_MAX_INPUT_DELAY 10
+
 struct snes_callbacks
 {
    snes_video_refresh_t frame_cb;
@@ -47,6 +52,38 @@ netplay_t *netplay_new(const char *server,
       const char *nick);
 void netplay_free(netplay_t *handle);
 
+struct netplay_stats
+{
+   uint32_t frames; // Frames run, not counting replays.
+
+   uint64_t rollbacks;
+   uint64_t replayed_frames;
+   uint64_t resimulated_frames; // Frames run from a checkpoint to get to where a replay starts.
+   uint64_t replay_usec;
+
+   uint64_t predicted_frames; // Frames that were run with predicted input of the other player.
+   uint64_t prediction_hits;
+
+   uint64_t stalls; // Frames we had to wait for the other player on.
+   uint64_t stall_usec;
+   uint64_t time_sync_frames; // Frames waited out to let the other player catch up.
+
+   uint64_t packets;
+   uint64_t packets_lost;
+   uint64_t desync_checks; // State hashes compared with the other player's.
+   uint64_t desyncs;
+   uint64_t resyncs;
+
+   uint64_t packets_sent;
+   uint64_t bytes_sent;
+   uint64_t frames_sent; // Frames of input in sent packets, counting every time a frame is resent.
+   uint64_t rtt_samples;
+   uint64_t rtt_usec_total; // Mean round trip time is rtt_usec_total / rtt_samples.
+};
+
+// Totals since netplay_new(). Everything is zero when spectating.
+void netplay_get_stats(netplay_t *handle, struct netplay_stats *stats);
+
 // On regular netplay, flip who controls player 1 and 2.
 void netplay_flip_players(netplay_t *handle);
 
@@ -10,6 +10,7 @@ PACKAGE_VERSION=0.9.5
 add_command_line_enable DYNAMIC "Disable dynamic loading of libsnes library" yes
 add_command_line_string LIBSNES "libsnes library used" ""
 add_command_line_enable THREADS "Threading support" auto
+add_command_line_enable MMAP "Enable memory mapped rewind spill file and movie playback" auto
 add_command_line_enable FFMPEG "Enable FFmpeg recording support" auto
 add_command_line_enable X264RGB "Enable lossless X264 RGB recording" no
 add_command_line_enable DYLIB "Enable dynamic loading support" auto
@@ -21,20 +21,209 @@
 #include "boolean.h"
 #include <string.h>
 #include <limits.h>
+#include "timer.h"
+
+#ifndef REWIND_TEST
 #include "general.h"
+#else
+#include <stdio.h>
+#define SSNES_LOG(...)
+#define SSNES_WARN(...) fprintf(stderr, __VA_ARGS__)
+#define ssnes_assert(cond) do { if (!(cond)) abort(); } while (0)
+#endif
+
+#ifdef HAVE_THREADS
+#include "thread.h"
+#endif
+
+#ifdef HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if __SSE2__
+#include <emmintrin.h>
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__))
+#include <immintrin.h>
+#define HAVE_REWIND_AVX2 1
+#endif
+#endif
+
+// The ring buffer holds one record per pushed state, oldest at bottom_ptr, newest ending at top_ptr.
+// A record looks like:
+//
+// [u32 payload size] [payload] [u32 payload size]
+//
+// The size is stored at both ends so the ring can be walked backwards (pop) and forwards (evicting the oldest record).
+// The payload is a list of runs of changed words:
+//
+// [varint words skipped since end of previous run] [varint run length in words] [run length * u32 xor]
+//
+// Keyframe records have KEYFRAME_FLAG set in the size and store the full previous state instead.
+// Pointers are free-running byte counters and are masked on access.
+#define KEYFRAME_FLAG 0x80000000U
+
+struct keyframe
+{
+   uint64_t frame;
+   size_t ptr; // Start of record.
+};
 
 struct state_manager
 {
-   uint64_t *buffer;
+   uint8_t *buffer;
    size_t buf_size;
    size_t buf_size_mask;
-   uint32_t *tmp_state;
+   uint32_t *tmp_state; // The newest state.
+   uint32_t *next_state; // Handed out by state_manager_get_buffer() in synchronous mode. Swapped with tmp_state on push.
    size_t top_ptr;
    size_t bottom_ptr;
    size_t state_size;
    bool first_pop;
+
+   uint8_t *scratch; // Linear buffer a record is encoded into/decoded from.
+   size_t scratch_size;
+
+   struct state_manager_stats stats;
+
+   // Records are numbered. The newest is head_frame, the oldest is head_frame - frames + 1.
+   uint64_t head_frame;
+   size_t frames;
+
+   // Ring of keyframe records currently in the buffer, oldest first.
+   unsigned keyframe_interval;
+   struct keyframe *keyframes;
+   size_t keyframes_size;
+   size_t keyframes_first;
+   size_t keyframes_count;
+
+#ifdef HAVE_MMAP
+   // Records evicted from the ring are appended to a memory mapped spill file rather than being discarded.
+   // The newest spilled record is the one right before the oldest record in the ring.
+   struct
+   {
+      int fd;
+      uint8_t *map;
+      size_t map_size;
+      size_t max_size;
+      uint64_t start; // Start of the oldest record.
+      uint64_t end; // End of the newest record.
+      size_t frames;
+   } spill;
+#endif
+
+#ifdef HAVE_THREADS
+   // Asynchronous mode. Serialized states are queued up (oldest first) and committed to the ring by a worker.
+   // The ring, tmp_state and scratch belong to the worker while busy is set.
+   struct
+   {
+      bool enable;
+      bool quit;
+      bool busy;
+
+      uint32_t **buffers;
+      unsigned num_buffers;
+
+      uint32_t **free_list;
+      unsigned num_free;
+
+      uint32_t **queue;
+      unsigned queue_head;
+      unsigned queue_count;
+
+      sthread_t *thread;
+      slock_t *lock;
+      scond_t *work_cond;
+      scond_t *done_cond;
+
+      // Published by the worker after each commit so stats can be read without waiting for it.
+      struct state_manager_stats stats;
+   } async;
+#endif
 };
 
+// Returns index of first word >= i where the states differ, or size if none does.
+typedef size_t (*find_diff_t)(const uint32_t *a, const uint32_t *b, size_t i, size_t size);
+
+static size_t find_diff_c(const uint32_t *a, const uint32_t *b, size_t i, size_t size)
+{
+   while (i < size && a[i] == b[i])
+      i++;
+   return i;
+}
+
+#if __SSE2__
+static inline unsigned ctz32(uint32_t v)
+{
+#ifdef __GNUC__
+   return __builtin_ctz(v);
+#else
+   unsigned ret = 0;
+   while (!(v & 1))
+   {
+      v >>= 1;
+      ret++;
+   }
+   return ret;
+#endif
+}
+
+// Compares 4 words at a time. Identical spans never branch per word.
+static size_t find_diff_sse2(const uint32_t *a, const uint32_t *b, size_t i, size_t size)
+{
+   for (; i + 4 <= size; i += 4)
+   {
+      __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(a + i)),
+            _mm_loadu_si128((const __m128i*)(b + i)));
+      uint32_t mask = ~(uint32_t)_mm_movemask_epi8(eq) & 0xffff;
+      if (mask)
+         return i + (ctz32(mask) >> 2);
+   }
+
+   return find_diff_c(a, b, i, size);
+}
+
+#ifdef HAVE_REWIND_AVX2
+__attribute__((target("avx2")))
+static size_t find_diff_avx2(const uint32_t *a, const uint32_t *b, size_t i, size_t size)
+{
+   for (; i + 8 <= size; i += 8)
+   {
+      __m256i eq = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(a + i)),
+            _mm256_loadu_si256((const __m256i*)(b + i)));
+      uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(eq);
+      if (mask)
+         return i + (ctz32(mask) >> 2);
+   }
+
+   return find_diff_sse2(a, b, i, size);
+}
+#endif
+#endif
+
+static find_diff_t select_find_diff(const char **name)
+{
+#if defined(HAVE_REWIND_AVX2)
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2"))
+   {
+      *name = "AVX2";
+      return find_diff_avx2;
+   }
+#endif
+
+#if __SSE2__
+   *name = "SSE2";
+   return find_diff_sse2;
+#else
+   *name = "C";
+   return find_diff_c;
+#endif
+}
+
 static inline size_t nearest_pow2_size(size_t v)
 {
    size_t orig = v;
@@ -62,6 +251,148 @@ static inline size_t nearest_pow2_size(size_t v)
       return prev;
 }
 
+static inline size_t write_varint(uint8_t *out, uint32_t v)
+{
+   size_t len = 0;
+   while (v >= 0x80)
+   {
+      out[len++] = (uint8_t)(v | 0x80);
+      v >>= 7;
+   }
+   out[len++] = (uint8_t)v;
+   return len;
+}
+
+static inline uint32_t read_varint(const uint8_t **in)
+{
+   uint32_t v = 0;
+   unsigned shift = 0;
+   const uint8_t *ptr = *in;
+   while (*ptr & 0x80)
+   {
+      v |= (uint32_t)(*ptr++ & 0x7f) << shift;
+      shift += 7;
+   }
+   v |= (uint32_t)*ptr++ << shift;
+   *in = ptr;
+   return v;
+}
+
+size_t state_delta_encode(uint8_t *out, const uint32_t *old_state, const uint32_t *new_state, size_t words)
+{
+   const char *name;
+   find_diff_t find_diff = select_find_diff(&name);
+   uint8_t *start = out;
+
+   // Only the differing words are visited; the scan between them is done in wide blocks where available.
+   size_t prev_end = 0;
+   for (size_t i = find_diff(old_state, new_state, 0, words);
+         i < words;
+         i = find_diff(old_state, new_state, i, words))
+   {
+      size_t end = i + 1;
+      while (end < words && old_state[end] != new_state[end])
+         end++;
+
+      out += write_varint(out, (uint32_t)(i - prev_end));
+      out += write_varint(out, (uint32_t)(end - i));
+
+      // The xor can be reversed by reapplying it.
+      for (; i < end; i++, out += sizeof(uint32_t))
+      {
+         uint32_t xor_ = old_state[i] ^ new_state[i];
+         memcpy(out, &xor_, sizeof(xor_));
+      }
+
+      prev_end = end;
+   }
+
+   return out - start;
+}
+
+void state_delta_apply(uint32_t *state, const uint8_t *delta, size_t size)
+{
+   const uint8_t *end = delta + size;
+   while (delta < end)
+   {
+      state += read_varint(&delta);
+      uint32_t len = read_varint(&delta);
+
+      for (uint32_t i = 0; i < len; i++, delta += sizeof(uint32_t))
+      {
+         uint32_t xor_;
+         memcpy(&xor_, delta, sizeof(xor_));
+         state[i] ^= xor_;
+      }
+      state += len;
+   }
+}
+
+static bool read_varint_checked(const uint8_t **in, const uint8_t *end, uint32_t *value)
+{
+   const uint8_t *ptr = *in;
+   uint32_t v = 0;
+   unsigned shift = 0;
+   do
+   {
+      if (ptr >= end || shift > 28)
+         return false;
+      v |= (uint32_t)(*ptr & 0x7f) << shift;
+      shift += 7;
+   } while (*ptr++ & 0x80);
+
+   *in = ptr;
+   *value = v;
+   return true;
+}
+
+bool state_delta_apply_checked(uint32_t *state, size_t words, const uint8_t *delta, size_t size)
+{
+   const uint8_t *end = delta + size;
+   size_t pos = 0;
+   while (delta < end)
+   {
+      uint32_t skip, len;
+      if (!read_varint_checked(&delta, end, &skip) || !read_varint_checked(&delta, end, &len))
+         return false;
+
+      if (skip > words - pos || len > words - pos - skip || (size_t)(end - delta) / sizeof(uint32_t) < len)
+         return false;
+
+      pos += skip;
+      for (uint32_t i = 0; i < len; i++, pos++, delta += sizeof(uint32_t))
+      {
+         uint32_t xor_;
+         memcpy(&xor_, delta, sizeof(xor_));
+         state[pos] ^= xor_;
+      }
+   }
+
+   return true;
+}
+
+static void ring_write(state_manager_t *state, size_t pos, const void *data, size_t size)
+{
+   pos &= state->buf_size_mask;
+   size_t first = state->buf_size - pos;
+   if (first > size)
+      first = size;
+
+   memcpy(state->buffer + pos, data, first);
+   memcpy(state->buffer, (const uint8_t*)data + first, size - first);
+}
+
+static void ring_read(const state_manager_t *state, size_t pos, void *data, size_t size)
+{
+   pos &= state->buf_size_mask;
+   size_t first = state->buf_size - pos;
+   if (first > size)
+      first = size;
+
+   memcpy(data, state->buffer + pos, first);
+   memcpy((uint8_t*)data + first, state->buffer, size - first);
+}
+
 state_manager_t *state_manager_new(size_t state_size, size_t buffer_size, void *init_buffer)
 {
    if (buffer_size <= state_size * 4) // Need a sufficient buffer size.
@@ -73,17 +404,33 @@ state_manager_t *state_manager_new(size_t state_size, size_t buffer_size, void *
 
    // We need 4-byte aligned state_size to avoid having to enforce this with unneeded memcpy's!
    ssnes_assert(state_size % 4 == 0);
-   state->top_ptr = 1;
+   const char *find_diff_name;
+   select_find_diff(&find_diff_name);
+   SSNES_LOG("Rewind delta [%s]\n", find_diff_name);
+#ifdef HAVE_MMAP
+   state->spill.fd = -1;
+#endif
 
    state->state_size = state_size / sizeof(uint32_t); // Works in multiple of 4.
-   state->buf_size = nearest_pow2_size(buffer_size) / sizeof(uint64_t); // Works in multiple of 8.
+   state->buf_size = nearest_pow2_size(buffer_size);
    state->buf_size_mask = state->buf_size - 1;
-   SSNES_LOG("Readjusted rewind buffer size to %u MiB\n", (unsigned)(sizeof(uint64_t) * (state->buf_size >> 20)));
+   SSNES_LOG("Readjusted rewind buffer size to %u MiB\n", (unsigned)(state->buf_size >> 20));
+
+   state->scratch_size = STATE_DELTA_MAX_SIZE(state->state_size);
 
-   if (!(state->buffer = (uint64_t*)calloc(1, state->buf_size * sizeof(uint64_t))))
+   if (!(state->buffer = (uint8_t*)calloc(1, state->buf_size)))
       goto error;
    if (!(state->tmp_state = (uint32_t*)calloc(1, state->state_size * sizeof(uint32_t))))
       goto error;
+   if (!(state->next_state = (uint32_t*)calloc(1, state->state_size * sizeof(uint32_t))))
+      goto error;
+   if (!(state->scratch = (uint8_t*)malloc(state->scratch_size)))
+      goto error;
+
+   // Every keyframe takes up at least a full state in the ring, which bounds how many can be live.
+   state->keyframes_size = state->buf_size / (state_size + 2 * sizeof(uint32_t)) + 1;
+   if (!(state->keyframes = (struct keyframe*)calloc(state->keyframes_size, sizeof(*state->keyframes))))
+      goto error;
 
    memcpy(state->tmp_state, init_buffer, state_size);
 
@@ -94,20 +441,415 @@ error:
    {
       free(state->buffer);
       free(state->tmp_state);
+      free(state->next_state);
+      free(state->scratch);
+      free(state->keyframes);
       free(state);
    }
    return NULL;
 }
 
+#ifdef HAVE_THREADS
+static void deinit_async(state_manager_t *state);
+static bool async_pop(state_manager_t *state, void **data);
+static void fill_stats(state_manager_t *state, struct state_manager_stats *stats);
+#endif
+#ifdef HAVE_MMAP
+static void deinit_spill(state_manager_t *state);
+#endif
+
 void state_manager_free(state_manager_t *state)
 {
+#ifdef HAVE_THREADS
+   deinit_async(state);
+#endif
+#ifdef HAVE_MMAP
+   deinit_spill(state);
+#endif
+
    free(state->buffer);
    free(state->tmp_state);
+   free(state->next_state);
+   free(state->scratch);
+   free(state->keyframes);
    free(state);
 }
 
+void state_manager_set_keyframe_interval(state_manager_t *state, unsigned interval)
+{
+   state->keyframe_interval = interval;
+}
+
+static inline struct keyframe *keyframe_at(state_manager_t *state, size_t index)
+{
+   return &state->keyframes[(state->keyframes_first + index) % state->keyframes_size];
+}
+
+static inline size_t history_frames(const state_manager_t *state)
+{
+#ifdef HAVE_MMAP
+   return state->frames + state->spill.frames;
+#else
+   return state->frames;
+#endif
+}
+
+static void update_pop_stats(state_manager_t *state, int64_t usec)
+{
+   state->stats.pops++;
+   state->stats.pop_usec_total += usec;
+   if (usec > state->stats.pop_usec_peak)
+      state->stats.pop_usec_peak = usec;
+}
+
+#ifdef HAVE_MMAP
+#define SPILL_MAGIC "SSNESRWD"
+#define SPILL_MIN_SIZE (16 << 20)
+
+// Record positions are free-running byte counters into the data after the header, taken modulo the capacity.
+// The file only wraps around once it has grown to max_size, so positions map linearly while it's still growing.
+struct spill_header
+{
+   char magic[8];
+   uint32_t state_size;
+   uint32_t pad;
+   uint64_t start;
+   uint64_t end;
+   uint64_t frames;
+   uint64_t capacity;
+};
+
+static inline size_t spill_capacity(const state_manager_t *state)
+{
+   return state->spill.map_size - sizeof(struct spill_header);
+}
+
+static void spill_write(state_manager_t *state, uint64_t pos, const void *data, size_t size)
+{
+   uint8_t *base = state->spill.map + sizeof(struct spill_header);
+   size_t capacity = spill_capacity(state);
+   size_t offset = pos % capacity;
+   size_t first = capacity - offset < size ? capacity - offset : size;
+   memcpy(base + offset, data, first);
+   memcpy(base, (const uint8_t*)data + first, size - first);
+}
+
+static void spill_read(const state_manager_t *state, uint64_t pos, void *data, size_t size)
+{
+   const uint8_t *base = state->spill.map + sizeof(struct spill_header);
+   size_t capacity = spill_capacity(state);
+   size_t offset = pos % capacity;
+   size_t first = capacity - offset < size ? capacity - offset : size;
+   memcpy(data, base + offset, first);
+   memcpy((uint8_t*)data + first, base, size - first);
+}
+
+// Allocates blocks for the whole file up front. A sparse file would only run out of disk space
+// when a page of the mapping is written back, which raises SIGBUS instead of failing here.
+static bool spill_allocate(int fd, size_t old_size, size_t new_size)
+{
+#ifdef __APPLE__
+   (void)old_size;
+   return ftruncate(fd, new_size) == 0;
+#else
+   return posix_fallocate(fd, old_size, new_size - old_size) == 0;
+#endif
+}
+
+static void spill_close(state_manager_t *state)
+{
+   if (state->spill.map)
+   {
+      struct spill_header header = {SPILL_MAGIC};
+      header.state_size = state->state_size * sizeof(uint32_t);
+      header.start = state->spill.start;
+      header.end = state->spill.end;
+      header.frames = state->spill.frames;
+      header.capacity = spill_capacity(state);
+      memcpy(state->spill.map, &header, sizeof(header));
+
+      munmap(state->spill.map, state->spill.map_size);
+      // Don't leave the slack from growing the mapping on disk. Once wrapped around, all of it is in use.
+      if (state->spill.end <= header.capacity && ftruncate(state->spill.fd, sizeof(header) + state->spill.end) < 0)
+         SSNES_WARN("Failed to truncate rewind spill file.\n");
+   }
+
+   if (state->spill.fd >= 0)
+      close(state->spill.fd);
+
+   memset(&state->spill, 0, sizeof(state->spill));
+   state->spill.fd = -1;
+}
+
+// Records evicted from now on are discarded, which leaves a gap between the spilled history and the ring.
+// The spilled history can't be used after that, so it's thrown away, also on disk.
+static void spill_discard(state_manager_t *state)
+{
+   SSNES_WARN("Failed to grow rewind spill file. Discarding spilled rewind history.\n");
+
+   if (state->spill.map)
+      munmap(state->spill.map, state->spill.map_size);
+   state->spill.map = NULL;
+
+   if (state->spill.fd >= 0 && ftruncate(state->spill.fd, 0) < 0)
+      SSNES_WARN("Failed to truncate rewind spill file.\n");
+
+   spill_close(state);
+}
+
+// Drops the oldest spilled record. The ones after it are deltas towards newer states, so they stay usable.
+static void spill_drop_oldest(state_manager_t *state)
+{
+   uint32_t size;
+   spill_read(state, state->spill.start, &size, sizeof(size));
+   state->spill.start += (size & ~KEYFRAME_FLAG) + 2 * sizeof(size);
+   state->spill.frames--;
+   state->stats.spill_evictions++;
+}
+
+// Makes room for size more bytes at the end of the spill file.
+// The file grows up to max_size. After that, it wraps around and the oldest spilled records make room.
+// If the file can't grow, spilling is disabled and records are discarded as before.
+static bool spill_reserve(state_manager_t *state, size_t size)
+{
+   if (!state->spill.map)
+      return false;
+
+   // Positions only map to the same place after growing if nothing has wrapped around yet.
+   size_t capacity = spill_capacity(state);
+   if (state->spill.end + size > capacity && state->spill.end <= capacity &&
+         state->spill.map_size < state->spill.max_size)
+   {
+      size_t new_size = state->spill.map_size;
+      while (new_size < state->spill.max_size && new_size - sizeof(struct spill_header) < state->spill.end + size)
+         new_size *= 2;
+      if (new_size > state->spill.max_size)
+         new_size = state->spill.max_size;
+
+      munmap(state->spill.map, state->spill.map_size);
+      state->spill.map = NULL;
+
+      if (!spill_allocate(state->spill.fd, state->spill.map_size, new_size) ||
+            (state->spill.map = (uint8_t*)mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, state->spill.fd, 0)) == MAP_FAILED)
+      {
+         state->spill.map = NULL;
+         spill_discard(state);
+         return false;
+      }
+
+      state->spill.map_size = new_size;
+      capacity = spill_capacity(state);
+   }
+
+   while (state->spill.frames && state->spill.end + size - state->spill.start > capacity)
+      spill_drop_oldest(state);
+
+   // A record bigger than the whole file is dropped. Everything older has been dropped with it.
+   return size <= capacity;
+}
+
+static bool spill_append(state_manager_t *state, const void *header, const void *payload, size_t size)
+{
+   if (!spill_reserve(state, size + 2 * sizeof(uint32_t)))
+      return false;
+
+   spill_write(state, state->spill.end, header, sizeof(uint32_t));
+   spill_write(state, state->spill.end + sizeof(uint32_t), payload, size);
+   spill_write(state, state->spill.end + sizeof(uint32_t) + size, header, sizeof(uint32_t));
+   state->spill.end += size + 2 * sizeof(uint32_t);
+   state->spill.frames++;
+   return true;
+}
+
+// Moves the record at bottom_ptr into the spill file.
+static void spill_record(state_manager_t *state, uint32_t header)
+{
+   size_t size = (header & ~KEYFRAME_FLAG) + 2 * sizeof(uint32_t);
+   if (!spill_reserve(state, size))
+      return;
+
+   size_t capacity = spill_capacity(state);
+   size_t offset = state->spill.end % capacity;
+   size_t first = capacity - offset < size ? capacity - offset : size;
+   uint8_t *base = state->spill.map + sizeof(struct spill_header);
+   ring_read(state, state->bottom_ptr, base + offset, first);
+   ring_read(state, state->bottom_ptr + first, base, size - first);
+   state->spill.end += size;
+   state->spill.frames++;
+}
+
+// Pops the newest spilled record. Pages are brought in by the OS as we touch them.
+static void spill_pop(state_manager_t *state)
+{
+   uint32_t size;
+   spill_read(state, state->spill.end - sizeof(size), &size, sizeof(size));
+   bool keyframe = size & KEYFRAME_FLAG;
+   size &= ~KEYFRAME_FLAG;
+
+   state->spill.end -= size + 2 * sizeof(size);
+   state->spill.frames--;
+   state->head_frame--;
+
+   if (keyframe)
+      spill_read(state, state->spill.end + sizeof(size), state->tmp_state, size);
+   else
+   {
+      spill_read(state, state->spill.end + sizeof(size), state->scratch, size);
+      state_delta_apply(state->tmp_state, state->scratch, size);
+   }
+
+   // Start over at the beginning, so the file can shrink again.
+   if (!state->spill.frames)
+      state->spill.start = state->spill.end = 0;
+}
+
+bool state_manager_init_spill(state_manager_t *state, const char *path, size_t max_size)
+{
+   if (max_size <= sizeof(struct spill_header))
+   {
+      SSNES_WARN("Rewind spill file size limit is too small.\n");
+      return false;
+   }
+
+   state->spill.fd = open(path, O_RDWR | O_CREAT, 0644);
+   if (state->spill.fd < 0)
+   {
+      SSNES_WARN("Failed to open rewind spill file \"%s\".\n", path);
+      return false;
+   }
+
+   struct stat st;
+   if (fstat(state->spill.fd, &st) < 0)
+      goto error;
+
+   // Pick up history from earlier sessions, as long as the state format still matches and it fits.
+   struct spill_header header = {{0}};
+   size_t map_size = 0;
+   if ((size_t)st.st_size >= sizeof(header) && read(state->spill.fd, &header, sizeof(header)) == sizeof(header))
+   {
+      bool wrapped = header.end > header.capacity;
+      uint64_t used = wrapped ? header.capacity : header.end;
+      if (memcmp(header.magic, SPILL_MAGIC, sizeof(header.magic)) ||
+            header.state_size != state->state_size * sizeof(uint32_t) ||
+            header.start > header.end || header.end - header.start > header.capacity ||
+            sizeof(header) + used > (uint64_t)st.st_size)
+         SSNES_WARN("Rewind spill file \"%s\" does not match current state format. Discarding it.\n", path);
+      else if (sizeof(header) + used > max_size)
+         SSNES_WARN("Rewind spill file \"%s\" is larger than the size limit. Discarding it.\n", path);
+      else
+      {
+         state->spill.start = header.start;
+         state->spill.end = header.end;
+         state->spill.frames = header.frames;
+         // Positions of wrapped around history only make sense with the capacity they were written with.
+         if (wrapped)
+            map_size = sizeof(header) + header.capacity;
+      }
+   }
+
+   if (!map_size)
+   {
+      map_size = SPILL_MIN_SIZE;
+      while (map_size < max_size && map_size - sizeof(header) < state->spill.end)
+         map_size *= 2;
+      if (map_size > max_size)
+         map_size = max_size;
+   }
+
+   state->spill.max_size = max_size;
+   state->spill.map_size = map_size;
+
+   // Drops whatever is past the mapping, such as a file from a larger limit that was discarded.
+   if ((size_t)st.st_size > map_size && ftruncate(state->spill.fd, map_size) < 0)
+      goto error;
+   if (!spill_allocate(state->spill.fd, 0, map_size))
+      goto error;
+
+   state->spill.map = (uint8_t*)mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, state->spill.fd, 0);
+   if (state->spill.map == MAP_FAILED)
+   {
+      state->spill.map = NULL;
+      goto error;
+   }
+
+   SSNES_LOG("Rewind: spilling old history to \"%s\", %u states from earlier sessions.\n",
+         path, (unsigned)state->spill.frames);
+   state->head_frame = state->spill.frames;
+   return true;
+
+error:
+   SSNES_WARN("Failed to map rewind spill file \"%s\".\n", path);
+   spill_close(state);
+   return false;
+}
+
+// Moves all history into the spill file, followed by the current state, which is where the next session continues from.
+static void deinit_spill(state_manager_t *state)
+{
+   if (!state->spill.map)
+   {
+      spill_close(state);
+      return;
+   }
+
+   while (state->bottom_ptr != state->top_ptr)
+   {
+      uint32_t header;
+      ring_read(state, state->bottom_ptr, &header, sizeof(header));
+      spill_record(state, header);
+      state->bottom_ptr += (header & ~KEYFRAME_FLAG) + 2 * sizeof(header);
+   }
+
+   // The spilled deltas lead back from the current state, so without it they're useless.
+   uint32_t header = (state->state_size * sizeof(uint32_t)) | KEYFRAME_FLAG;
+   if (!spill_append(state, &header, state->tmp_state, state->state_size * sizeof(uint32_t)))
+   {
+      state->spill.start = state->spill.end = 0;
+      state->spill.frames = 0;
+   }
+   spill_close(state);
+}
+#endif
+
+// Removes the newest record from the ring and applies it to tmp_state.
+static void pop_record(state_manager_t *state)
+{
+#ifdef HAVE_MMAP
+   if (!state->frames)
+   {
+      spill_pop(state);
+      return;
+   }
+#endif
+
+   uint32_t size;
+   ring_read(state, state->top_ptr - sizeof(size), &size, sizeof(size));
+   bool keyframe = size & KEYFRAME_FLAG;
+   size &= ~KEYFRAME_FLAG;
+   state->top_ptr -= size + 2 * sizeof(size);
+
+   if (state->keyframes_count && keyframe_at(state, state->keyframes_count - 1)->frame == state->head_frame)
+      state->keyframes_count--;
+   state->head_frame--;
+   state->frames--;
+
+   if (keyframe)
+   {
+      ring_read(state, state->top_ptr + sizeof(size), state->tmp_state, size);
+      return;
+   }
+
+   ring_read(state, state->top_ptr + sizeof(size), state->scratch, size);
+   state_delta_apply(state->tmp_state, state->scratch, size);
+}
+
 bool state_manager_pop(state_manager_t *state, void **data)
 { 
+#ifdef HAVE_THREADS
+   if (state->async.enable && async_pop(state, data))
+      return true;
+#endif
+
    *data = state->tmp_state;
    if (state->first_pop)
    {
@@ -115,81 +857,394 @@ bool state_manager_pop(state_manager_t *state, void **data)
       return true;
    }
 
-   state->top_ptr = (state->top_ptr - 1) & state->buf_size_mask;
+   if (!history_frames(state)) // Our stack is completely empty... :v
+      return false;
+
+   int64_t start = ssnes_get_time_usec();
+   pop_record(state);
+   update_pop_stats(state, ssnes_get_time_usec() - start);
+   return true;
+}
 
-   if (state->top_ptr == state->bottom_ptr) // Our stack is completely empty... :v
+unsigned state_manager_pop_frames(state_manager_t *state, unsigned frames, void **data)
+{
+   unsigned popped = 0;
+
+   // States which are not in the ring yet are cheap to pop one by one.
+   // The first pop only hands back the current state, so it doesn't count as a frame rewound.
+#ifdef HAVE_THREADS
+   while (popped < frames && state->async.enable)
    {
-      state->top_ptr = (state->top_ptr + 1) & state->buf_size_mask;
-      return false;
+      bool first_pop = state->first_pop;
+      if (!async_pop(state, data))
+         break;
+      if (!first_pop)
+         popped++;
    }
+#endif
 
-   while (state->buffer[state->top_ptr])
+   if (state->first_pop)
    {
-      // Apply the xor patch.
-      uint32_t addr = state->buffer[state->top_ptr] >> 32;
-      uint32_t xor_ = state->buffer[state->top_ptr] & 0xFFFFFFFFU;
-      state->tmp_state[addr] ^= xor_;
+      state->first_pop = false;
+      *data = state->tmp_state;
+   }
+
+   size_t records = frames - popped;
+   if (records > history_frames(state))
+      records = history_frames(state);
+   if (!records)
+      return popped;
+
+   // Start from the oldest keyframe newer than the target state, if any,
+   // so only the deltas between it and the target have to be applied.
+   int64_t start_time = ssnes_get_time_usec();
+   uint64_t target = state->head_frame - records;
+   const struct keyframe *start = NULL;
+   for (size_t i = state->keyframes_count; i > 0 && keyframe_at(state, i - 1)->frame > target; i--)
+      start = keyframe_at(state, i - 1);
 
-      state->top_ptr = (state->top_ptr - 1) & state->buf_size_mask;
+   // Drop everything newer than the keyframe without applying it. Popping the keyframe record then restores its state in one go.
+   if (start)
+   {
+      state->top_ptr = start->ptr + state->state_size * sizeof(uint32_t) + 2 * sizeof(uint32_t);
+      state->frames -= state->head_frame - start->frame;
+      state->head_frame = start->frame;
+      while (state->keyframes_count && keyframe_at(state, state->keyframes_count - 1)->frame > state->head_frame)
+         state->keyframes_count--;
    }
 
-   if (state->top_ptr == state->bottom_ptr) // Our stack is completely empty... :v
+   while (state->head_frame > target)
+      pop_record(state);
+
+   update_pop_stats(state, ssnes_get_time_usec() - start_time);
+   *data = state->tmp_state;
+   return popped + records;
+}
+
+// Writes the record for data to the ring. The caller is responsible for making data the new tmp_state on success.
+static bool commit_state(state_manager_t *state, const void *data)
+{
+   int64_t start_time = ssnes_get_time_usec();
+   bool keyframe = state->keyframe_interval && (state->head_frame + 1) % state->keyframe_interval == 0;
+
+   uint32_t size;
+   const void *payload;
+   if (keyframe)
    {
-      state->top_ptr = (state->top_ptr + 1) & state->buf_size_mask;
-      return true;
+      size = state->state_size * sizeof(uint32_t);
+      payload = state->tmp_state;
+   }
+   else
+   {
+      size = state_delta_encode(state->scratch, state->tmp_state, (const uint32_t*)data, state->state_size);
+      payload = state->scratch;
+   }
+
+   size_t record_size = size + 2 * sizeof(size);
+   if (record_size > state->buf_size)
+      return false;
+
+   // Delete old cruft until the new record fits.
+   while (state->top_ptr - state->bottom_ptr + record_size > state->buf_size)
+   {
+      uint32_t old_size;
+      ring_read(state, state->bottom_ptr, &old_size, sizeof(old_size));
+#ifdef HAVE_MMAP
+      spill_record(state, old_size);
+#endif
+      state->bottom_ptr += (old_size & ~KEYFRAME_FLAG) + 2 * sizeof(old_size);
+
+      if (state->keyframes_count && state->keyframes[state->keyframes_first].frame == state->head_frame - state->frames + 1)
+      {
+         state->keyframes_first = (state->keyframes_first + 1) % state->keyframes_size;
+         state->keyframes_count--;
+      }
+      state->frames--;
+      state->stats.evictions++;
    }
 
+   uint32_t header = keyframe ? (size | KEYFRAME_FLAG) : size;
+   ring_write(state, state->top_ptr, &header, sizeof(header));
+   ring_write(state, state->top_ptr + sizeof(header), payload, size);
+   ring_write(state, state->top_ptr + sizeof(header) + size, &header, sizeof(header));
+
+   state->head_frame++;
+   state->frames++;
+   if (keyframe)
+   {
+      struct keyframe *entry = keyframe_at(state, state->keyframes_count++);
+      entry->frame = state->head_frame;
+      entry->ptr = state->top_ptr;
+   }
+
+   state->top_ptr += record_size;
+
+   int64_t usec = ssnes_get_time_usec() - start_time;
+   state->stats.pushes++;
+   state->stats.pushed_bytes += record_size;
+   if (record_size > state->stats.peak_record_size)
+      state->stats.peak_record_size = record_size;
+   state->stats.push_usec_total += usec;
+   if (usec > state->stats.push_usec_peak)
+      state->stats.push_usec_peak = usec;
+
    return true;
 }
 
-static void reassign_bottom(state_manager_t *state)
+bool state_manager_push(state_manager_t *state, const void *data)
 {
-   state->bottom_ptr = (state->top_ptr + 1) & state->buf_size_mask;
-   while (state->buffer[state->bottom_ptr]) // Skip ahead until we find the first 0 (boundary for state delta).
-      state->bottom_ptr = (state->bottom_ptr + 1) & state->buf_size_mask;
+   bool ret = commit_state(state, data);
+   if (ret)
+      memcpy(state->tmp_state, data, state->state_size * sizeof(uint32_t));
+   state->first_pop = true;
+   return ret;
 }
 
-static void generate_delta(state_manager_t *state, const void *data)
+// Makes buffer the new tmp_state without copying it. Returns the buffer that held the previous state.
+static uint32_t *swap_state(state_manager_t *state, uint32_t *buffer)
 {
-   bool crossed = false;
-   const uint32_t *old_state = state->tmp_state;
-   const uint32_t *new_state = (const uint32_t*)data;
-
-   state->buffer[state->top_ptr++] = 0; // For each separate delta, we have a 0 value sentinel in between.
-   state->top_ptr &= state->buf_size_mask;
+   uint32_t *old = state->tmp_state;
+   state->tmp_state = buffer;
+   return old;
+}
 
-   // Check if top_ptr and bottom_ptr crossed each other, which means we need to delete old cruft.
-   if (state->top_ptr == state->bottom_ptr)
-      crossed = true;
+#ifdef HAVE_THREADS
+static void async_thread(void *data)
+{
+   state_manager_t *state = (state_manager_t*)data;
 
-   for (uint64_t i = 0; i < state->state_size; i++)
+   slock_lock(state->async.lock);
+   for (;;)
    {
-      uint64_t xor_ = old_state[i] ^ new_state[i];
+      while (!state->async.queue_count && !state->async.quit)
+         scond_wait(state->async.work_cond, state->async.lock);
 
-      // If the data differs (xor != 0), we push that xor on the stack with index and xor.
-      // This can be reversed by reapplying the xor.
-      // This, if states don't really differ much, we'll save lots of space :)
-      // Hopefully this will work really well with save states.
-      if (xor_)
-      {
-         state->buffer[state->top_ptr] = (i << 32) | xor_;
-         state->top_ptr = (state->top_ptr + 1) & state->buf_size_mask;
+      if (state->async.quit)
+         break;
+
+      uint32_t *buffer = state->async.queue[state->async.queue_head];
+      state->async.busy = true;
+      slock_unlock(state->async.lock);
 
-         if (state->top_ptr == state->bottom_ptr)
-            crossed = true;
+      // The committed buffer becomes tmp_state, and the old tmp_state takes its place in the pool.
+      uint32_t *freed = buffer;
+      if (commit_state(state, buffer))
+      {
+         freed = swap_state(state, buffer);
+         for (unsigned i = 0; i < state->async.num_buffers; i++)
+         {
+            if (state->async.buffers[i] == buffer)
+               state->async.buffers[i] = freed;
+         }
       }
+
+      struct state_manager_stats stats;
+      fill_stats(state, &stats);
+
+      slock_lock(state->async.lock);
+      state->async.stats = stats;
+      state->async.queue_head = (state->async.queue_head + 1) % state->async.num_buffers;
+      state->async.queue_count--;
+      state->async.free_list[state->async.num_free++] = freed;
+      state->async.busy = false;
+      scond_signal(state->async.done_cond);
    }
+   slock_unlock(state->async.lock);
+}
 
-   if (crossed)
-      reassign_bottom(state);
+// Returns the newest queued buffer, or NULL. Lock must be held.
+static uint32_t *async_newest(state_manager_t *state)
+{
+   if (!state->async.queue_count)
+      return NULL;
+   return state->async.queue[(state->async.queue_head + state->async.queue_count - 1) % state->async.num_buffers];
 }
 
-bool state_manager_push(state_manager_t *state, const void *data)
+bool state_manager_init_async(state_manager_t *state, unsigned num_buffers)
 {
-   generate_delta(state, data);
-   memcpy(state->tmp_state, data, state->state_size * sizeof(uint32_t));
-   state->first_pop = true;
+   if (num_buffers < 2)
+      num_buffers = 2;
+
+   state->async.num_buffers = num_buffers;
+   state->async.buffers = (uint32_t**)calloc(num_buffers, sizeof(uint32_t*));
+   state->async.free_list = (uint32_t**)calloc(num_buffers, sizeof(uint32_t*));
+   state->async.queue = (uint32_t**)calloc(num_buffers, sizeof(uint32_t*));
+   if (!state->async.buffers || !state->async.free_list || !state->async.queue)
+      goto error;
+
+   for (unsigned i = 0; i < num_buffers; i++)
+   {
+      if (!(state->async.buffers[i] = (uint32_t*)calloc(state->state_size, sizeof(uint32_t))))
+         goto error;
+      state->async.free_list[state->async.num_free++] = state->async.buffers[i];
+   }
+
+   state->async.lock = slock_new();
+   state->async.work_cond = scond_new();
+   state->async.done_cond = scond_new();
+   if (!state->async.lock || !state->async.work_cond || !state->async.done_cond)
+      goto error;
+
+   if (!(state->async.thread = sthread_create(async_thread, state)))
+      goto error;
+
+   state->async.enable = true;
+   SSNES_LOG("Rewind: committing states on worker thread with %u buffers.\n", num_buffers);
+   return true;
+
+error:
+   SSNES_WARN("Failed to start rewind worker thread. Falling back to synchronous rewind.\n");
+   deinit_async(state);
+   return false;
+}
+
+static void deinit_async(state_manager_t *state)
+{
+   if (state->async.thread)
+   {
+      slock_lock(state->async.lock);
+      state->async.quit = true;
+      scond_signal(state->async.work_cond);
+      slock_unlock(state->async.lock);
+      sthread_join(state->async.thread);
+   }
+
+   if (state->async.lock)
+      slock_free(state->async.lock);
+   if (state->async.work_cond)
+      scond_free(state->async.work_cond);
+   if (state->async.done_cond)
+      scond_free(state->async.done_cond);
+
+   if (state->async.buffers)
+   {
+      for (unsigned i = 0; i < state->async.num_buffers; i++)
+         free(state->async.buffers[i]);
+   }
+   free(state->async.buffers);
+   free(state->async.free_list);
+   free(state->async.queue);
+
+   memset(&state->async, 0, sizeof(state->async));
+}
+
+// Pops while pushes are still queued. States that have not yet been committed are simply dropped,
+// so only a push the worker is in the middle of is waited for.
+static bool async_pop(state_manager_t *state, void **data)
+{
+   slock_lock(state->async.lock);
+   while (state->async.busy)
+      scond_wait(state->async.done_cond, state->async.lock);
+
+   uint32_t *newest = async_newest(state);
+   if (!newest)
+   {
+      slock_unlock(state->async.lock);
+      return false;
+   }
 
+   if (state->first_pop)
+   {
+      state->first_pop = false;
+      *data = newest;
+   }
+   else
+   {
+      state->async.queue_count--;
+      state->async.free_list[state->async.num_free++] = newest;
+
+      newest = async_newest(state);
+      *data = newest ? newest : state->tmp_state;
+   }
+
+   slock_unlock(state->async.lock);
    return true;
 }
+#endif
+
+void *state_manager_get_buffer(state_manager_t *state)
+{
+#ifdef HAVE_THREADS
+   if (state->async.enable)
+   {
+      slock_lock(state->async.lock);
+      // Only blocks when the worker has fallen a whole pool behind.
+      while (!state->async.num_free)
+         scond_wait(state->async.done_cond, state->async.lock);
+      uint32_t *buffer = state->async.free_list[--state->async.num_free];
+      slock_unlock(state->async.lock);
+      return buffer;
+   }
+#endif
+
+   return state->next_state;
+}
+
+void state_manager_push_buffer(state_manager_t *state, void *buffer)
+{
+#ifdef HAVE_THREADS
+   if (state->async.enable)
+   {
+      slock_lock(state->async.lock);
+      state->async.queue[(state->async.queue_head + state->async.queue_count) % state->async.num_buffers] = (uint32_t*)buffer;
+      state->async.queue_count++;
+      state->first_pop = true;
+      scond_signal(state->async.work_cond);
+      slock_unlock(state->async.lock);
+      return;
+   }
+#endif
+
+   if (commit_state(state, buffer))
+      state->next_state = swap_state(state, (uint32_t*)buffer);
+   state->first_pop = true;
+}
+
+// Caller must own the ring, i.e. the worker must not be busy.
+static void fill_stats(state_manager_t *state, struct state_manager_stats *stats)
+{
+   *stats = state->stats;
+   stats->frames = state->frames;
+   stats->keyframes = state->keyframes_count;
+   stats->state_size = state->state_size * sizeof(uint32_t);
+   stats->buffer_size = state->buf_size;
+   stats->buffer_used = state->top_ptr - state->bottom_ptr;
+#ifdef HAVE_MMAP
+   stats->spill_frames = state->spill.frames;
+   stats->spill_bytes = state->spill.end - state->spill.start;
+#endif
+}
+
+void state_manager_get_stats(state_manager_t *state, struct state_manager_stats *stats)
+{
+#ifdef HAVE_THREADS
+   if (state->async.enable)
+   {
+      slock_lock(state->async.lock);
+      if (state->async.busy)
+         *stats = state->async.stats;
+      else
+         fill_stats(state, stats);
+      slock_unlock(state->async.lock);
+      return;
+   }
+#endif
+
+   fill_stats(state, stats);
+}
+
+void state_manager_flush(state_manager_t *state)
+{
+#ifdef HAVE_THREADS
+   if (state->async.enable)
+   {
+      slock_lock(state->async.lock);
+      while (state->async.busy || state->async.queue_count)
+         scond_wait(state->async.done_cond, state->async.lock);
+      slock_unlock(state->async.lock);
+   }
+#else
+   (void)state;
+#endif
+}
 
@@ -19,8 +19,13 @@
 #define __SSNES_REWIND_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include "boolean.h"
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 typedef struct state_manager state_manager_t;
 
 // Always pass in at least 4-byte aligned data and sizes!
@@ -30,4 +35,78 @@ void state_manager_free(state_manager_t *state);
 bool state_manager_pop(state_manager_t *state, void **data);
 bool state_manager_push(state_manager_t *state, const void *data);
 
+// Rewinds frames states back from the current one, starting from the nearest keyframe
+// so only the deltas between it and the target state are applied. Stops early at the end of the buffer.
+// Unlike the first state_manager_pop(), returning the current state isn't counted as a frame rewound.
+// Returns the number of frames actually rewound.
+unsigned state_manager_pop_frames(state_manager_t *state, unsigned frames, void **data);
+
+// Stores a full state every interval pushes, which bounds the cost of state_manager_pop_frames(). 0 disables keyframes.
+// Set this before pushing any states.
+void state_manager_set_keyframe_interval(state_manager_t *state, unsigned interval);
+
+// Alternative to state_manager_push() which lets the state manager own the buffer.
+// Serialize into the buffer from state_manager_get_buffer() and hand it back with state_manager_push_buffer().
+// The pushed buffer becomes the current state by swapping pointers, so no state sized copy is made.
+// Popped data stays valid until the next state_manager_get_buffer().
+void *state_manager_get_buffer(state_manager_t *state);
+void state_manager_push_buffer(state_manager_t *state, void *buffer);
+
+struct state_manager_stats
+{
+   size_t frames; // States currently held in the buffer, i.e. how far back we can rewind.
+   size_t keyframes;
+
+   size_t state_size;
+   size_t buffer_size;
+   size_t buffer_used;
+
+   size_t spill_frames; // States in the spill file, which can be rewound to after the in-memory ones.
+   uint64_t spill_bytes;
+   uint64_t spill_evictions; // Spilled states dropped to keep the spill file within its size limit.
+
+   uint64_t pushes;
+   uint64_t pushed_bytes; // Including record framing. Average delta size is pushed_bytes / pushes.
+   size_t peak_record_size;
+   uint64_t evictions; // States dropped from the bottom of the buffer to make room.
+   uint64_t push_usec_total;
+   int64_t push_usec_peak;
+
+   uint64_t pops;
+   uint64_t pop_usec_total;
+   int64_t pop_usec_peak;
+};
+
+// In asynchronous mode, stats may lag behind by the states still queued. Call state_manager_flush() first for exact numbers.
+void state_manager_get_stats(state_manager_t *state, struct state_manager_stats *stats);
+
+// Waits until all pushed states are committed. Only blocks in asynchronous mode.
+void state_manager_flush(state_manager_t *state);
+
+#ifdef HAVE_MMAP
+// Appends history that no longer fits in the buffer to a memory mapped file at path instead of discarding it.
+// The file grows up to max_size bytes, after which the oldest history in it is dropped.
+// History in the file is kept across sessions. Call this before pushing any states.
+bool state_manager_init_spill(state_manager_t *state, const char *path, size_t max_size);
+#endif
+
+#ifdef HAVE_THREADS
+// Computes deltas and commits them to the ring on a worker thread, using a pool of num_buffers state buffers.
+// Only state_manager_get_buffer()/state_manager_push_buffer() may be used to push afterwards.
+bool state_manager_init_async(state_manager_t *state, unsigned num_buffers);
+#endif
+
+// Deltas between two states of the same size, as used by the rewind buffer, netplay and movie checkpoints.
+// A delta is a list of runs of changed words: [varint unchanged words][varint changed words][changed words xor old words].
+// Applying it to either state gives the other one.
+
+// A single run over the whole state costs the state plus two varints. Every other word changing only costs 3 bytes per word.
+#define STATE_DELTA_MAX_SIZE(words) ((words) * sizeof(uint32_t) + 24)
+
+// Writes at most STATE_DELTA_MAX_SIZE(words) bytes to out. Returns the size of the delta.
+size_t state_delta_encode(uint8_t *out, const uint32_t *old_state, const uint32_t *new_state, size_t words);
+void state_delta_apply(uint32_t *state, const uint8_t *delta, size_t size);
+// Like state_delta_apply(), but doesn't trust the delta. Returns false if it's broken or doesn't fit in words.
+bool state_delta_apply_checked(uint32_t *state, size_t words, const uint8_t *delta, size_t size);
+
 #endif
@@ -203,6 +203,16 @@ void config_set_defaults(void)
    g_settings.rewind_enable = rewind_enable;
    g_settings.rewind_buffer_size = rewind_buffer_size;
    g_settings.rewind_granularity = rewind_granularity;
+   g_settings.rewind_keyframe_interval = rewind_keyframe_interval;
+   g_settings.rewind_jump_seconds = rewind_jump_seconds;
+   g_settings.rewind_async = rewind_async;
+   g_settings.rewind_adaptive = rewind_adaptive;
+   g_settings.rewind_granularity_max = rewind_granularity_max;
+   g_settings.rewind_adaptive_budget = rewind_adaptive_budget;
+   g_settings.rewind_adaptive_seconds = rewind_adaptive_seconds;
+   g_settings.rewind_spill_size = rewind_spill_size;
+   g_settings.movie_checkpoint_interval = movie_checkpoint_interval;
+   g_settings.movie_pack_input = movie_pack_input;
    g_settings.slowmotion_ratio = slowmotion_ratio;
    g_settings.pause_nonactive = pause_nonactive;
    g_settings.autosave_interval = autosave_interval;
@@ -224,6 +234,12 @@ void config_set_defaults(void)
 
    g_settings.input.axis_threshold = axis_threshold;
    g_settings.input.netplay_client_swap_input = netplay_client_swap_input;
+   strlcpy(g_settings.netplay_prediction, netplay_prediction, sizeof(g_settings.netplay_prediction));
+   g_settings.netplay_telemetry_interval = netplay_telemetry_interval;
+   g_settings.netplay_input_delay = netplay_input_delay;
+   g_settings.netplay_input_delay_auto = netplay_input_delay_auto;
+   g_settings.netplay_time_sync = netplay_time_sync;
+   g_settings.netplay_check_frames = netplay_check_frames;
    for (int i = 0; i < MAX_PLAYERS; i++)
       g_settings.input.joypad_map[i] = i;
 }
@@ -421,6 +437,13 @@ bool config_load_file(const char *path)
 
    CONFIG_GET_FLOAT(input.axis_threshold, "input_axis_threshold");
    CONFIG_GET_BOOL(input.netplay_client_swap_input, "netplay_client_swap_input");
+   CONFIG_GET_STRING(netplay_prediction, "netplay_prediction");
+   CONFIG_GET_INT(netplay_telemetry_interval, "netplay_telemetry_interval");
+   CONFIG_GET_INT(netplay_input_delay, "netplay_input_delay");
+   CONFIG_GET_BOOL(netplay_input_delay_auto, "netplay_input_delay_auto");
+   CONFIG_GET_BOOL(netplay_time_sync, "netplay_time_sync");
+   CONFIG_GET_INT(netplay_check_frames, "netplay_check_frames");
+   CONFIG_GET_STRING(netplay_telemetry_path, "netplay_telemetry_path");
 
    for (unsigned i = 0; i < MAX_PLAYERS; i++)
    {
@@ -461,6 +484,28 @@ bool config_load_file(const char *path)
       g_settings.rewind_buffer_size = buffer_size * UINT64_C(1000000);
 
    CONFIG_GET_INT(rewind_granularity, "rewind_granularity");
+   CONFIG_GET_INT(rewind_keyframe_interval, "rewind_keyframe_interval");
+   CONFIG_GET_INT(rewind_jump_seconds, "rewind_jump_seconds");
+   CONFIG_GET_BOOL(rewind_async, "rewind_async");
+   CONFIG_GET_BOOL(rewind_adaptive, "rewind_adaptive");
+   CONFIG_GET_INT(rewind_granularity_max, "rewind_granularity_max");
+   CONFIG_GET_FLOAT(rewind_adaptive_budget, "rewind_adaptive_budget");
+   CONFIG_GET_INT(rewind_adaptive_seconds, "rewind_adaptive_seconds");
+
+   CONFIG_GET_STRING(rewind_spill_directory, "rewind_spill_directory");
+   if (*g_settings.rewind_spill_directory && !path_is_directory(g_settings.rewind_spill_directory))
+   {
+      SSNES_WARN("rewind_spill_directory is not an existing directory, ignoring ...\n");
+      *g_settings.rewind_spill_directory = '\0';
+   }
+
+   int spill_size = 0;
+   if (config_get_int(conf, "rewind_spill_size", &spill_size))
+      g_settings.rewind_spill_size = spill_size * UINT64_C(1000000);
+
+   CONFIG_GET_INT(movie_checkpoint_interval, "movie_checkpoint_interval");
+   CONFIG_GET_BOOL(movie_pack_input, "movie_pack_input");
+
    CONFIG_GET_FLOAT(slowmotion_ratio, "slowmotion_ratio");
    if (g_settings.slowmotion_ratio < 1.0f)
       g_settings.slowmotion_ratio = 1.0f;
@@ -580,6 +625,7 @@ static const struct bind_map bind_maps[MAX_PLAYERS][SSNES_BIND_LIST_END] = {
       DECLARE_BIND(audio_mute,            SSNES_MUTE),
       DECLARE_BIND(netplay_flip_players,  SSNES_NETPLAY_FLIP),
       DECLARE_BIND(slowmotion,            SSNES_SLOWMOTION),
+      DECLARE_BIND(rewind_jump,           SSNES_REWIND_JUMP),
    },
 
    DECL_PLAYER(2),
@@ -29,7 +29,9 @@
 #include "audio/utils.h"
 #include "record/ffemu.h"
 #include "rewind.h"
+#include "timer.h"
 #include "movie.h"
+#include "hash.h"
 #include "compat/strl.h"
 #include "screenshot.h"
 #include "cheats.h"
@@ -544,6 +546,11 @@ static void print_help(void)
 #ifdef HAVE_BSV_MOVIE
    puts("\t-P/--bsvplay: Playback a BSV movie file.");
    puts("\t-R/--bsvrecord: Start recording a BSV movie file from the beginning.");
+   puts("\t--bsvseek: Start playback of the movie given by --bsvplay at this frame.");
+   puts("\t\tMovies recorded with movie_checkpoint_interval set get there quickly.");
+   puts("\t--headless: Play back the movie given by --bsvplay as fast as possible, without video, audio or input, then quit.");
+   puts("\t--bsvhash: With --headless, write CRC32 hashes of the video and audio output to this file.");
+   puts("\t--bsvhash-interval: Write a hash line every this many frames. Defaults to every frame.");
    puts("\t-M/--sram-mode: Takes an argument telling how SRAM should be handled in the session.");
 #endif
    puts("\t\t{no,}load-{no,}save describes if SRAM should be loaded, and if SRAM should be saved.");
@@ -706,6 +713,10 @@ static void parse_input(int argc, char *argv[])
 #ifdef HAVE_BSV_MOVIE
       { "bsvplay", 1, NULL, 'P' },
       { "bsvrecord", 1, NULL, 'R' },
+      { "bsvseek", 1, &val, 'e' },
+      { "headless", 0, &val, 'd' },
+      { "bsvhash", 1, &val, 'a' },
+      { "bsvhash-interval", 1, &val, 'i' },
       { "sram-mode", 1, NULL, 'M' },
 #endif
 #ifdef HAVE_NETPLAY
@@ -912,8 +923,8 @@ static void parse_input(int argc, char *argv[])
 
          case 'F':
             g_extern.netplay_sync_frames = strtol(optarg, NULL, 0);
-            if (g_extern.netplay_sync_frames > 16)
-               g_extern.netplay_sync_frames = 16;
+            if (g_extern.netplay_sync_frames > NETPLAY_MAX_FRAMES)
+               g_extern.netplay_sync_frames = NETPLAY_MAX_FRAMES;
             break;
 #endif
 
@@ -949,6 +960,24 @@ static void parse_input(int argc, char *argv[])
                   break;
 #endif
 
+#ifdef HAVE_BSV_MOVIE
+               case 'e':
+                  g_extern.bsv.movie_seek_frame = strtoul(optarg, NULL, 0);
+                  break;
+
+               case 'd':
+                  g_extern.bsv.movie_headless = true;
+                  break;
+
+               case 'a':
+                  strlcpy(g_extern.bsv.movie_hash_path, optarg, sizeof(g_extern.bsv.movie_hash_path));
+                  break;
+
+               case 'i':
+                  g_extern.bsv.movie_hash_interval = strtoul(optarg, NULL, 0);
+                  break;
+#endif
+
                case 'B':
                   strlcpy(g_extern.bps_name, optarg, sizeof(g_extern.bps_name));
                   g_extern.bps_pref = true;
@@ -1217,6 +1246,13 @@ static void deinit_cheats(void)
 }
 #endif
 
+static double get_core_fps(void)
+{
+   if (g_extern.system.timing_set)
+      return g_extern.system.timing.fps;
+   return psnes_get_region() == SNES_REGION_NTSC ? 60.0 : 50.0;
+}
+
 static void init_rewind(void)
 {
    if (!g_settings.rewind_enable)
@@ -1225,41 +1261,268 @@ static void init_rewind(void)
    g_extern.state_size = psnes_serialize_size();
 
    // Make sure we allocate at least 4-byte multiple.
+   // The state manager keeps its own copies, so the initial state is only needed until it is created.
    size_t aligned_state_size = (g_extern.state_size + 3) & ~3;
-   g_extern.state_buf = calloc(1, aligned_state_size);
+   void *init_buf = calloc(1, aligned_state_size);
 
-   if (!g_extern.state_buf)
+   if (!init_buf)
    {
       SSNES_ERR("Failed to allocate memory for rewind buffer.\n");
       return;
    }
 
-   if (!psnes_serialize((uint8_t*)g_extern.state_buf, g_extern.state_size))
+   if (!psnes_serialize((uint8_t*)init_buf, g_extern.state_size))
    {
       SSNES_ERR("Failed to perform initial serialization for rewind.\n");
-      free(g_extern.state_buf);
-      g_extern.state_buf = NULL;
+      free(init_buf);
       return;
    }
 
+   g_extern.rewind_granularity = g_settings.rewind_granularity ? g_settings.rewind_granularity : 1;
+
    SSNES_LOG("Initing rewind buffer with size: %u MB\n", (unsigned)(g_settings.rewind_buffer_size / 1000000));
-   g_extern.state_manager = state_manager_new(aligned_state_size, g_settings.rewind_buffer_size, g_extern.state_buf);
+   g_extern.state_manager = state_manager_new(aligned_state_size, g_settings.rewind_buffer_size, init_buf);
+   free(init_buf);
 
    if (!g_extern.state_manager)
       SSNES_WARN("Failed to init rewind buffer. Rewinding will be disabled.\n");
+   else
+   {
+      state_manager_set_keyframe_interval(g_extern.state_manager, g_settings.rewind_keyframe_interval);
+
+#ifdef HAVE_MMAP
+      if (*g_settings.rewind_spill_directory)
+      {
+         char spill_path[PATH_MAX];
+         strlcpy(spill_path, g_settings.rewind_spill_directory, sizeof(spill_path));
+         fill_pathname_dir(spill_path, g_extern.basename, ".rwd", sizeof(spill_path));
+         state_manager_init_spill(g_extern.state_manager, spill_path, g_settings.rewind_spill_size);
+      }
+#endif
+
+#ifdef HAVE_THREADS
+      if (g_settings.rewind_async)
+         state_manager_init_async(g_extern.state_manager, 4);
+#endif
+   }
+}
+
+static void log_rewind_stats(void)
+{
+   struct state_manager_stats stats;
+   state_manager_get_stats(g_extern.state_manager, &stats);
+   if (!stats.pushes)
+      return;
+
+   double fps = get_core_fps();
+
+   unsigned granularity = g_extern.rewind_granularity;
+   SSNES_LOG("Rewind: %u states (%.1f seconds) in buffer, %u keyframes, %u of %u KiB used.\n",
+         (unsigned)stats.frames, stats.frames * granularity / fps, (unsigned)stats.keyframes,
+         (unsigned)(stats.buffer_used >> 10), (unsigned)(stats.buffer_size >> 10));
+   if (stats.spill_frames)
+   {
+      SSNES_LOG("Rewind: %u states (%.1f seconds, %u MiB) in spill file, %u dropped to stay within its size limit.\n",
+            (unsigned)stats.spill_frames, stats.spill_frames * granularity / fps, (unsigned)(stats.spill_bytes >> 20),
+            (unsigned)stats.spill_evictions);
+   }
+   SSNES_LOG("Rewind: %u bytes per state on average (%.1f %% of state size), peak %u bytes, %u states evicted.\n",
+         (unsigned)(stats.pushed_bytes / stats.pushes), 100.0 * stats.pushed_bytes / (stats.pushes * stats.state_size),
+         (unsigned)stats.peak_record_size, (unsigned)stats.evictions);
+   SSNES_LOG("Rewind: push %.1f usec average, %u usec peak.\n",
+         (double)stats.push_usec_total / stats.pushes, (unsigned)stats.push_usec_peak);
+   if (stats.pops)
+   {
+      SSNES_LOG("Rewind: pop %.1f usec average, %u usec peak.\n",
+            (double)stats.pop_usec_total / stats.pops, (unsigned)stats.pop_usec_peak);
+   }
 }
 
 static void deinit_rewind(void)
 {
    if (g_extern.state_manager)
+   {
+      log_rewind_stats();
       state_manager_free(g_extern.state_manager);
-   if (g_extern.state_buf)
-      free(g_extern.state_buf);
+      g_extern.state_manager = NULL;
+   }
 }
 
 #ifdef HAVE_BSV_MOVIE
+static void video_frame_seek(const uint16_t *data, unsigned width, unsigned height)
+{}
+
+static void audio_sample_seek(uint16_t left, uint16_t right)
+{}
+
+static void input_poll_seek(void)
+{}
+
+static int16_t input_state_seek(bool port, unsigned device, unsigned index, unsigned id)
+{
+   int16_t ret = 0;
+   if (!bsv_movie_get_input(g_extern.bsv.movie, &ret))
+      g_extern.bsv.movie_end = true;
+   return ret;
+}
+
+// Jumps to the closest checkpoint, and runs the rest of the way without output.
+// The real callbacks are set up afterwards by init_libsnes_cbs().
+// Returns the frame playback continues from, which is short of frame if the movie ends first.
+static unsigned seek_movie(unsigned frame)
+{
+   unsigned start_frame;
+   if (!bsv_movie_seek(g_extern.bsv.movie, frame, &start_frame))
+   {
+      SSNES_ERR("Failed to seek movie to frame %u.\n", frame);
+      // Headless output would be labeled with frames it doesn't belong to.
+      if (g_extern.bsv.movie_headless)
+         ssnes_fail(1, "seek_movie()");
+      return 0;
+   }
+
+   psnes_set_video_refresh(video_frame_seek);
+   psnes_set_audio_sample(audio_sample_seek);
+   psnes_set_input_poll(input_poll_seek);
+   psnes_set_input_state(input_state_seek);
+
+   unsigned frames = 0;
+   for (unsigned i = start_frame; i < frame && !g_extern.bsv.movie_end; i++, frames++)
+   {
+      bsv_movie_set_frame_start(g_extern.bsv.movie);
+      psnes_run();
+      bsv_movie_set_frame_end(g_extern.bsv.movie);
+   }
+
+   SSNES_LOG("Seeked movie to frame %u from checkpoint at frame %u, ran %u frames.\n",
+         start_frame + frames, start_frame, frames);
+   if (g_extern.bsv.movie_end)
+      SSNES_WARN("Movie ended at frame %u, before reaching frame %u.\n", start_frame + frames, frame);
+
+   return start_frame + frames;
+}
+
+// Headless playback hashes what the core outputs instead of presenting it.
+static void video_frame_replay(const uint16_t *data, unsigned width, unsigned height)
+{
+   if (!g_extern.bsv.replay.hash_file || !data)
+      return;
+
+   unsigned pitch = lines_to_pitch(height) >> 1;
+   for (unsigned y = 0; y < height; y++, data += pitch)
+   {
+      g_extern.bsv.replay.frame_video = crc32_update(g_extern.bsv.replay.frame_video,
+            (const uint8_t*)data, width * sizeof(uint16_t));
+   }
+}
+
+static void replay_flush_audio(void)
+{
+   g_extern.bsv.replay.frame_audio = crc32_update(g_extern.bsv.replay.frame_audio,
+         (const uint8_t*)g_extern.bsv.replay.audio_buf, g_extern.bsv.replay.audio_ptr * sizeof(uint16_t));
+   g_extern.bsv.replay.audio_ptr = 0;
+}
+
+static void audio_sample_replay(uint16_t left, uint16_t right)
+{
+   if (!g_extern.bsv.replay.hash_file)
+      return;
+
+   g_extern.bsv.replay.audio_buf[g_extern.bsv.replay.audio_ptr++] = left;
+   g_extern.bsv.replay.audio_buf[g_extern.bsv.replay.audio_ptr++] = right;
+   if (g_extern.bsv.replay.audio_ptr >= sizeof(g_extern.bsv.replay.audio_buf) / sizeof(g_extern.bsv.replay.audio_buf[0]))
+      replay_flush_audio();
+}
+
+static void replay_write_hash(void)
+{
+   fprintf(g_extern.bsv.replay.hash_file, "%u %08x %08x\n", g_extern.bsv.replay.frame,
+         (unsigned)g_extern.bsv.replay.video, (unsigned)g_extern.bsv.replay.audio);
+   g_extern.bsv.replay.video = 0;
+   g_extern.bsv.replay.audio = 0;
+}
+
+// Frame hashes are only added once we know the frame had input, as the movie ends with a frame that didn't.
+static void replay_add_frame(void)
+{
+   replay_flush_audio();
+
+   uint32_t hashes[2] = { g_extern.bsv.replay.frame_video, g_extern.bsv.replay.frame_audio };
+   g_extern.bsv.replay.video = crc32_update(g_extern.bsv.replay.video, (const uint8_t*)&hashes[0], sizeof(hashes[0]));
+   g_extern.bsv.replay.audio = crc32_update(g_extern.bsv.replay.audio, (const uint8_t*)&hashes[1], sizeof(hashes[1]));
+   g_extern.bsv.replay.total_video = crc32_update(g_extern.bsv.replay.total_video, (const uint8_t*)&hashes[0], sizeof(hashes[0]));
+   g_extern.bsv.replay.total_audio = crc32_update(g_extern.bsv.replay.total_audio, (const uint8_t*)&hashes[1], sizeof(hashes[1]));
+   g_extern.bsv.replay.frame_video = 0;
+   g_extern.bsv.replay.frame_audio = 0;
+
+   // Lines fall on the same frames however far we seeked.
+   if (g_extern.bsv.replay.frame % g_extern.bsv.movie_hash_interval == 0)
+      replay_write_hash();
+}
+
+static bool replay_iterate(void)
+{
+   bsv_movie_set_frame_start(g_extern.bsv.movie);
+   psnes_run();
+   bsv_movie_set_frame_end(g_extern.bsv.movie);
+
+   if (g_extern.bsv.movie_end)
+      return false;
+
+   g_extern.bsv.replay.frame++;
+   g_extern.bsv.replay.frames++;
+   if (g_extern.bsv.replay.hash_file)
+      replay_add_frame();
+   return true;
+}
+
+static void init_replay(unsigned frame)
+{
+   if (!g_extern.bsv.movie_hash_interval)
+      g_extern.bsv.movie_hash_interval = 1;
+
+   if (*g_extern.bsv.movie_hash_path)
+   {
+      g_extern.bsv.replay.hash_file = fopen(g_extern.bsv.movie_hash_path, "w");
+      if (!g_extern.bsv.replay.hash_file)
+      {
+         SSNES_ERR("Failed to open movie hash file: \"%s\".\n", g_extern.bsv.movie_hash_path);
+         ssnes_fail(1, "init_replay()");
+      }
+   }
+
+   g_extern.bsv.replay.frame = frame;
+   g_extern.bsv.replay.start_time = ssnes_get_time_usec();
+   SSNES_LOG("Playing back movie headless.\n");
+}
+
+static void deinit_replay(void)
+{
+   double sec = (ssnes_get_time_usec() - g_extern.bsv.replay.start_time) / 1000000.0;
+   SSNES_LOG("Played back %u frames in %.2f seconds, %.1f frames per second.\n",
+         g_extern.bsv.replay.frames, sec, sec > 0.0 ? g_extern.bsv.replay.frames / sec : 0.0);
+
+   if (g_extern.bsv.replay.hash_file)
+   {
+      // The last line covers whatever came after the last full interval.
+      if (g_extern.bsv.replay.frame % g_extern.bsv.movie_hash_interval)
+         replay_write_hash();
+
+      fclose(g_extern.bsv.replay.hash_file);
+      g_extern.bsv.replay.hash_file = NULL;
+      SSNES_LOG("Movie output hashes: video %08x, audio %08x.\n",
+            (unsigned)g_extern.bsv.replay.total_video, (unsigned)g_extern.bsv.replay.total_audio);
+   }
+}
+
 static void init_movie(void)
 {
+   if (g_extern.bsv.movie_headless && !g_extern.bsv.movie_start_playback)
+   {
+      SSNES_ERR("--headless needs a movie to play back with --bsvplay.\n");
+      ssnes_fail(1, "init_movie()");
+   }
+
    if (g_extern.bsv.movie_start_playback)
    {
       g_extern.bsv.movie = bsv_movie_init(g_extern.bsv.movie_start_path, SSNES_MOVIE_PLAYBACK);
@@ -1273,6 +1536,15 @@ static void init_movie(void)
       msg_queue_push(g_extern.msg_queue, "Starting movie playback.", 2, 180);
       SSNES_LOG("Starting movie playback.\n");
       g_settings.rewind_granularity = 1;
+
+      unsigned frame = 0;
+      if (g_extern.bsv.movie_seek_frame)
+         frame = seek_movie(g_extern.bsv.movie_seek_frame);
+
+      if (g_extern.bsv.movie_headless)
+         init_replay(frame);
+      else if (*g_extern.bsv.movie_hash_path)
+         SSNES_WARN("--bsvhash only works with --headless, ignoring it.\n");
    }
    else if (g_extern.bsv.movie_start_recording)
    {
@@ -1297,6 +1569,9 @@ static void init_movie(void)
 
 static void deinit_movie(void)
 {
+   if (g_extern.bsv.movie_headless)
+      deinit_replay();
+
    if (g_extern.bsv.movie)
       bsv_movie_free(g_extern.bsv.movie);
 }
@@ -1351,13 +1626,24 @@ static void deinit_netplay(void)
 
 static void init_libsnes_cbs(void)
 {
+#ifdef HAVE_BSV_MOVIE
+   if (g_extern.bsv.movie_headless)
+   {
+      psnes_set_video_refresh(video_frame_replay);
+      psnes_set_audio_sample(audio_sample_replay);
+      psnes_set_input_state(input_state_seek);
+      psnes_set_input_poll(input_poll_seek);
+      return;
+   }
+#endif
+
 #ifdef HAVE_NETPLAY
    if (g_extern.netplay)
    {
-      psnes_set_video_refresh(g_extern.netplay_is_spectate ?
-            video_frame : video_frame_net);
-      psnes_set_audio_sample(g_extern.netplay_is_spectate ?
-            audio_sample : audio_sample_net);
+      // Spectating clients skip frames while catching up with the host.
+      bool spectate_host = g_extern.netplay_is_spectate && !g_extern.netplay_is_client;
+      psnes_set_video_refresh(spectate_host ? video_frame : video_frame_net);
+      psnes_set_audio_sample(spectate_host ? audio_sample : audio_sample_net);
 
       psnes_set_input_state(g_extern.netplay_is_spectate ?
             (g_extern.netplay_is_client ? input_state_spectate_client : input_state_spectate)
@@ -1792,6 +2078,76 @@ static inline void setup_rewind_audio(void)
    g_extern.audio_data.data_ptr = 0;
 }
 
+static unsigned ceil_ratio(double num, double den)
+{
+   double ratio = num / den;
+   unsigned ret = (unsigned)ratio;
+   return ret < ratio ? ret + 1 : ret;
+}
+
+// Picks the smallest granularity where pushing stays within its share of the frame time,
+// and where rewind_adaptive_seconds of history fits in the buffer at the current delta size.
+// Re-evaluated about once per second. Granularity is raised at once, but only lowered a step at a time,
+// as deltas shrink when pushing more often, which would otherwise make it oscillate.
+static void adapt_rewind_granularity(int64_t push_usec)
+{
+   static int64_t usec_total;
+   static unsigned pushes;
+   static unsigned frames;
+   static uint64_t last_pushes;
+   static uint64_t last_pushed_bytes;
+
+   usec_total += push_usec;
+   pushes++;
+   frames += g_extern.rewind_granularity;
+
+   double fps = get_core_fps();
+   if (frames < fps)
+      return;
+
+   unsigned min_granularity = g_settings.rewind_granularity ? g_settings.rewind_granularity : 1;
+   unsigned max_granularity = g_settings.rewind_granularity_max > min_granularity ?
+      g_settings.rewind_granularity_max : min_granularity;
+
+   double avg_usec = (double)usec_total / pushes;
+   double budget_usec = g_settings.rewind_adaptive_budget * 1000000.0 / fps;
+   unsigned cpu_granularity = budget_usec > 0.0 ? ceil_ratio(avg_usec, budget_usec) : max_granularity;
+
+   // In async mode, stats lag behind by the states still queued, which is fine for an average.
+   struct state_manager_stats stats;
+   state_manager_get_stats(g_extern.state_manager, &stats);
+
+   unsigned mem_granularity = min_granularity;
+   double avg_bytes = 0.0;
+   if (stats.pushes > last_pushes)
+   {
+      avg_bytes = (double)(stats.pushed_bytes - last_pushed_bytes) / (stats.pushes - last_pushes);
+      if (g_settings.rewind_adaptive_seconds)
+         mem_granularity = ceil_ratio(g_settings.rewind_adaptive_seconds * fps * avg_bytes, stats.buffer_size);
+   }
+   last_pushes = stats.pushes;
+   last_pushed_bytes = stats.pushed_bytes;
+
+   unsigned granularity = cpu_granularity > mem_granularity ? cpu_granularity : mem_granularity;
+   if (granularity < g_extern.rewind_granularity)
+      granularity = g_extern.rewind_granularity - 1;
+   if (granularity < min_granularity)
+      granularity = min_granularity;
+   if (granularity > max_granularity)
+      granularity = max_granularity;
+
+   if (granularity != g_extern.rewind_granularity)
+   {
+      SSNES_LOG("Rewind: granularity %u -> %u (push %.1f usec, budget %.1f usec, %.0f bytes per state).\n",
+            g_extern.rewind_granularity, granularity, avg_usec, budget_usec, avg_bytes);
+      g_extern.rewind_granularity = granularity;
+   }
+
+   usec_total = 0;
+   pushes = 0;
+   frames = 0;
+}
+
 static void check_rewind(void)
 {
    flush_rewind_audio();
@@ -1807,7 +2163,47 @@ static void check_rewind(void)
    if (!g_extern.state_manager)
       return;
 
-   if (input_key_pressed_func(SSNES_REWIND))
+#ifdef HAVE_BSV_MOVIE
+   if (!g_settings.rewind_adaptive || g_extern.bsv.movie)
+#else
+   if (!g_settings.rewind_adaptive)
+#endif
+      g_extern.rewind_granularity = g_settings.rewind_granularity ? g_settings.rewind_granularity : 1; // Avoid possible SIGFPE.
+
+   static bool old_jump = false;
+   bool new_jump = input_key_pressed_func(SSNES_REWIND_JUMP);
+   bool jump = new_jump && !old_jump;
+   old_jump = new_jump;
+
+#ifdef HAVE_BSV_MOVIE
+   // Movie rewind can only step back a single frame at a time.
+   if (g_extern.bsv.movie)
+      jump = false;
+#endif
+
+   if (jump)
+   {
+      double fps = get_core_fps();
+
+      // If the granularity has been adapted, older history was pushed at a different rate, so this is approximate.
+      unsigned granularity = g_extern.rewind_granularity;
+      unsigned frames = (unsigned)(g_settings.rewind_jump_seconds * fps) / granularity;
+
+      msg_queue_clear(g_extern.msg_queue);
+      void *buf;
+      unsigned rewound = state_manager_pop_frames(g_extern.state_manager, frames ? frames : 1, &buf);
+      if (rewound)
+      {
+         psnes_unserialize((uint8_t*)buf, g_extern.state_size);
+
+         char msg[64];
+         snprintf(msg, sizeof(msg), "Rewound %.1f seconds.", rewound * granularity / fps);
+         msg_queue_push(g_extern.msg_queue, msg, 1, 60);
+      }
+      else
+         msg_queue_push(g_extern.msg_queue, "Reached end of rewind buffer.", 0, 30);
+   }
+   else if (input_key_pressed_func(SSNES_REWIND))
    {
       msg_queue_clear(g_extern.msg_queue);
       void *buf;
@@ -1830,15 +2226,24 @@ static void check_rewind(void)
    else
    {
       static unsigned cnt = 0;
-      cnt = (cnt + 1) % (g_settings.rewind_granularity ? g_settings.rewind_granularity : 1); // Avoid possible SIGFPE.
+      cnt = (cnt + 1) % g_extern.rewind_granularity;
 #ifdef HAVE_BSV_MOVIE
       if (cnt == 0 || g_extern.bsv.movie)
 #else
       if (cnt == 0)
 #endif
       {
-         psnes_serialize((uint8_t*)g_extern.state_buf, g_extern.state_size);
-         state_manager_push(g_extern.state_manager, g_extern.state_buf);
+         int64_t start = ssnes_get_time_usec();
+         void *state = state_manager_get_buffer(g_extern.state_manager);
+         psnes_serialize((uint8_t*)state, g_extern.state_size);
+         state_manager_push_buffer(g_extern.state_manager, state);
+
+#ifdef HAVE_BSV_MOVIE
+         if (g_settings.rewind_adaptive && !g_extern.bsv.movie)
+#else
+         if (g_settings.rewind_adaptive)
+#endif
+            adapt_rewind_granularity(ssnes_get_time_usec() - start);
       }
    }
 
@@ -2323,18 +2728,29 @@ int ssnes_main_init(int argc, char *argv[])
 #ifdef HAVE_NETPLAY
    init_netplay();
 #endif
-   init_drivers();
+
+#ifdef HAVE_BSV_MOVIE
+   bool headless = g_extern.bsv.movie_headless;
+#else
+   bool headless = false;
+#endif
+
+   if (!headless)
+   {
+      init_drivers();
 
 #ifdef HAVE_NETPLAY
-   if (!g_extern.netplay)
+      if (!g_extern.netplay)
 #endif
-      init_rewind();
+         init_rewind();
+   }
       
    init_libsnes_cbs();
    init_controllers();
    
 #ifdef HAVE_FFMPEG
-   init_recording();
+   if (!headless)
+      init_recording();
 #endif
 
 #ifdef HAVE_NETPLAY
@@ -2342,6 +2758,8 @@ int ssnes_main_init(int argc, char *argv[])
 #else
    g_extern.use_sram = !g_extern.sram_save_disable;
 #endif
+   // Replaying a movie to check it shouldn't touch save files.
+   g_extern.use_sram &= !headless;
 
    if (!g_extern.use_sram)
       SSNES_LOG("SRAM will not be saved.\n");
@@ -2376,6 +2794,11 @@ error:
 
 bool ssnes_main_iterate(void)
 {
+#ifdef HAVE_BSV_MOVIE
+   if (g_extern.bsv.movie_headless)
+      return replay_iterate();
+#endif
+
 #ifdef HAVE_DYLIB
    // DSP plugin GUI events.
    if (g_extern.audio_data.dsp_handle && g_extern.audio_data.dsp_plugin->events)
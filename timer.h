@@ -0,0 +1,61 @@
+/*  SSNES - A frontend for libretro.
+ *  Copyright (C) 2010-2012 - Hans-Kristian Arntzen
+ *
+
+ * 
+ *  SSNES is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  SSNES is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with SSNES.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SSNES_TIMER_H
+#define __SSNES_TIMER_H
+
+#include <stdint.h>
+
+// Monotonic time in microseconds, for measuring how long things take.
+
+#if defined(_WIN32)
+#ifndef _XBOX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <xtl.h>
+#endif
+#elif defined(__CELLOS_LV2__)
+#include <sys/sys_time.h>
+#elif defined(__MACH__)
+#include <sys/time.h>
+#else
+#include <time.h>
+#endif
+
+static inline int64_t ssnes_get_time_usec(void)
+{
+#if defined(_WIN32)
+   LARGE_INTEGER freq, count;
+   QueryPerformanceFrequency(&freq);
+   QueryPerformanceCounter(&count);
+   return count.QuadPart * 1000000 / freq.QuadPart;
+#elif defined(__CELLOS_LV2__)
+   return sys_time_get_system_time();
+#elif defined(__MACH__) // OSX doesn't have clock_gettime ... :(
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+   struct timespec tv;
+   clock_gettime(CLOCK_MONOTONIC, &tv);
+   return (int64_t)tv.tv_sec * 1000000 + tv.tv_nsec / 1000;
+#endif
+}
+
+#endif
+
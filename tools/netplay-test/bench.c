@@ -0,0 +1,479 @@
+/*  SSNES - A frontend for libretro.
+ *  Copyright (C) 2010-2012 - Hans-Kristian Arntzen
+ *
+
+ * 
+ *  SSNES is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  SSNES is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with SSNES.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Benchmarks netplay rollback on one box. A host and a client are run in two processes,
+// and talk through a relay that delays, drops and reorders their input packets.
+// Both play a fake core with a large, churning state, and the inputs of a seeded pseudo player.
+// Each side reports frame times, rollbacks, stalls and prediction, and checks its final state against a local replay.
+
+#include "../../general.h"
+#include "../../netplay.h"
+#include "../../dynamic.h"
+#include "../../timer.h"
+#include "relay.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+struct settings g_settings;
+struct global g_extern;
+
+static uint32_t *core_state;
+static size_t core_words;
+static unsigned core_usec; // Extra time each frame takes to emulate.
+static uint32_t core_hash; // Last thing the core did, used to check that both sides ran the same frames.
+static uint32_t core_desync_frame; // If set, the core goes wrong on this frame, every time it's run.
+
+static uint16_t *inputs; // Two per frame.
+static unsigned total_frames;
+static unsigned local_frame;
+
+// Nobody presses anything for this long at the end, so both sides have the real input of the last frames.
+// A side that ended on a guess could otherwise differ from the replay for no fault of netplay.
+#define IDLE_FRAMES 300
+
+// Buttons are held and released for random stretches, like a person would.
+static void generate_inputs(unsigned seed)
+{
+   srand(seed);
+   for (unsigned port = 0; port < 2; port++)
+   {
+      uint16_t state = 0;
+      unsigned left[12] = {0};
+      for (unsigned frame = 0; frame < total_frames; frame++)
+      {
+         for (unsigned i = 0; i < 12; i++)
+         {
+            if (left[i]--)
+               continue;
+            state ^= 1 << i;
+            left[i] = (state & (1 << i)) ? 2 + rand() % 20 : 10 + rand() % 120;
+         }
+         inputs[frame * 2 + port] = frame && frame + IDLE_FRAMES < total_frames ? state : 0;
+      }
+   }
+}
+
+static void spin(unsigned usec)
+{
+   int64_t end = ssnes_get_time_usec() + usec;
+   while (ssnes_get_time_usec() < end);
+}
+
+static void core_run_input(uint16_t in0, uint16_t in1)
+{
+   uint32_t frame = core_state[0]++;
+   uint32_t h = frame * 2654435761u ^ ((uint32_t)in0 << 16 | in1);
+   for (unsigned i = 0; i < 256; i++)
+   {
+      h ^= h << 13;
+      h ^= h >> 17;
+      h ^= h << 5;
+      core_state[1 + h % (core_words - 1)] += h;
+   }
+   core_hash = h;
+
+   if (core_desync_frame && frame == core_desync_frame)
+      core_state[1] ^= 0x5a5a5a5a;
+
+   if (core_usec)
+      spin(core_usec);
+}
+
+static void core_run(void)
+{
+   input_poll_net();
+   uint16_t in[2] = {0};
+   for (unsigned port = 0; port < 2; port++)
+      for (unsigned id = 0; id < 12; id++)
+         in[port] |= (input_state_net(port, SNES_DEVICE_JOYPAD, 0, id) ? 1 : 0) << id;
+
+   core_run_input(in[0], in[1]);
+   video_frame_net(NULL, 256, 224);
+}
+
+static unsigned core_serialize_size(void) { return core_words * sizeof(uint32_t); }
+
+static bool core_serialize(uint8_t *data, unsigned size)
+{
+   memcpy(data, core_state, size);
+   return true;
+}
+
+static bool core_unserialize(const uint8_t *data, unsigned size)
+{
+   memcpy(core_state, data, size);
+   return true;
+}
+
+static const char *core_library_id(void) { return "netplay-bench"; }
+static unsigned core_revision(void) { return 0; }
+static uint8_t *core_memory_data(unsigned type) { (void)type; return NULL; }
+static unsigned core_memory_size(unsigned type) { (void)type; return 0; }
+static void core_set_input_state(snes_input_state_t cb) { (void)cb; }
+
+void (*psnes_run)(void) = core_run;
+unsigned (*psnes_serialize_size)(void) = core_serialize_size;
+bool (*psnes_serialize)(uint8_t*, unsigned) = core_serialize;
+bool (*psnes_unserialize)(const uint8_t*, unsigned) = core_unserialize;
+const char *(*psnes_library_id)(void) = core_library_id;
+unsigned (*psnes_library_revision_minor)(void) = core_revision;
+unsigned (*psnes_library_revision_major)(void) = core_revision;
+uint8_t *(*psnes_get_memory_data)(unsigned) = core_memory_data;
+unsigned (*psnes_get_memory_size)(unsigned) = core_memory_size;
+void (*psnes_set_input_state)(snes_input_state_t) = core_set_input_state;
+
+void lock_autosave(void) {}
+void unlock_autosave(void) {}
+
+static void video_cb(const uint16_t *data, unsigned width, unsigned height) { (void)data; (void)width; (void)height; }
+static void audio_cb(uint16_t left, uint16_t right) { (void)left; (void)right; }
+
+static int16_t input_cb(bool port, unsigned device, unsigned index, unsigned id)
+{
+   (void)device;
+   (void)index;
+   return (inputs[local_frame * 2 + port] >> id) & 1;
+}
+
+static uint32_t hash_state(void)
+{
+   uint32_t h = core_hash;
+   for (size_t i = 0; i < core_words; i++)
+      h = h * 31 + core_state[i];
+   return h;
+}
+
+// Input read on a frame takes effect input_delay frames later, on both sides.
+static uint32_t reference_hash(unsigned input_delay)
+{
+   memset(core_state, 0, core_words * sizeof(uint32_t));
+   for (unsigned i = 0; i < total_frames; i++)
+   {
+      if (i < input_delay)
+         core_run_input(0, 0);
+      else
+         core_run_input(inputs[(i - input_delay) * 2 + 0], inputs[(i - input_delay) * 2 + 1]);
+   }
+   uint32_t hash = hash_state();
+   memset(core_state, 0, core_words * sizeof(uint32_t));
+   core_hash = 0;
+   return hash;
+}
+
+static int compare_usec(const void *a_, const void *b_)
+{
+   int64_t a = *(const int64_t*)a_;
+   int64_t b = *(const int64_t*)b_;
+   return a < b ? -1 : a > b;
+}
+
+static void print_report(const char *name, const char *check, const struct netplay_stats *stats,
+      int64_t *frame_usec, unsigned frames, int64_t budget_usec)
+{
+   qsort(frame_usec, frames, sizeof(*frame_usec), compare_usec);
+   int64_t sum = 0;
+   unsigned over = 0;
+   for (unsigned i = 0; i < frames; i++)
+   {
+      sum += frame_usec[i];
+      if (budget_usec && frame_usec[i] > budget_usec)
+         over++;
+   }
+
+   printf("%s: %u frames, %s.\n", name, frames, check);
+   printf("\tFrame time: mean %.0f usec, p50 %u, p99 %u, max %u.", (double)sum / frames,
+         (unsigned)frame_usec[frames / 2], (unsigned)frame_usec[frames * 99 / 100], (unsigned)frame_usec[frames - 1]);
+   if (budget_usec)
+      printf(" %u frames over %u usec.", over, (unsigned)budget_usec);
+   printf("\n");
+
+   printf("\tRollbacks: %u, %.1f frames replayed and %.1f re-simulated on average, %.0f usec each.\n",
+         (unsigned)stats->rollbacks,
+         stats->rollbacks ? (double)stats->replayed_frames / stats->rollbacks : 0.0,
+         stats->rollbacks ? (double)stats->resimulated_frames / stats->rollbacks : 0.0,
+         stats->rollbacks ? (double)stats->replay_usec / stats->rollbacks : 0.0);
+   printf("\tStalls: %u frames, %.1f ms in total. Time sync waited out %u frames.\n",
+         (unsigned)stats->stalls, stats->stall_usec / 1000.0, (unsigned)stats->time_sync_frames);
+   printf("\tPrediction: right for %.1f %% of %u frames.\n",
+         stats->predicted_frames ? 100.0 * stats->prediction_hits / stats->predicted_frames : 100.0,
+         (unsigned)stats->predicted_frames);
+   printf("\tNetwork: RTT %.1f ms on average, %.2f %% of %u packets lost.\n",
+         stats->rtt_samples ? stats->rtt_usec_total / (1000.0 * stats->rtt_samples) : 0.0,
+         stats->packets ? 100.0 * stats->packets_lost / (stats->packets + stats->packets_lost) : 0.0,
+         (unsigned)(stats->packets + stats->packets_lost));
+   printf("\tDesync checks: %u, %u mismatched, %u resyncs.\n",
+         (unsigned)stats->desync_checks, (unsigned)stats->desyncs, (unsigned)stats->resyncs);
+   printf("\tSent: %u packets, %.1f bytes and %.1f frames of input each.\n",
+         (unsigned)stats->packets_sent,
+         stats->packets_sent ? (double)stats->bytes_sent / stats->packets_sent : 0.0,
+         stats->packets_sent ? (double)stats->frames_sent / stats->packets_sent : 0.0);
+   fflush(stdout);
+}
+
+// Returns the final state hash in hash. expected is only checked against if check is set.
+static bool run_side(bool client, uint16_t port, unsigned frames, double fps,
+      bool check, uint32_t expected, uint32_t *hash)
+{
+   struct snes_callbacks cbs = { video_cb, audio_cb, input_cb };
+   netplay_t *netplay = netplay_new(client ? "127.0.0.1" : NULL, port, frames, &cbs, false, client ? "client" : "host");
+   if (!netplay)
+   {
+      fprintf(stderr, "Failed to start netplay %s.\n", client ? "client" : "host");
+      return false;
+   }
+   g_extern.netplay = netplay;
+
+   int64_t *frame_usec = (int64_t*)calloc(total_frames, sizeof(int64_t));
+   if (!frame_usec)
+      return false;
+
+   int64_t budget = fps > 0.0 ? (int64_t)(1000000 / fps) : 0;
+   int64_t deadline = ssnes_get_time_usec();
+   for (local_frame = 0; local_frame < total_frames; local_frame++)
+   {
+      int64_t start = ssnes_get_time_usec();
+      netplay_pre_frame(netplay);
+      psnes_run();
+      netplay_post_frame(netplay);
+      int64_t end = ssnes_get_time_usec();
+      frame_usec[local_frame] = end - start;
+
+      if (!budget)
+         continue;
+
+      // Paced like vsync would. A late frame waits for the next vblank, so it costs a whole frame.
+      deadline += budget;
+      while (deadline < end)
+         deadline += budget;
+      poll(NULL, 0, (int)((deadline - end) / 1000));
+   }
+
+   struct netplay_stats stats;
+   netplay_get_stats(netplay, &stats);
+   *hash = hash_state();
+   bool matches = !check || *hash == expected;
+
+   netplay_free(netplay);
+   g_extern.netplay = NULL;
+
+   print_report(client ? "Client" : "Host",
+         !check ? "not checked against a local replay, input delay is automatic" :
+         matches ? "matches local replay" : "DIFFERS from local replay",
+         &stats, frame_usec, total_frames, budget);
+   free(frame_usec);
+   return matches;
+}
+
+static void print_help(const char *argv0)
+{
+   fprintf(stderr, "Usage: %s [options]\n", argv0);
+   fprintf(stderr, "\t-f <frames>: Netplay frame window (default: 8).\n");
+   fprintf(stderr, "\t-n <frames>: Frames to play, the last %u idle (default: 3600).\n", IDLE_FRAMES);
+   fprintf(stderr, "\t-d <ms>: One way delay (default: 30).\n");
+   fprintf(stderr, "\t-j <ms>: Jitter, delay varies by this much either way (default: 5).\n");
+   fprintf(stderr, "\t-l <percent>: Packet loss (default: 1).\n");
+   fprintf(stderr, "\t-o <percent>: Packets reordered (default: 0).\n");
+   fprintf(stderr, "\t-s <seed>: Seed for inputs and impairment (default: 1).\n");
+   fprintf(stderr, "\t-S <KiB>: Save state size (default: 256).\n");
+   fprintf(stderr, "\t-c <usec>: Extra time the core takes per frame (default: 0).\n");
+   fprintf(stderr, "\t-r <fps>: Frame rate, 0 runs as fast as possible (default: 60).\n");
+   fprintf(stderr, "\t-p <name>: Input prediction, see netplay_prediction (default: repeat).\n");
+   fprintf(stderr, "\t-D <frames>: Input delay, or the most automatic delay may pick (default: 0).\n");
+   fprintf(stderr, "\t-A: Pick input delay from round trip time.\n");
+   fprintf(stderr, "\t-T: Disable time sync.\n");
+   fprintf(stderr, "\t-C <frames>: Frames between desync checks, 0 disables them (default: 60).\n");
+   fprintf(stderr, "\t-X <frame>: Make the client's core go wrong on this frame, to test resync.\n");
+   fprintf(stderr, "\t-a <permille>: Run the client this much faster than the host (default: 0).\n");
+   fprintf(stderr, "\t-P <port>: Host port, the relay uses the one after it (default: 55435).\n");
+   fprintf(stderr, "\t-v: Verbose netplay logging.\n");
+}
+
+int main(int argc, char *argv[])
+{
+   unsigned frames = 8;
+   unsigned fps = 60;
+   unsigned state_kib = 256;
+   uint16_t port = 55435;
+   const char *prediction = "repeat";
+   bool time_sync = true;
+   unsigned client_permille = 0;
+   unsigned desync_frame = 0;
+   g_settings.netplay_check_frames = 60;
+   struct relay_config config = { 30, 5, 1, 0, 1 };
+   total_frames = 3600;
+
+   int c;
+   while ((c = getopt(argc, argv, "f:n:d:j:l:o:s:S:c:r:p:D:ATC:X:a:P:vh")) != -1)
+   {
+      switch (c)
+      {
+         case 'f':
+            frames = strtoul(optarg, NULL, 0);
+            break;
+         case 'n':
+            total_frames = strtoul(optarg, NULL, 0);
+            break;
+         case 'd':
+            config.delay_ms = strtoul(optarg, NULL, 0);
+            break;
+         case 'j':
+            config.jitter_ms = strtoul(optarg, NULL, 0);
+            break;
+         case 'l':
+            config.loss_percent = strtoul(optarg, NULL, 0);
+            break;
+         case 'o':
+            config.reorder_percent = strtoul(optarg, NULL, 0);
+            break;
+         case 's':
+            config.seed = strtoul(optarg, NULL, 0);
+            break;
+         case 'S':
+            state_kib = strtoul(optarg, NULL, 0);
+            break;
+         case 'c':
+            core_usec = strtoul(optarg, NULL, 0);
+            break;
+         case 'r':
+            fps = strtoul(optarg, NULL, 0);
+            break;
+         case 'p':
+            prediction = optarg;
+            break;
+         case 'D':
+            g_settings.netplay_input_delay = strtoul(optarg, NULL, 0);
+            break;
+         case 'A':
+            g_settings.netplay_input_delay_auto = true;
+            break;
+         case 'T':
+            time_sync = false;
+            break;
+         case 'C':
+            g_settings.netplay_check_frames = strtoul(optarg, NULL, 0);
+            break;
+         case 'X':
+            desync_frame = strtoul(optarg, NULL, 0);
+            break;
+         case 'a':
+            client_permille = strtoul(optarg, NULL, 0);
+            break;
+         case 'P':
+            port = strtoul(optarg, NULL, 0);
+            break;
+         case 'v':
+            g_extern.verbose = true;
+            break;
+         default:
+            print_help(argv[0]);
+            return c == 'h' ? 0 : 1;
+      }
+   }
+
+   if (total_frames <= IDLE_FRAMES || !state_kib)
+   {
+      print_help(argv[0]);
+      return 1;
+   }
+
+   strlcpy(g_settings.netplay_prediction, prediction, sizeof(g_settings.netplay_prediction));
+   g_settings.netplay_time_sync = time_sync;
+   g_extern.msg_queue = msg_queue_new(8);
+
+   core_words = (state_kib << 10) / sizeof(uint32_t);
+   core_state = (uint32_t*)calloc(core_words, sizeof(uint32_t));
+   inputs = (uint16_t*)calloc(total_frames * 2, sizeof(uint16_t));
+   if (!core_state || !inputs)
+      return 1;
+
+   generate_inputs(config.seed);
+   bool check = !g_settings.netplay_input_delay_auto;
+   unsigned input_delay = g_settings.netplay_input_delay < NETPLAY_MAX_INPUT_DELAY ?
+      g_settings.netplay_input_delay : NETPLAY_MAX_INPUT_DELAY;
+   uint32_t expected = reference_hash(input_delay);
+
+   printf("Netplay: %u frame window, %u KiB state, %u frames at %u fps.\n",
+         frames, state_kib, total_frames, fps);
+   printf("Relay: %u ms delay, %u ms jitter, %u %% loss, %u %% reordered, seed %u.\n",
+         config.delay_ms, config.jitter_ms, config.loss_percent, config.reorder_percent, config.seed);
+   fflush(stdout);
+
+   // Bound before forking, so the client can connect right away.
+   relay_t *relay = relay_new(port + 1, port, &config);
+   if (!relay)
+      return 1;
+
+   // The client hands its final state hash back, so both sides can be compared even when there is no replay to check against.
+   int fds[2];
+   if (pipe(fds) < 0)
+      return 1;
+
+   pid_t pid = fork();
+   if (pid < 0)
+      return 1;
+
+   if (pid == 0)
+   {
+      relay_free(relay);
+      close(fds[0]);
+      core_desync_frame = desync_frame;
+      uint32_t hash = 0;
+      bool ok = run_side(true, port + 1, frames, fps * (1000 + client_permille) / 1000.0, check, expected, &hash);
+      if (write(fds[1], &hash, sizeof(hash)) != sizeof(hash))
+         ok = false;
+      close(fds[1]);
+      return ok ? 0 : 1;
+   }
+   close(fds[1]);
+
+   if (!relay_start(relay))
+   {
+      fprintf(stderr, "Failed to start relay.\n");
+      return 1;
+   }
+
+   uint32_t hash = 0, client_hash = 0;
+   bool ok = run_side(false, port, frames, fps, check, expected, &hash);
+
+   bool got_hash = read(fds[0], &client_hash, sizeof(client_hash)) == sizeof(client_hash);
+   close(fds[0]);
+   int status = 0;
+   waitpid(pid, &status, 0);
+   ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+   bool synced = got_hash && client_hash == hash;
+   printf("Host and client are %s.\n", synced ? "in sync" : "DESYNCED");
+   ok = ok && synced;
+
+   struct relay_stats stats;
+   relay_get_stats(relay, &stats);
+   relay_free(relay);
+   printf("Relay: %u packets, %u dropped, %u reordered.\n",
+         (unsigned)stats.packets, (unsigned)stats.dropped, (unsigned)stats.reordered);
+
+   msg_queue_free(g_extern.msg_queue);
+   free(core_state);
+   free(inputs);
+   return ok ? 0 : 1;
+}
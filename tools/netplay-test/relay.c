@@ -0,0 +1,348 @@
+/*  SSNES - A frontend for libretro.
+ *  Copyright (C) 2010-2012 - Hans-Kristian Arntzen
+ *
+
+ * 
+ *  SSNES is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  SSNES is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with SSNES.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "relay.h"
+#include "../../thread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define RELAY_MAX_PACKET 2048
+// Packets in flight in both directions. Anything past this is dropped, like a full router queue would.
+#define RELAY_QUEUE_SIZE 1024
+#define RELAY_POLL_MS 10
+#define RELAY_CONNECT_TRIES 100
+
+struct relay_packet
+{
+   int64_t release_usec;
+   int fd; // Socket to send it from.
+   struct sockaddr_in to;
+   size_t size;
+   uint8_t data[RELAY_MAX_PACKET];
+};
+
+struct relay
+{
+   struct relay_config config;
+   uint16_t host_port;
+   uint32_t random;
+
+   int tcp_listen;
+   int tcp_client;
+   int tcp_host;
+   int udp_front; // Talks to the client.
+   int udp_back; // Talks to the host.
+
+   struct sockaddr_in client_addr;
+   bool has_client_addr;
+   struct sockaddr_in host_addr;
+
+   struct relay_packet *queue;
+   size_t queue_size;
+
+   struct relay_stats stats;
+
+   sthread_t *thread;
+   volatile bool quit;
+};
+
+static int64_t relay_time_usec(void)
+{
+   struct timespec tv;
+   clock_gettime(CLOCK_MONOTONIC, &tv);
+   return (int64_t)tv.tv_sec * 1000000 + tv.tv_nsec / 1000;
+}
+
+// The relay has its own generator, so a seed gives the same impairment no matter what else calls rand().
+static unsigned relay_rand(relay_t *relay, unsigned range)
+{
+   uint32_t x = relay->random;
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   relay->random = x;
+   return range ? x % range : 0;
+}
+
+static struct sockaddr_in loopback_addr(uint16_t port)
+{
+   struct sockaddr_in addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(port);
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   return addr;
+}
+
+static int bind_socket(int type, uint16_t port)
+{
+   int fd = socket(AF_INET, type, 0);
+   if (fd < 0)
+      return -1;
+
+   int yes = 1;
+   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+   struct sockaddr_in addr = loopback_addr(port);
+   if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+         (type == SOCK_STREAM && listen(fd, 1) < 0))
+   {
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+relay_t *relay_new(uint16_t port, uint16_t host_port, const struct relay_config *config)
+{
+   relay_t *relay = (relay_t*)calloc(1, sizeof(*relay));
+   if (!relay)
+      return NULL;
+
+   relay->config = *config;
+   relay->random = config->seed ? config->seed : 1;
+   relay->host_port = host_port;
+   relay->host_addr = loopback_addr(host_port);
+   relay->tcp_client = -1;
+   relay->tcp_host = -1;
+
+   relay->queue = (struct relay_packet*)calloc(RELAY_QUEUE_SIZE, sizeof(*relay->queue));
+   relay->tcp_listen = bind_socket(SOCK_STREAM, port);
+   relay->udp_front = bind_socket(SOCK_DGRAM, port);
+   relay->udp_back = bind_socket(SOCK_DGRAM, 0);
+   if (!relay->queue || relay->tcp_listen < 0 || relay->udp_front < 0 || relay->udp_back < 0)
+   {
+      fprintf(stderr, "Relay failed to bind port %u.\n", (unsigned)port);
+      relay_free(relay);
+      return NULL;
+   }
+
+   return relay;
+}
+
+// The host might still be starting up when the client connects.
+static int connect_host(relay_t *relay)
+{
+   for (unsigned i = 0; i < RELAY_CONNECT_TRIES && !relay->quit; i++)
+   {
+      int fd = socket(AF_INET, SOCK_STREAM, 0);
+      if (fd < 0)
+         return -1;
+
+      if (connect(fd, (const struct sockaddr*)&relay->host_addr, sizeof(relay->host_addr)) == 0)
+         return fd;
+
+      close(fd);
+      poll(NULL, 0, 50);
+   }
+   return -1;
+}
+
+static void schedule_packet(relay_t *relay, int fd, const struct sockaddr_in *to, const uint8_t *data, size_t size)
+{
+   relay->stats.packets++;
+   if (relay_rand(relay, 100) < relay->config.loss_percent || relay->queue_size >= RELAY_QUEUE_SIZE)
+   {
+      relay->stats.dropped++;
+      return;
+   }
+
+   int64_t delay = relay->config.delay_ms * 1000;
+   if (relay->config.jitter_ms)
+      delay += (int64_t)relay_rand(relay, 2 * relay->config.jitter_ms * 1000 + 1) - relay->config.jitter_ms * 1000;
+
+   // Held back for longer than jitter alone could, so it arrives after packets sent after it.
+   if (relay_rand(relay, 100) < relay->config.reorder_percent)
+   {
+      delay += (2 * relay->config.jitter_ms + 1) * 1000;
+      relay->stats.reordered++;
+   }
+
+   if (delay < 0)
+      delay = 0;
+
+   struct relay_packet *packet = &relay->queue[relay->queue_size++];
+   packet->release_usec = relay_time_usec() + delay;
+   packet->fd = fd;
+   packet->to = *to;
+   packet->size = size;
+   memcpy(packet->data, data, size);
+}
+
+// Sends every packet that is due. Returns ms until the next one is, or RELAY_POLL_MS.
+static int send_due_packets(relay_t *relay)
+{
+   int64_t now = relay_time_usec();
+   int64_t next = now + RELAY_POLL_MS * 1000;
+
+   for (size_t i = 0; i < relay->queue_size; )
+   {
+      struct relay_packet *packet = &relay->queue[i];
+      if (packet->release_usec <= now)
+      {
+         sendto(packet->fd, packet->data, packet->size, 0, (const struct sockaddr*)&packet->to, sizeof(packet->to));
+         *packet = relay->queue[--relay->queue_size];
+         continue;
+      }
+
+      if (packet->release_usec < next)
+         next = packet->release_usec;
+      i++;
+   }
+
+   return (int)((next - now + 999) / 1000);
+}
+
+static void receive_packet(relay_t *relay, int fd)
+{
+   uint8_t data[RELAY_MAX_PACKET];
+   struct sockaddr_in from;
+   socklen_t len = sizeof(from);
+   ssize_t ret = recvfrom(fd, data, sizeof(data), 0, (struct sockaddr*)&from, &len);
+   if (ret <= 0)
+      return;
+
+   if (fd == relay->udp_front)
+   {
+      relay->client_addr = from;
+      relay->has_client_addr = true;
+      schedule_packet(relay, relay->udp_back, &relay->host_addr, data, ret);
+   }
+   else if (relay->has_client_addr)
+      schedule_packet(relay, relay->udp_front, &relay->client_addr, data, ret);
+}
+
+static bool forward_stream(int from, int to)
+{
+   uint8_t data[4096];
+   ssize_t ret = recv(from, data, sizeof(data), 0);
+   if (ret <= 0)
+      return false;
+
+   for (ssize_t sent = 0; sent < ret; )
+   {
+      ssize_t now = send(to, data + sent, ret - sent, 0);
+      if (now <= 0)
+         return false;
+      sent += now;
+   }
+   return true;
+}
+
+static void close_stream(relay_t *relay)
+{
+   if (relay->tcp_client >= 0)
+      close(relay->tcp_client);
+   if (relay->tcp_host >= 0)
+      close(relay->tcp_host);
+   relay->tcp_client = -1;
+   relay->tcp_host = -1;
+}
+
+static void relay_thread(void *data)
+{
+   relay_t *relay = (relay_t*)data;
+
+   while (!relay->quit)
+   {
+      int timeout = send_due_packets(relay);
+
+      struct pollfd fds[4];
+      memset(fds, 0, sizeof(fds));
+      fds[0].fd = relay->udp_front;
+      fds[1].fd = relay->udp_back;
+      fds[2].fd = relay->tcp_client >= 0 ? relay->tcp_client : relay->tcp_listen;
+      fds[3].fd = relay->tcp_host;
+      for (unsigned i = 0; i < 4; i++)
+         fds[i].events = POLLIN;
+
+      if (poll(fds, 4, timeout) < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         break;
+      }
+
+      if (fds[0].revents & POLLIN)
+         receive_packet(relay, relay->udp_front);
+      if (fds[1].revents & POLLIN)
+         receive_packet(relay, relay->udp_back);
+
+      if (relay->tcp_client < 0)
+      {
+         if (fds[2].revents & POLLIN)
+         {
+            relay->tcp_client = accept(relay->tcp_listen, NULL, NULL);
+            if (relay->tcp_client >= 0 && (relay->tcp_host = connect_host(relay)) < 0)
+            {
+               fprintf(stderr, "Relay couldn't reach the host on port %u.\n", (unsigned)relay->host_port);
+               close_stream(relay);
+            }
+         }
+         continue;
+      }
+
+      if ((fds[2].revents & (POLLIN | POLLHUP | POLLERR)) && !forward_stream(relay->tcp_client, relay->tcp_host))
+         close_stream(relay);
+      else if ((fds[3].revents & (POLLIN | POLLHUP | POLLERR)) && !forward_stream(relay->tcp_host, relay->tcp_client))
+         close_stream(relay);
+   }
+}
+
+bool relay_start(relay_t *relay)
+{
+   relay->thread = sthread_create(relay_thread, relay);
+   return relay->thread;
+}
+
+// Counters are updated by the relay thread, read them once the session is over.
+void relay_get_stats(relay_t *relay, struct relay_stats *stats)
+{
+   *stats = relay->stats;
+}
+
+void relay_free(relay_t *relay)
+{
+   if (!relay)
+      return;
+
+   if (relay->thread)
+   {
+      relay->quit = true;
+      sthread_join(relay->thread);
+   }
+
+   close_stream(relay);
+   if (relay->tcp_listen >= 0)
+      close(relay->tcp_listen);
+   if (relay->udp_front >= 0)
+      close(relay->udp_front);
+   if (relay->udp_back >= 0)
+      close(relay->udp_back);
+
+   free(relay->queue);
+   free(relay);
+}
@@ -0,0 +1,52 @@
+/*  SSNES - A frontend for libretro.
+ *  Copyright (C) 2010-2012 - Hans-Kristian Arntzen
+ *
+
+ * 
+ *  SSNES is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  SSNES is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with SSNES.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __NETPLAY_TEST_RELAY_H
+#define __NETPLAY_TEST_RELAY_H
+
+#include <stdint.h>
+#include "../../boolean.h"
+
+// Forwards a netplay session between a client and a host on the same box.
+// The client connects to the relay's port. UDP input packets are delayed, dropped and reordered
+// on the way in both directions, while the TCP connection is forwarded as is.
+typedef struct relay relay_t;
+
+struct relay_config
+{
+   unsigned delay_ms; // One way.
+   unsigned jitter_ms; // Delay varies by up to this much either way.
+   unsigned loss_percent;
+   unsigned reorder_percent; // Packets held back behind the ones sent after them.
+   unsigned seed;
+};
+
+struct relay_stats
+{
+   uint64_t packets;
+   uint64_t dropped;
+   uint64_t reordered;
+};
+
+// Binds the relay's sockets, so clients can connect before relay_start().
+relay_t *relay_new(uint16_t port, uint16_t host_port, const struct relay_config *config);
+bool relay_start(relay_t *relay);
+void relay_get_stats(relay_t *relay, struct relay_stats *stats);
+void relay_free(relay_t *relay);
+
+#endif
+
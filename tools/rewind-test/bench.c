@@ -0,0 +1,334 @@
+/*  SSNES - A frontend for libretro.
+ *  Copyright (C) 2010-2012 - Hans-Kristian Arntzen
+ *
+
+ * 
+ *  SSNES is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  SSNES is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with SSNES.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Microbenchmark for the rewind state manager.
+// Pushes synthetic states of varying size and change density through state_manager_push()
+// and reports the cost per frame. Popped states are verified against the pushed ones.
+// Also checks that running out of room for the spill file, or reaching its size limit, leaves a usable history.
+
+#include "../../rewind.h"
+#include "../../boolean.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#define FRAMES 600
+#define VERIFY_FRAMES 64
+#define KEYFRAME_INTERVAL 16
+
+static double get_time(void)
+{
+   struct timespec tv;
+   clock_gettime(CLOCK_MONOTONIC, &tv);
+   return tv.tv_sec + tv.tv_nsec / 1000000000.0;
+}
+
+// Changes roughly density * words words. Changes come in short bursts,
+// which is closer to how real save states churn than uniform noise.
+static void mutate_state(uint32_t *state, size_t words, double density)
+{
+   size_t changes = (size_t)(words * density);
+   while (changes)
+   {
+      size_t run = 1 + rand() % 16;
+      if (run > changes)
+         run = changes;
+
+      size_t start = (size_t)rand() % words;
+      for (size_t i = 0; i < run && start + i < words; i++)
+         state[start + i] += 1 + (rand() & 0xff);
+
+      changes -= run;
+   }
+}
+
+static bool run_bench(size_t state_size, double density, size_t buffer_size, bool async)
+{
+   size_t words = state_size / sizeof(uint32_t);
+   uint32_t *state = (uint32_t*)calloc(words, sizeof(uint32_t));
+   uint32_t *history = (uint32_t*)calloc(words * VERIFY_FRAMES, sizeof(uint32_t));
+   if (!state || !history)
+      return false;
+
+   for (size_t i = 0; i < words; i++)
+      state[i] = rand();
+
+   state_manager_t *manager = state_manager_new(state_size, buffer_size, state);
+   if (!manager)
+   {
+      fprintf(stderr, "Failed to create state manager.\n");
+      return false;
+   }
+
+   state_manager_set_keyframe_interval(manager, KEYFRAME_INTERVAL);
+
+   if (async && !state_manager_init_async(manager, 4))
+   {
+      fprintf(stderr, "Failed to start async state manager.\n");
+      return false;
+   }
+
+   double total = 0.0;
+   for (unsigned frame = 0; frame < FRAMES; frame++)
+   {
+      mutate_state(state, words, density);
+      if (frame >= FRAMES - VERIFY_FRAMES)
+         memcpy(history + (frame - (FRAMES - VERIFY_FRAMES)) * words, state, state_size);
+
+      double start = get_time();
+      if (async)
+      {
+         void *buf = state_manager_get_buffer(manager);
+         memcpy(buf, state, state_size);
+         state_manager_push_buffer(manager, buf);
+      }
+      else
+         state_manager_push(manager, state);
+      total += get_time() - start;
+   }
+
+   // A small buffer might not hold all verify frames, but it must hold at least the newest one.
+   // In async mode, the newest pushes are typically still in flight here.
+   // Jumps of varying length are mixed in to exercise keyframe seeking.
+   bool ok = true;
+   unsigned popped = 0;
+   int frame = VERIFY_FRAMES - 1;
+   unsigned step = 1;
+   while (frame >= 0)
+   {
+      // Only the first pop hands back the newest state, jumps go back from there.
+      void *data;
+      bool ret = popped ? state_manager_pop_frames(manager, step, &data) == step : state_manager_pop(manager, &data);
+      if (!ret)
+      {
+         ok = popped > 0;
+         break;
+      }
+
+      if (memcmp(data, history + frame * words, state_size))
+      {
+         ok = false;
+         break;
+      }
+
+      popped++;
+      step = 1 + popped % 5;
+      frame -= step;
+   }
+
+   printf("%8u KiB | %6.2f %% changed | %4u MiB buffer | %s | %8.2f us/push | %2u pops verified | %s\n",
+         (unsigned)(state_size >> 10), density * 100.0, (unsigned)(buffer_size >> 20), async ? "async" : " sync",
+         1000000.0 * total / FRAMES, popped, ok ? "OK" : "MISMATCH");
+
+   state_manager_free(manager);
+   free(state);
+   free(history);
+   return ok;
+}
+
+#define SPILL_LIMIT_STATE_SIZE (64 << 10)
+#define SPILL_LIMIT_FRAMES 800
+
+// The spill file starts out at 16 MiB. Capping file sizes below where it has to grow makes growing it fail.
+static bool run_spill_limit(void)
+{
+   size_t words = SPILL_LIMIT_STATE_SIZE / sizeof(uint32_t);
+   uint32_t *history = (uint32_t*)calloc(words * SPILL_LIMIT_FRAMES, sizeof(uint32_t));
+   if (!history)
+      return false;
+
+   char path[] = "/tmp/rewind-bench-spill-XXXXXX";
+   int fd = mkstemp(path);
+   if (fd < 0)
+   {
+      fprintf(stderr, "Failed to create spill file.\n");
+      free(history);
+      return false;
+   }
+   close(fd);
+   unlink(path);
+
+   struct rlimit old_limit, limit;
+   getrlimit(RLIMIT_FSIZE, &old_limit);
+   limit = old_limit;
+   limit.rlim_cur = 24 << 20;
+   void (*old_handler)(int) = signal(SIGXFSZ, SIG_IGN);
+   setrlimit(RLIMIT_FSIZE, &limit);
+
+   for (size_t i = 0; i < words; i++)
+      history[i] = rand();
+
+   bool ok = false;
+   unsigned popped = 0;
+   struct state_manager_stats stats = {0};
+   state_manager_t *manager = state_manager_new(SPILL_LIMIT_STATE_SIZE, 4 << 20, history);
+   if (!manager || !state_manager_init_spill(manager, path, 256 << 20))
+   {
+      fprintf(stderr, "Failed to set up state manager with spill file.\n");
+      goto end;
+   }
+   state_manager_set_keyframe_interval(manager, KEYFRAME_INTERVAL);
+
+   for (unsigned frame = 1; frame < SPILL_LIMIT_FRAMES; frame++)
+   {
+      uint32_t *state = history + frame * words;
+      memcpy(state, state - words, SPILL_LIMIT_STATE_SIZE);
+      mutate_state(state, words, 0.5);
+      state_manager_push(manager, state);
+   }
+
+   state_manager_get_stats(manager, &stats);
+
+   // Every pop has to match, until the history runs out.
+   ok = stats.spill_frames == 0;
+   void *data;
+   int frame = SPILL_LIMIT_FRAMES - 1;
+   while (ok && frame >= 0 && state_manager_pop(manager, &data))
+   {
+      ok = !memcmp(data, history + frame * words, SPILL_LIMIT_STATE_SIZE);
+      frame--;
+      popped++;
+   }
+   ok &= popped > 0;
+
+end:
+   printf("Spill file out of room | %4u states in history | %3u pops verified | %s\n",
+         (unsigned)stats.frames, popped, ok ? "OK" : "MISMATCH");
+
+   if (manager)
+      state_manager_free(manager);
+   setrlimit(RLIMIT_FSIZE, &old_limit);
+   signal(SIGXFSZ, old_handler);
+   unlink(path);
+   free(history);
+   return ok;
+}
+
+#define SPILL_SIZE_LIMIT (3 << 20)
+
+// Pushes more history than fits in the spill file, which then wraps around and drops the oldest records.
+// The file is reopened by a second state manager, which continues from its first state, to check that it's read back.
+static bool run_spill_size(void)
+{
+   size_t words = SPILL_LIMIT_STATE_SIZE / sizeof(uint32_t);
+   uint32_t *history = (uint32_t*)calloc(words * (SPILL_LIMIT_FRAMES + 1), sizeof(uint32_t));
+   if (!history)
+      return false;
+
+   char path[] = "/tmp/rewind-bench-spill-XXXXXX";
+   int fd = mkstemp(path);
+   if (fd < 0)
+   {
+      fprintf(stderr, "Failed to create spill file.\n");
+      free(history);
+      return false;
+   }
+   close(fd);
+   unlink(path);
+
+   for (size_t i = 0; i < words; i++)
+      history[i] = rand();
+
+   bool ok = false;
+   unsigned popped = 0;
+   struct state_manager_stats stats = {0};
+   struct stat st = {0};
+   state_manager_t *manager = state_manager_new(SPILL_LIMIT_STATE_SIZE, 4 << 20, history);
+   if (!manager || !state_manager_init_spill(manager, path, SPILL_SIZE_LIMIT))
+   {
+      fprintf(stderr, "Failed to set up state manager with spill file.\n");
+      goto end;
+   }
+   state_manager_set_keyframe_interval(manager, KEYFRAME_INTERVAL);
+
+   for (unsigned frame = 1; frame < SPILL_LIMIT_FRAMES; frame++)
+   {
+      uint32_t *state = history + frame * words;
+      memcpy(state, state - words, SPILL_LIMIT_STATE_SIZE);
+      mutate_state(state, words, 0.5);
+      state_manager_push(manager, state);
+   }
+
+   state_manager_get_stats(manager, &stats);
+   ok = stats.spill_evictions > 0 && stats.spill_bytes <= SPILL_SIZE_LIMIT;
+
+   // Closing spills the whole ring and the current state, so the file ends up full.
+   state_manager_free(manager);
+   manager = NULL;
+   ok &= stat(path, &st) == 0 && st.st_size <= SPILL_SIZE_LIMIT;
+
+   uint32_t *next = history + SPILL_LIMIT_FRAMES * words;
+   for (size_t i = 0; i < words; i++)
+      next[i] = rand();
+   manager = state_manager_new(SPILL_LIMIT_STATE_SIZE, 4 << 20, next);
+   if (!manager || !state_manager_init_spill(manager, path, SPILL_SIZE_LIMIT))
+   {
+      fprintf(stderr, "Failed to reopen spill file.\n");
+      ok = false;
+      goto end;
+   }
+
+   // Nothing has been pushed yet, so popping goes straight back into the previous session, starting from its last state.
+   state_manager_get_stats(manager, &stats);
+   ok &= stats.spill_frames > 0;
+   void *data;
+   int frame = SPILL_LIMIT_FRAMES - 1;
+   while (ok && frame >= 0 && state_manager_pop(manager, &data))
+   {
+      ok = !memcmp(data, history + frame * words, SPILL_LIMIT_STATE_SIZE);
+      frame--;
+      popped++;
+   }
+   ok &= popped == stats.spill_frames;
+
+end:
+   printf("Spill file size limit | %4u states in file | %3u pops verified | %s\n",
+         (unsigned)stats.spill_frames, popped, ok ? "OK" : "MISMATCH");
+
+   if (manager)
+      state_manager_free(manager);
+   unlink(path);
+   free(history);
+   return ok;
+}
+
+int main(void)
+{
+   static const size_t sizes[] = { 64 << 10, 256 << 10, 320 << 10, 1024 << 10 };
+   static const double densities[] = { 0.0, 0.001, 0.01, 0.1, 0.5 };
+   static const size_t buffer_sizes[] = { 8 << 20, 256 << 20 };
+
+   srand(0);
+
+   bool ok = true;
+   for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+      for (unsigned d = 0; d < sizeof(densities) / sizeof(densities[0]); d++)
+         for (unsigned b = 0; b < sizeof(buffer_sizes) / sizeof(buffer_sizes[0]); b++)
+            for (unsigned async = 0; async < 2; async++)
+               ok &= run_bench(sizes[s], densities[d], buffer_sizes[b], async);
+
+   ok &= run_spill_limit();
+   ok &= run_spill_size();
+
+   return ok ? 0 : 1;
+}
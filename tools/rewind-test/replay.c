@@ -0,0 +1,233 @@
+/*  SSNES - A frontend for libretro.
+ *  Copyright (C) 2010-2012 - Hans-Kristian Arntzen
+ *
+
+ * 
+ *  SSNES is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  SSNES is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with SSNES.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Replays a recorded sequence of save states through the rewind state manager and prints throughput.
+// States are raw serialized states, e.g. SSNES .state files. A file holding several
+// concatenated states is split up with -s. Used to compare encodings and buffer sizes offline.
+
+#include "../../rewind.h"
+#include "../../timer.h"
+#include "../../boolean.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+
+static uint8_t *states;
+static size_t num_states;
+static size_t state_size;
+
+static bool load_states(const char *path)
+{
+   FILE *file = fopen(path, "rb");
+   if (!file)
+   {
+      fprintf(stderr, "Couldn't open \"%s\".\n", path);
+      return false;
+   }
+
+   fseek(file, 0, SEEK_END);
+   long len = ftell(file);
+   rewind(file);
+
+   if (!state_size)
+      state_size = len;
+
+   if (len <= 0 || len % state_size)
+   {
+      fprintf(stderr, "\"%s\" is not a multiple of the state size (%u bytes).\n", path, (unsigned)state_size);
+      fclose(file);
+      return false;
+   }
+
+   // Pad to 4 bytes, same as the frontend does.
+   size_t aligned_size = (state_size + 3) & ~3;
+   size_t count = len / state_size;
+   uint8_t *new_states = (uint8_t*)realloc(states, (num_states + count) * aligned_size);
+   if (!new_states)
+   {
+      fclose(file);
+      return false;
+   }
+   states = new_states;
+
+   for (size_t i = 0; i < count; i++, num_states++)
+   {
+      uint8_t *state = states + num_states * aligned_size;
+      memset(state, 0, aligned_size);
+      if (fread(state, 1, state_size, file) != state_size)
+      {
+         fclose(file);
+         return false;
+      }
+   }
+
+   fclose(file);
+   return true;
+}
+
+static void print_help(const char *argv0)
+{
+   fprintf(stderr, "Usage: %s [options] <states>...\n", argv0);
+   fprintf(stderr, "\t-b <MiB>: Rewind buffer size (default: 20).\n");
+   fprintf(stderr, "\t-s <bytes>: State size, to split files holding several states (default: size of first file).\n");
+   fprintf(stderr, "\t-k <states>: Keyframe interval (default: 600, 0 disables).\n");
+   fprintf(stderr, "\t-r <count>: Replay the sequence this many times (default: 1).\n");
+   fprintf(stderr, "\t-a: Push asynchronously on a worker thread.\n");
+   fprintf(stderr, "\t-f <path>: Spill evicted history to this file. It should not exist beforehand.\n");
+   fprintf(stderr, "\t-m <MiB>: Size limit of the spill file (default: 1024).\n");
+}
+
+int main(int argc, char *argv[])
+{
+   size_t buffer_size = 20 << 20;
+   unsigned keyframe_interval = 600;
+   unsigned repeat = 1;
+   bool async = false;
+   const char *spill_path = NULL;
+   size_t spill_size = (size_t)1024 << 20;
+
+   int c;
+   while ((c = getopt(argc, argv, "b:s:k:r:af:m:h")) != -1)
+   {
+      switch (c)
+      {
+         case 'b':
+            buffer_size = (size_t)strtoul(optarg, NULL, 0) << 20;
+            break;
+         case 's':
+            state_size = strtoul(optarg, NULL, 0);
+            break;
+         case 'k':
+            keyframe_interval = strtoul(optarg, NULL, 0);
+            break;
+         case 'r':
+            repeat = strtoul(optarg, NULL, 0);
+            break;
+         case 'a':
+            async = true;
+            break;
+         case 'f':
+            spill_path = optarg;
+            break;
+         case 'm':
+            spill_size = (size_t)strtoul(optarg, NULL, 0) << 20;
+            break;
+         default:
+            print_help(argv[0]);
+            return 1;
+      }
+   }
+
+   if (optind >= argc || !repeat)
+   {
+      print_help(argv[0]);
+      return 1;
+   }
+
+   for (int i = optind; i < argc; i++)
+      if (!load_states(argv[i]))
+         return 1;
+
+   size_t aligned_size = (state_size + 3) & ~3;
+   state_manager_t *manager = state_manager_new(aligned_size, buffer_size, states);
+   if (!manager)
+   {
+      fprintf(stderr, "Failed to create state manager. Buffer must be larger than 4 states.\n");
+      return 1;
+   }
+
+   state_manager_set_keyframe_interval(manager, keyframe_interval);
+#ifdef HAVE_MMAP
+   if (spill_path && !state_manager_init_spill(manager, spill_path, spill_size))
+      return 1;
+#else
+   (void)spill_path;
+   (void)spill_size;
+#endif
+#ifdef HAVE_THREADS
+   if (async && !state_manager_init_async(manager, 4))
+      return 1;
+#else
+   (void)async;
+#endif
+
+   int64_t start = ssnes_get_time_usec();
+   size_t pushes = 0;
+   for (unsigned r = 0; r < repeat; r++)
+   {
+      for (size_t i = 0; i < num_states; i++, pushes++)
+      {
+         void *buf = state_manager_get_buffer(manager);
+         memcpy(buf, states + i * aligned_size, aligned_size);
+         state_manager_push_buffer(manager, buf);
+      }
+   }
+
+   struct state_manager_stats stats;
+   state_manager_flush(manager);
+   state_manager_get_stats(manager, &stats);
+   double push_time = (ssnes_get_time_usec() - start) / 1000000.0;
+
+   printf("Pushed %u states of %u bytes in %.3f s: %.1f states/s, %.1f MB/s.\n",
+         (unsigned)pushes, (unsigned)state_size, push_time,
+         pushes / push_time, pushes * state_size / (push_time * 1000000.0));
+   printf("  %.1f bytes per state (%.2f %% of state size), peak %u bytes.\n",
+         (double)stats.pushed_bytes / stats.pushes, 100.0 * stats.pushed_bytes / (stats.pushes * aligned_size),
+         (unsigned)stats.peak_record_size);
+   printf("  Push: %.1f usec average, %u usec peak.\n",
+         (double)stats.push_usec_total / stats.pushes, (unsigned)stats.push_usec_peak);
+   printf("  History: %u states, %u keyframes, %u evicted, %u of %u KiB used.\n",
+         (unsigned)stats.frames, (unsigned)stats.keyframes, (unsigned)stats.evictions,
+         (unsigned)(stats.buffer_used >> 10), (unsigned)(stats.buffer_size >> 10));
+   if (stats.spill_frames)
+   {
+      printf("  Spilled: %u states, %u KiB, %u dropped to stay within the size limit.\n",
+            (unsigned)stats.spill_frames, (unsigned)(stats.spill_bytes >> 10), (unsigned)stats.spill_evictions);
+   }
+
+   // Pop back through the whole history, verifying against the recorded states.
+   // Popping past the first push yields the initial state, which is the first recorded state.
+   long index = pushes - 1;
+   size_t mismatches = 0;
+   void *data;
+   start = ssnes_get_time_usec();
+   size_t pops = 0;
+   while (state_manager_pop(manager, &data))
+   {
+      const uint8_t *expected = index >= 0 ? states + (index % num_states) * aligned_size : states;
+      if (memcmp(data, expected, aligned_size))
+         mismatches++;
+      index--;
+      pops++;
+   }
+   double pop_time = (ssnes_get_time_usec() - start) / 1000000.0;
+
+   state_manager_get_stats(manager, &stats);
+   printf("Popped %u states in %.3f s: %.1f states/s, %u mismatches.\n",
+         (unsigned)pops, pop_time, pops / pop_time, (unsigned)mismatches);
+   if (stats.pops)
+   {
+      printf("  Pop: %.1f usec average, %u usec peak.\n",
+            (double)stats.pop_usec_total / stats.pops, (unsigned)stats.pop_usec_peak);
+   }
+
+   state_manager_free(manager);
+   free(states);
+   return mismatches ? 1 : 0;
+}
@@ -105,6 +105,7 @@ static struct bind binds[] = {
    MISC_BIND("Audio mute/unmute", audio_mute)
    MISC_BIND("Netplay player flip", netplay_flip_players)
    MISC_BIND("Slow motion", slowmotion)
+   MISC_BIND("Rewind jump", rewind_jump)
 };
 
 static void get_binds(config_file_t *conf, int player, int joypad)